@@ -7,67 +7,466 @@
 #include <algorithm>
 #include <numeric>
 #include <thread>
+#include <barrier>
+#include <array>
+#include <utility>
+#include <cstdint>
+#include <type_traits>
+#include <random>
+#include <limits>
+#include <cstring>
 #include <omp.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 
 #define RUNS 500  // The number of runs to average the results over.
 #define SIZE 512  // The size of the matrix.
 #define THREAD_COUNT 16  // The number of threads to use.
 
+#define PACKED_MULTIPLY  // If the packed panel multiply should be used instead of the transposed dot product one
+
+// Block sizes for the packed multiply, each one chosen so its working set stays inside a cache level.
+#define L1_BLOCK 256  // Depth of the shared dimension, keeps a MICRO_COLS wide strip of the second matrix in L1.
+#define L2_BLOCK 128  // Rows of the first matrix, keeps an L2_BLOCK x L1_BLOCK block of it in L2.
+#define L3_BLOCK 1024  // Columns of the second matrix, keeps an L1_BLOCK x L3_BLOCK panel of it in L3.
+
+// Size of the block of the result matrix that the micro-kernel keeps in registers.
+#define MICRO_ROWS 4
+#define MICRO_COLS 8
+
+static_assert(L2_BLOCK % MICRO_ROWS == 0 && L3_BLOCK % MICRO_COLS == 0, "Blocks must be made of whole micro-blocks");
+
+// Sizes for the cache-oblivious transpose.
+#define TRANSPOSE_TILE 8  // Size of the square tiles transposed in registers, a tile of ints fills 8 AVX2 registers.
+#define TRANSPOSE_LEAF 64  // Size of the blocks the recursive transpose stops splitting at.
+
+static_assert(TRANSPOSE_TILE == 8 && TRANSPOSE_LEAF >= 2 * TRANSPOSE_TILE, "The tile kernels work on 8 x 8 tiles");
+
+#define STRASSEN_CUTOFF 128  // The size at which Strassen stops recursing and uses the packed multiply.
+#define STRASSEN_TASK_DEPTH 2  // The depth of recursion that Strassen stops spawning OpenMP tasks at.
+
+#define FIXED_MIN_SIZE 4  // The smallest size that gets a compile time fixed size multiply.
+#define FIXED_MAX_SIZE 64  // The largest size that gets a compile time fixed size multiply.
+#define FIXED_SIZE 16  // The size of the small matrices in the fixed size and batched runs.
+#define FIXED_COUNT 10000  // The number of small matrices multiplied in each fixed size and batched run.
+
+#define BATCH_LANES 16  // The number of matrices interleaved together in the batched layout, one per vector lane.
+
+#define SPARSE_DENSITY 0.1  // The fraction of non-zero elements under which a matrix is multiplied in sparse form.
+#define DENSITY_SAMPLES 4096  // The number of elements sampled to estimate the density of a matrix.
+#define SPARSE_ZERO_PERCENT 95  // The percentage of the elements that are zero in the inputs of the sparse runs.
+
 
 using namespace std::chrono;
 using namespace std;
 
 
+#pragma region Element Types
+
+// The type of the elements of the matrices in the runs, one of int32_t, int64_t, float or double.
+using matrix_t = int32_t;
+
+
+// The type that the products are summed up in for each type of element.
+// Integers wrap around the same whether they are summed wider or not, so they are summed in their own type.
+// Floats are summed up as doubles to hold onto the precision over long sums. The packed multiply only widens the
+// sums within each L1_BLOCK deep block of the shared dimension, rounding the running total back to float after each.
+template <typename T>
+struct Accumulator
+{
+    using type = T;
+};
+
+template <>
+struct Accumulator<float>
+{
+    using type = double;
+};
+
+template <typename T>
+using accumulator_t = typename Accumulator<T>::type;
+
+
+// Turns a random integer into an element between 0 and 100, with two decimal places for floating point types.
+template <typename T>
+T randomElement(int const random)
+{
+    if constexpr (is_floating_point_v<T>)
+    {
+        return (T)(random % 10000) / 100;
+    }
+    else
+    {
+        return (T)(random % 100);
+    }
+}
+
+#pragma endregion
+
+
+#pragma region Transpose Kernels
+
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile one element at a time.
+// The tile is read in full before any of it is written, so the input and output can be the same tile.
+template <typename T>
+void transposeTileScalar(T const input[], int const inputStride, T output[], int const outputStride)
+{
+    T tile[TRANSPOSE_TILE][TRANSPOSE_TILE];
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++)
+    {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++)
+        {
+            tile[j][i] = input[i * inputStride + j];
+        }
+    }
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++)
+    {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++)
+        {
+            output[i * outputStride + j] = tile[i][j];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Transposes an 8 x 8 tile inside of 8 AVX2 registers.
+// Pairs of rows are interleaved 32 bits at a time, then 64 bits at a time, then the 128 bit halves are swapped
+// over, which leaves each register holding a column.
+template <typename T>
+__attribute__((target("avx2")))
+void transposeTileAvx2(T const input[], int const inputStride, T output[], int const outputStride)
+{
+    static_assert(sizeof(T) == 4, "The AVX2 tile kernel works on 32 bit elements");
+
+    __m256i rows[8];
+    for (auto i = 0; i < 8; i++)
+    {
+        rows[i] = _mm256_loadu_si256((__m256i const *)&input[i * inputStride]);
+    }
+
+    __m256i pairs[8];
+    for (auto i = 0; i < 8; i += 2)
+    {
+        pairs[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+    }
+
+    __m256i quads[8];
+    for (auto i = 0; i < 8; i += 4)
+    {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+
+    for (auto i = 0; i < 4; i++)
+    {
+        auto const low = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20);
+        auto const high = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31);
+        _mm256_storeu_si256((__m256i *)&output[i * outputStride], low);
+        _mm256_storeu_si256((__m256i *)&output[(i + 4) * outputStride], high);
+    }
+}
+#endif
+
+// If the CPU supports the AVX2 tile kernel, checked once when the program starts.
+#if defined(__x86_64__) || defined(__i386__)
+bool const transposeAvx2 = __builtin_cpu_supports("avx2");
+#endif
+
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile with the best kernel for the element type.
+// Only 32 bit elements fill an 8 x 8 tile of AVX2 registers, anything else is done one element at a time.
+template <typename T>
+void transposeTile(T const input[], int const inputStride, T output[], int const outputStride)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if constexpr (sizeof(T) == 4)
+    {
+        if (transposeAvx2)
+        {
+            transposeTileAvx2(input, inputStride, output, outputStride);
+            return;
+        }
+    }
+#endif
+
+    transposeTileScalar(input, inputStride, output, outputStride);
+}
+
+// Transposes a block that fits in cache, a tile at a time, with the edges that don't make up a whole tile done
+// one element at a time.
+template <typename T>
+void transposeLeaf(T const input[], int const inputStride, T output[], int const outputStride,
+                   int const rows, int const cols)
+{
+    auto const tileRows = rows / TRANSPOSE_TILE * TRANSPOSE_TILE;
+    auto const tileCols = cols / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    for (auto i = 0; i < tileRows; i += TRANSPOSE_TILE)
+    {
+        for (auto j = 0; j < tileCols; j += TRANSPOSE_TILE)
+        {
+            transposeTile(&input[i * inputStride + j], inputStride, &output[j * outputStride + i], outputStride);
+        }
+    }
+
+    for (auto i = 0; i < rows; i++)
+    {
+        for (auto j = i < tileRows ? tileCols : 0; j < cols; j++)
+        {
+            output[j * outputStride + i] = input[i * inputStride + j];
+        }
+    }
+}
+
+// Transposes a rows x cols block of the input into a cols x rows block of the output.
+// The longer side is split in half until the block fits in cache, so the transpose makes good use of every cache
+// level without having to know their sizes.
+template <typename T>
+void transposeBlock(T const input[], int const inputStride, T output[], int const outputStride,
+                    int const rows, int const cols)
+{
+    if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF)
+    {
+        transposeLeaf(input, inputStride, output, outputStride, rows, cols);
+    }
+    else if (rows >= cols)
+    {
+        // Split on a tile boundary, so only the real edges of the matrix are left out of the tile kernel.
+        auto const half = rows / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transposeBlock(input, inputStride, output, outputStride, half, cols);
+        transposeBlock(&input[half * inputStride], inputStride, &output[half], outputStride, rows - half, cols);
+    }
+    else
+    {
+        auto const half = cols / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transposeBlock(input, inputStride, output, outputStride, rows, half);
+        transposeBlock(&input[half], inputStride, &output[half * outputStride], outputStride, rows, cols - half);
+    }
+}
+
+
+#pragma endregion
+
+
+#pragma region Packed Panels
+
+// Allocates a buffer for a packed panel, aligned to a cache line so the panels never straddle one.
+template <typename T>
+T *allocatePacked(unsigned long const count)
+{
+    auto const bytes = (count * sizeof(T) + 63) / 64 * 64;
+    return (T *)aligned_alloc(64, bytes);
+}
+
+
+// Copies a rows x depth block of the first matrix into a packed buffer.
+// The block is stored as MICRO_ROWS tall strips, each one laid out column after column, so the micro-kernel
+// reads it contiguously. Strips at the edge of the matrix are padded out with zeros.
+template <typename T>
+void packA(T const m1[], T packed[], unsigned long const size, unsigned long const rows,
+           unsigned long const depth)
+{
+    for (auto i = 0; i < rows; i += MICRO_ROWS)
+    {
+        auto const height = min<unsigned long>(MICRO_ROWS, rows - i);
+
+        for (auto k = 0; k < depth; k++)
+        {
+            for (auto ii = 0; ii < MICRO_ROWS; ii++)
+            {
+                *packed++ = ii < height ? m1[(i + ii) * size + k] : 0;
+            }
+        }
+    }
+}
+
+
+// Copies a depth x width strip of the second matrix into a packed buffer, laid out row after row.
+// The strip is at most MICRO_COLS wide, and is padded out with zeros to that width.
+template <typename T>
+void packBStrip(T const m2[], T packed[], unsigned long const size, unsigned long const depth,
+                unsigned long const width)
+{
+    for (auto k = 0; k < depth; k++)
+    {
+        for (auto j = 0; j < MICRO_COLS; j++)
+        {
+            *packed++ = j < width ? m2[k * size + j] : 0;
+        }
+    }
+}
+
+
+// Computes a rows x cols block of the result from a packed strip of each matrix.
+// The partial sums for the whole MICRO_ROWS x MICRO_COLS block are held in registers, the padding in the strips
+// means the loops always have constant bounds so they can be unrolled and vectorised.
+// The first block of the shared dimension stores its sums, the rest add onto them, so the sums are only as wide as
+// accumulator_t within a block and are rounded back to T between blocks.
+template <typename T>
+void microKernel(T const aStrip[], T const bStrip[], T c[], unsigned long const size,
+                 unsigned long const depth, unsigned long const rows, unsigned long const cols, bool const first)
+{
+    accumulator_t<T> accumulator[MICRO_ROWS][MICRO_COLS] = {};
+
+    for (auto k = 0; k < depth; k++)
+    {
+        for (auto i = 0; i < MICRO_ROWS; i++)
+        {
+            accumulator_t<T> const aValue = aStrip[k * MICRO_ROWS + i];
+
+            for (auto j = 0; j < MICRO_COLS; j++)
+            {
+                accumulator[i][j] += aValue * bStrip[k * MICRO_COLS + j];
+            }
+        }
+    }
+
+    // Only write back the part of the block that is inside of the matrix.
+    for (auto i = 0; i < rows; i++)
+    {
+        for (auto j = 0; j < cols; j++)
+        {
+            c[i * size + j] = (T)(first ? accumulator[i][j] : c[i * size + j] + accumulator[i][j]);
+        }
+    }
+}
+
+
+// Multiplies a packed block of the first matrix with a packed panel of the second matrix, walking over the
+// register sized blocks of the result.
+template <typename T>
+void multiplyPackedBlock(T const aPacked[], T const bPacked[], T c[], unsigned long const size,
+                         unsigned long const rows, unsigned long const cols, unsigned long const depth,
+                         bool const first)
+{
+    for (auto j = 0; j < cols; j += MICRO_COLS)
+    {
+        for (auto i = 0; i < rows; i += MICRO_ROWS)
+        {
+            microKernel(&aPacked[i * depth], &bPacked[j * depth], &c[i * size + j], size, depth,
+                        min<unsigned long>(MICRO_ROWS, rows - i), min<unsigned long>(MICRO_COLS, cols - j), first);
+        }
+    }
+}
+
+#pragma endregion
+
+
 #pragma region OMP Version
 
+// Multiplies two matrices with packed panels, splitting the rows of the result between threads.
+// The threads share the packing of each panel of the second matrix, then each one packs and multiplies its own
+// row blocks of the first matrix. The implicit barriers after each loop stop a panel being repacked while in use.
+template <typename T>
+void multiplyPackedOmp(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    // Shrink the row blocks for small matrices so every thread still gets a block to work on.
+    auto const rowsPerThread = (size + THREAD_COUNT - 1) / THREAD_COUNT;
+    auto const rowBlock = min<unsigned long>(L2_BLOCK, (rowsPerThread + MICRO_ROWS - 1) / MICRO_ROWS * MICRO_ROWS);
+
+    // The panel of the second matrix is shared between all the threads.
+    T *bPacked = allocatePacked<T>(L1_BLOCK * L3_BLOCK);
+
+#pragma omp parallel default(none) firstprivate(size, rowBlock) shared(m1, m2, m3, bPacked)
+    {
+        // Each thread packs its blocks of the first matrix into its own buffer.
+        T *aPacked = allocatePacked<T>(L2_BLOCK * L1_BLOCK);
+
+        for (auto jBlock = 0; jBlock < size; jBlock += L3_BLOCK)
+        {
+            auto const cols = min<unsigned long>(L3_BLOCK, size - jBlock);
+
+            for (auto kBlock = 0; kBlock < size; kBlock += L1_BLOCK)
+            {
+                auto const depth = min<unsigned long>(L1_BLOCK, size - kBlock);
+
+                // Share out the packing of the strips of the panel.
+#pragma omp for
+                for (auto j = 0; j < cols; j += MICRO_COLS)
+                {
+                    packBStrip(&m2[kBlock * size + jBlock + j], &bPacked[j * depth], size, depth,
+                               min<unsigned long>(MICRO_COLS, cols - j));
+                }
+
+                // Then share out the row blocks that multiply with it.
+#pragma omp for schedule(dynamic)
+                for (auto iBlock = 0; iBlock < size; iBlock += rowBlock)
+                {
+                    auto const rows = min<unsigned long>(rowBlock, size - iBlock);
+
+                    packA(&m1[iBlock * size + kBlock], aPacked, size, rows, depth);
+                    multiplyPackedBlock(aPacked, bPacked, &m3[iBlock * size + jBlock], size, rows, cols, depth,
+                                        kBlock == 0);
+                }
+            }
+        }
+
+        free(aPacked);
+    }
+
+    free(bPacked);
+}
+
+
+template <typename T>
 microseconds ompRun(unsigned long size, unsigned long length)
 {
     // Set the number of threads OMP can use.
     omp_set_num_threads(THREAD_COUNT);
 
     // Allocate memory for the matrices
-    int *m1 = new int[length];
-    int *m2 = new int[length];
-    int *m3 = new int[length];
+    T *m1 = new T[length];
+    T *m2 = new T[length];
+    T *m3 = new T[length];
 
+#ifndef PACKED_MULTIPLY
     // Set up an array to store the transposed version of m2.
-    int *m2Transposed = new int[length];
+    T *m2Transposed = new T[length];
+#endif
 
 #pragma omp parallel default(none) firstprivate(length) shared(m1, m2)
     {
         // Generate a private seed for each thread based on the time and the thread number.
         unsigned int seed = (unsigned int)omp_get_wtime() * omp_get_thread_num() + 1;
 
-        // Loop through the matrices, generating a random integer between 0 and 100 for each slot.
+        // Loop through the matrices, generating a random element between 0 and 100 for each slot.
 #pragma omp for
         for (auto i = 0; i < length; i++)
         {
-            m1[i] = rand_r(&seed) % 100;
+            m1[i] = randomElement<T>(rand_r(&seed));
         }
 #pragma omp for
         for (auto i = 0; i < length; i++)
         {
-            m2[i] = rand_r(&seed) % 100;
+            m2[i] = randomElement<T>(rand_r(&seed));
         }
     }
 
     // Store the time before the execution of the algorithm, for computing run time
     auto start = high_resolution_clock::now();
 
+#ifdef PACKED_MULTIPLY
+    // Multiply the matrices with packed panels, only ever holding a block of each matrix at a time.
+    multiplyPackedOmp(m1, m2, m3, size);
+#else
     // Fork the program into multiple threads, for the main parts of the algorithm.
 #pragma omp parallel default(none) firstprivate(size, length) shared(m1, m2, m3, m2Transposed)
     {
         // Transpose the second matrix to speed up the algorithm
         // Helps with caching by keeping the access sequential when accessing
         // what would originally be the columns.
+        // The rows are shared out in bands of TRANSPOSE_LEAF rows, each one transposed cache-obliviously.
 #pragma omp for
-        for (auto i = 0; i < size; i++)
+        for (auto i = 0; i < (int)size; i += TRANSPOSE_LEAF)
         {
-            for (auto j = 0; j < size; j++)
-            {
-                m2Transposed[j * size + i] = m2[i * size + j];
-            }
+            transposeBlock(&m2[i * size], size, &m2Transposed[i], size, min(TRANSPOSE_LEAF, (int)size - i), size);
         }
 
         // Compute the matrix multiplication for every element.
@@ -78,15 +477,16 @@ microseconds ompRun(unsigned long size, unsigned long length)
             for (auto j = 0; j < size; j++)
             {
                 // Sum up the multiplication of row and column of the input matrices.
-                int temp = 0;
+                accumulator_t<T> temp = 0;
                 for (auto k = 0; k < size; k++)
                 {
                     temp += m1[i * size + k] * m2Transposed[j * size + k];
                 }
-                m3[i * size + j] = temp;
+                m3[i * size + j] = (T)temp;
             }
         }
     }
+#endif
 
     auto stop = high_resolution_clock::now();
 
@@ -96,7 +496,9 @@ microseconds ompRun(unsigned long size, unsigned long length)
     delete[] m1;
     delete[] m2;
     delete[] m3;
+#ifndef PACKED_MULTIPLY
     delete[] m2Transposed;
+#endif
 
     return duration;
 }
@@ -106,19 +508,85 @@ microseconds ompRun(unsigned long size, unsigned long length)
 
 #pragma region std::thread Version
 
+// Multiplies two matrices with packed panels, splitting the rows of the result between threads.
+// The threads share the packing of each panel of the second matrix, then each one packs and multiplies its own
+// row blocks of the first matrix. Barriers keep the threads in step so a panel isn't repacked while still in use.
+template <typename T>
+void multiplyPackedStdThread(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    // Shrink the row blocks for small matrices so every thread still gets a block to work on.
+    auto const rowsPerThread = (size + THREAD_COUNT - 1) / THREAD_COUNT;
+    auto const rowBlock = min<unsigned long>(L2_BLOCK, (rowsPerThread + MICRO_ROWS - 1) / MICRO_ROWS * MICRO_ROWS);
+
+    // The panel of the second matrix is shared between all the threads.
+    T *bPacked = allocatePacked<T>(L1_BLOCK * L3_BLOCK);
+    std::barrier sync(THREAD_COUNT);
+
+    // Worker function to multiply the row blocks assigned to a thread, cyclically.
+    auto worker = [&](int const threadId)
+    {
+        T *aPacked = allocatePacked<T>(L2_BLOCK * L1_BLOCK);
+
+        for (auto jBlock = 0; jBlock < size; jBlock += L3_BLOCK)
+        {
+            auto const cols = min<unsigned long>(L3_BLOCK, size - jBlock);
+
+            for (auto kBlock = 0; kBlock < size; kBlock += L1_BLOCK)
+            {
+                auto const depth = min<unsigned long>(L1_BLOCK, size - kBlock);
+
+                // Pack this thread's share of the strips of the panel, then wait for the others to pack theirs.
+                for (auto j = threadId * MICRO_COLS; j < cols; j += THREAD_COUNT * MICRO_COLS)
+                {
+                    packBStrip(&m2[kBlock * size + jBlock + j], &bPacked[j * depth], size, depth,
+                               min<unsigned long>(MICRO_COLS, cols - j));
+                }
+                sync.arrive_and_wait();
+
+                for (auto iBlock = threadId * rowBlock; iBlock < size; iBlock += THREAD_COUNT * rowBlock)
+                {
+                    auto const rows = min<unsigned long>(rowBlock, size - iBlock);
+
+                    packA(&m1[iBlock * size + kBlock], aPacked, size, rows, depth);
+                    multiplyPackedBlock(aPacked, bPacked, &m3[iBlock * size + jBlock], size, rows, cols, depth,
+                                        kBlock == 0);
+                }
+
+                // Wait for everyone to finish with the panel before it gets repacked.
+                sync.arrive_and_wait();
+            }
+        }
+
+        free(aPacked);
+    };
+
+    // Start the workers, then wait for them to finish.
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; i++)
+    {
+        threads.emplace_back(worker, i);
+    }
+
+    for (auto &thread: threads)
+    {
+        thread.join();
+    }
+
+    free(bPacked);
+}
+
+
 // Transposes a matrix into another pointer.
-// Splits up the rows between threads.
-void transposeStdThread(int const inputMatrix[], int outputMatrix[], int const size)
+// Splits up the rows between threads in bands of TRANSPOSE_LEAF rows, each one transposed cache-obliviously.
+template <typename T>
+void transposeStdThread(T const inputMatrix[], T outputMatrix[], int const size)
 {
     // Worker function to transpose the matrix.
     auto worker = [=](int const threadId, int const threadCount)
     {
-        for (auto i = threadId; i < size; i += threadCount)
+        for (auto i = threadId * TRANSPOSE_LEAF; i < size; i += threadCount * TRANSPOSE_LEAF)
         {
-            for (auto j = 0; j < size; j++)
-            {
-                outputMatrix[j * size + i] = inputMatrix[i * size + j];
-            }
+            transposeBlock(&inputMatrix[i * size], size, &outputMatrix[i], size, min(TRANSPOSE_LEAF, size - i), size);
         }
     };
 
@@ -137,27 +605,29 @@ void transposeStdThread(int const inputMatrix[], int outputMatrix[], int const s
 }
 
 
+template <typename T>
 microseconds stdThreadRun(unsigned long size, unsigned long length)
 {
     // Worker function to fill a matrix with random values using threads.
     // Splits the matrix into blocks for each thread to calculate.
-    auto randomiseWorker = [&](int const block, int const blockSize, int matrix[])
+    auto randomiseWorker = [&](int const block, int const blockSize, T matrix[])
     {
         // Generate a seed for the PRNG engine with the time and thread id.
         unsigned int seed = time(nullptr) * (hash<std::thread::id>()(std::this_thread::get_id()) + 1);
 
-        // Loop through the matrix, generating a random integer between 0 and 100 for each slot.
+        // Loop through the matrix, generating a random element between 0 and 100 for each slot.
         for (auto i = block * blockSize; i < (block + 1) * blockSize; i++)
         {
-            matrix[i] = rand_r(&seed) % 100;
+            matrix[i] = randomElement<T>(rand_r(&seed));
         }
     };
 
+#ifndef PACKED_MULTIPLY
     // Worker function to calculate the matrix multiplication of matrices.
     // Each row will be calculated by a different thread, cyclically.
     auto multiplyWorker = [&](
-            int const threadId, int const assignedThreads, int const matrix1[], int const matrix2Transposed[],
-            int matrix3[], int const size
+            int const threadId, int const assignedThreads, T const matrix1[], T const matrix2Transposed[],
+            T matrix3[], int const size
     )
     {
         // i represents the row and j represents the column of the output matrix that is being calculated.
@@ -166,20 +636,21 @@ microseconds stdThreadRun(unsigned long size, unsigned long length)
             for (auto j = 0; j < size; j++)
             {
                 // Sum up the multiplication of row and column of the input matrices.
-                int temp = 0;
+                accumulator_t<T> temp = 0;
                 for (auto k = 0; k < size; k++)
                 {
                     temp += matrix1[i * size + k] * matrix2Transposed[j * size + k];
                 }
-                matrix3[i * size + j] = temp;
+                matrix3[i * size + j] = (T)temp;
             }
         }
     };
+#endif
 
     // Allocate memory for the matrices
-    int *m1 = new int[length];
-    int *m2 = new int[length];
-    int *m3 = new int[length];
+    T *m1 = new T[length];
+    T *m2 = new T[length];
+    T *m3 = new T[length];
 
     // Randomise the input matrices, parallelising the calculations with threads.
     {
@@ -209,11 +680,15 @@ microseconds stdThreadRun(unsigned long size, unsigned long length)
     // Store the time before the execution of the algorithm, for computing run time
     auto start = high_resolution_clock::now();
 
+#ifdef PACKED_MULTIPLY
+    // Compute the matrix multiplication of the matrices with packed panels.
+    multiplyPackedStdThread(m1, m2, m3, size);
+#else
     // Compute the matrix multiplication of the matrices.
     {
         // Transpose the second matrix to make it so that it is multiplying rows by rows.
         // This further helps with caching, it uses contiguous memory instead of jumping around.
-        int *m2Transposed = new int[length];
+        T *m2Transposed = new T[length];
         transposeStdThread(m2, m2Transposed, size);
 
         // Start worker threads to compute the matrix multiplication.
@@ -231,6 +706,7 @@ microseconds stdThreadRun(unsigned long size, unsigned long length)
 
         delete[] m2Transposed;
     }
+#endif
 
     // Store the time after the execution of the algorithm.
     auto stop = high_resolution_clock::now();
@@ -250,19 +726,66 @@ microseconds stdThreadRun(unsigned long size, unsigned long length)
 
 #pragma region Sequential Version
 
-// Transposes a matrix into another pointer.
-void transposeSequential(int const inputMatrix[], int outputMatrix[], int const size)
+// Multiplies two matrices by splitting the work into blocks that fit into each level of the cache.
+// The columns of the result are split up for L3, then the shared dimension for L1, then the rows for L2.
+// Only the panels of each matrix that the current block needs are packed, so there is no full transposed copy.
+// Each matrix has its own row stride, so this can also work on the quadrants of a larger matrix in place.
+template <typename T>
+void multiplyPackedSequential(T const m1[], unsigned long const stride1, T const m2[], unsigned long const stride2,
+                              T m3[], unsigned long const stride3, unsigned long const size)
 {
-    for (auto i = 0; i < size; i++)
+    // Buffers for the packed panels, only ever one block of each matrix in size.
+    T *aPacked = allocatePacked<T>(L2_BLOCK * L1_BLOCK);
+    T *bPacked = allocatePacked<T>(L1_BLOCK * L3_BLOCK);
+
+    for (auto jBlock = 0; jBlock < size; jBlock += L3_BLOCK)
     {
-        for (auto j = 0; j < size; j++)
+        auto const cols = min<unsigned long>(L3_BLOCK, size - jBlock);
+
+        for (auto kBlock = 0; kBlock < size; kBlock += L1_BLOCK)
         {
-            outputMatrix[j * size + i] = inputMatrix[i * size + j];
+            auto const depth = min<unsigned long>(L1_BLOCK, size - kBlock);
+
+            // Pack the panel of the second matrix, it gets reused for every row block.
+            for (auto j = 0; j < cols; j += MICRO_COLS)
+            {
+                packBStrip(&m2[kBlock * stride2 + jBlock + j], &bPacked[j * depth], stride2, depth,
+                           min<unsigned long>(MICRO_COLS, cols - j));
+            }
+
+            for (auto iBlock = 0; iBlock < size; iBlock += L2_BLOCK)
+            {
+                auto const rows = min<unsigned long>(L2_BLOCK, size - iBlock);
+
+                packA(&m1[iBlock * stride1 + kBlock], aPacked, stride1, rows, depth);
+                multiplyPackedBlock(aPacked, bPacked, &m3[iBlock * stride3 + jBlock], stride3, rows, cols, depth,
+                                    kBlock == 0);
+            }
         }
     }
+
+    free(aPacked);
+    free(bPacked);
+}
+
+
+// Multiplies two whole matrices with the packed panels.
+template <typename T>
+void multiplyPackedSequential(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    multiplyPackedSequential(m1, size, m2, size, m3, size, size);
+}
+
+
+// Transposes a matrix into another pointer.
+template <typename T>
+void transposeSequential(T const inputMatrix[], T outputMatrix[], int const size)
+{
+    transposeBlock(inputMatrix, size, outputMatrix, size, size, size);
 }
 
 
+template <typename T>
 microseconds sequentialRun(unsigned long size, unsigned long length)
 {
     // Seed the PRNG engine.
@@ -270,23 +793,27 @@ microseconds sequentialRun(unsigned long size, unsigned long length)
 
     // Allocate memory for the matrices
     // The matrices will be stored as 1D arrays, instead of 2D arrays, to help with caching.
-    int *m1 = (int *)malloc(sizeof(int *) * length);
-    int *m2 = (int *)malloc(sizeof(int *) * length);
-    int *m3 = (int *)malloc(sizeof(int *) * length);
+    T *m1 = (T *)malloc(sizeof(T) * length);
+    T *m2 = (T *)malloc(sizeof(T) * length);
+    T *m3 = (T *)malloc(sizeof(T) * length);
 
-    // Loop through the input matrices, generating random integer between 0 and 100 for each slot.
+    // Loop through the input matrices, generating random element between 0 and 100 for each slot.
     for (int i = 0; i < length; i++)
     {
-        m1[i] = rand() % 100;
-        m2[i] = rand() % 100;
+        m1[i] = randomElement<T>(rand());
+        m2[i] = randomElement<T>(rand());
     }
 
     // Store the time before the execution of the algorithm, for computing run time
     auto start = high_resolution_clock::now();
 
+#ifdef PACKED_MULTIPLY
+    // Multiply the matrices block by block, packing only the panels each block needs.
+    multiplyPackedSequential(m1, m2, m3, size);
+#else
     // Transpose the second matrix to make it so that it is multiplying rows by rows.
     // This further helps with caching, it uses contiguous memory instead of jumping around.
-    int *m2Transposed = new int[length];
+    T *m2Transposed = new T[length];
     transposeSequential(m2, m2Transposed, size);
 
     // Compute the vector addition for each element of the input matrices.
@@ -296,14 +823,15 @@ microseconds sequentialRun(unsigned long size, unsigned long length)
         for (int j = 0; j < size; j++)
         {
             // Sum up the multiplication of row and column of the input matrices.
-            int temp = 0;
+            accumulator_t<T> temp = 0;
             for (int k = 0; k < size; k++)
             {
                 temp += m1[i * size + k] * m2Transposed[j * size + k];
             }
-            m3[i * size + j] = temp;
+            m3[i * size + j] = (T)temp;
         }
     }
+#endif
 
     // Store the end time of the algorithm.
     auto stop = high_resolution_clock::now();
@@ -317,33 +845,1099 @@ microseconds sequentialRun(unsigned long size, unsigned long length)
 #pragma endregion
 
 
-// Return the average run time of a list of runs.
-unsigned long average(vector<microseconds> runs)
+#pragma region Strassen Version
+
+// Adds (or subtracts, with a sign of -1) two n x n matrices into a third, each with its own row stride.
+template <typename T>
+void addStrassen(T const m1[], unsigned long const stride1, T const m2[], unsigned long const stride2,
+                 T out[], unsigned long const strideOut, unsigned long const n, int const sign)
 {
-    return (reduce(runs.begin(), runs.end()) / runs.size()).count();
+    for (auto i = 0; i < n; i++)
+    {
+        for (auto j = 0; j < n; j++)
+        {
+            out[i * strideOut + j] = m1[i * stride1 + j] + sign * m2[i * stride2 + j];
+        }
+    }
 }
 
 
-int main()
+// Multiplies two n x n matrices with the Strassen-Winograd algorithm, recursing until the matrices are
+// STRASSEN_CUTOFF or smaller, then falling back to the packed multiply.
+// Each level splits the matrices into quadrants, and does 7 multiplications of them instead of 8, at the cost of
+// 15 additions. n has to halve cleanly all the way down to the cutoff.
+// The 7 multiplications are independent, so down to STRASSEN_TASK_DEPTH they are run as OpenMP tasks.
+template <typename T>
+void multiplyStrassen(T const m1[], unsigned long const stride1, T const m2[], unsigned long const stride2,
+                      T m3[], unsigned long const stride3, unsigned long const n, int const depth)
 {
-    // Set up the matrix column size, and total length of the storage arrays
-    unsigned long constexpr size = SIZE;
-    unsigned long constexpr length = size * size;
+    if (n <= STRASSEN_CUTOFF)
+    {
+        multiplyPackedSequential(m1, stride1, m2, stride2, m3, stride3, n);
+        return;
+    }
 
-    // Initialise a spaces string to blank out a console line.
-    int line_width = getenv("COLUMNS") ? atoi(getenv("COLUMNS")) : 80;
-    string spaces(line_width - 1, ' ');
+    auto const half = n / 2;
+    auto const quadrant = half * half;
+
+    // Pointers to the quadrants of each matrix, they keep the stride of the full matrix.
+    T const *a11 = m1, *a12 = m1 + half, *a21 = m1 + half * stride1, *a22 = a21 + half;
+    T const *b11 = m2, *b12 = m2 + half, *b21 = m2 + half * stride2, *b22 = b21 + half;
+    T *c11 = m3, *c12 = m3 + half, *c21 = m3 + half * stride3, *c22 = c21 + half;
+
+    // Space for the 8 sums and the 7 products, all stored contiguously with a stride of half.
+    T *buffer = new T[15 * quadrant];
+    T *s1 = buffer, *s2 = s1 + quadrant, *s3 = s2 + quadrant, *s4 = s3 + quadrant;
+    T *t1 = s4 + quadrant, *t2 = t1 + quadrant, *t3 = t2 + quadrant, *t4 = t3 + quadrant;
+    T *p1 = t4 + quadrant, *p2 = p1 + quadrant, *p3 = p2 + quadrant, *p4 = p3 + quadrant;
+    T *p5 = p4 + quadrant, *p6 = p5 + quadrant, *p7 = p6 + quadrant;
+
+    // The sums of the quadrants of the first matrix.
+    addStrassen(a21, stride1, a22, stride1, s1, half, half, 1);
+    addStrassen(s1, half, a11, stride1, s2, half, half, -1);
+    addStrassen(a11, stride1, a21, stride1, s3, half, half, -1);
+    addStrassen(a12, stride1, s2, half, s4, half, half, -1);
+
+    // The sums of the quadrants of the second matrix.
+    addStrassen(b12, stride2, b11, stride2, t1, half, half, -1);
+    addStrassen(b22, stride2, t1, half, t2, half, half, -1);
+    addStrassen(b22, stride2, b12, stride2, t3, half, half, -1);
+    addStrassen(t2, half, b21, stride2, t4, half, half, -1);
+
+    // The 7 products, only spawned as tasks near the top of the recursion where they are large enough to be worth it.
+    auto const spawn = depth < STRASSEN_TASK_DEPTH;
+#pragma omp task default(none) firstprivate(a11, b11, p1, stride1, stride2, half, depth) if(spawn)
+    multiplyStrassen(a11, stride1, b11, stride2, p1, half, half, depth + 1);
+#pragma omp task default(none) firstprivate(a12, b21, p2, stride1, stride2, half, depth) if(spawn)
+    multiplyStrassen(a12, stride1, b21, stride2, p2, half, half, depth + 1);
+#pragma omp task default(none) firstprivate(s4, b22, p3, stride2, half, depth) if(spawn)
+    multiplyStrassen(s4, half, b22, stride2, p3, half, half, depth + 1);
+#pragma omp task default(none) firstprivate(a22, t4, p4, stride1, half, depth) if(spawn)
+    multiplyStrassen(a22, stride1, t4, half, p4, half, half, depth + 1);
+#pragma omp task default(none) firstprivate(s1, t1, p5, half, depth) if(spawn)
+    multiplyStrassen(s1, half, t1, half, p5, half, half, depth + 1);
+#pragma omp task default(none) firstprivate(s2, t2, p6, half, depth) if(spawn)
+    multiplyStrassen(s2, half, t2, half, p6, half, half, depth + 1);
+#pragma omp task default(none) firstprivate(s3, t3, p7, half, depth) if(spawn)
+    multiplyStrassen(s3, half, t3, half, p7, half, half, depth + 1);
+#pragma omp taskwait
+
+    // Combine the products into the quadrants of the result, reusing the product buffers for the partial sums.
+    addStrassen(p1, half, p2, half, c11, stride3, half, 1);
+    addStrassen(p6, half, p1, half, p6, half, half, 1);
+    addStrassen(p7, half, p6, half, p7, half, half, 1);
+    addStrassen(p6, half, p5, half, p6, half, half, 1);
+    addStrassen(p6, half, p3, half, c12, stride3, half, 1);
+    addStrassen(p7, half, p4, half, c21, stride3, half, -1);
+    addStrassen(p7, half, p5, half, c22, stride3, half, 1);
+
+    delete[] buffer;
+}
 
-    // Set fields to be left justified
-    cout << left;
 
-    // Run each algorithm a number of times, storing the run times and displaying the running average.
-    // Later they will be used to show a final comparison.
-    cout << "Sequential Runs" << endl;
-    vector<microseconds> sequentialRuns;
-    for (auto i = 0; i < RUNS / 10; i++)
+// Multiplies two matrices with the Strassen-Winograd algorithm.
+// Sizes that don't halve cleanly down to the cutoff are padded out with zeros to the next size that does.
+template <typename T>
+void multiplyStrassen(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    // Work out how many times the matrix needs to be halved, and the size it needs to be padded to for that.
+    auto base = size;
+    auto levels = 0;
+    while (base > STRASSEN_CUTOFF)
     {
-        sequentialRuns.push_back(sequentialRun(size, length));
+        base = (base + 1) / 2;
+        levels++;
+    }
+    auto const padded = base << levels;
+
+    T const *a = m1;
+    T const *b = m2;
+    T *c = m3;
+
+    // Copy the matrices into the top left of zeroed out padded matrices if the size doesn't fit.
+    if (padded != size)
+    {
+        T *aPadded = new T[padded * padded]();
+        T *bPadded = new T[padded * padded]();
+        for (auto i = 0; i < size; i++)
+        {
+            copy(&m1[i * size], &m1[(i + 1) * size], &aPadded[i * padded]);
+            copy(&m2[i * size], &m2[(i + 1) * size], &bPadded[i * padded]);
+        }
+
+        a = aPadded;
+        b = bPadded;
+        c = new T[padded * padded];
+    }
+
+    // Start up the threads, with a single thread starting the recursion and the rest picking up its tasks.
+#pragma omp parallel default(none) shared(a, b, c, padded)
+#pragma omp single
+    multiplyStrassen(a, padded, b, padded, c, padded, padded, 0);
+
+    // Copy the result back out of the padded matrix.
+    if (padded != size)
+    {
+        for (auto i = 0; i < size; i++)
+        {
+            copy(&c[i * padded], &c[i * padded + size], &m3[i * size]);
+        }
+
+        delete[] a;
+        delete[] b;
+        delete[] c;
+    }
+}
+
+
+template <typename T>
+microseconds strassenRun(unsigned long size, unsigned long length)
+{
+    // Set the number of threads OMP can use.
+    omp_set_num_threads(THREAD_COUNT);
+
+    // Allocate memory for the matrices
+    T *m1 = new T[length];
+    T *m2 = new T[length];
+    T *m3 = new T[length];
+
+#pragma omp parallel default(none) firstprivate(length) shared(m1, m2)
+    {
+        // Generate a private seed for each thread based on the time and the thread number.
+        unsigned int seed = (unsigned int)omp_get_wtime() * omp_get_thread_num() + 1;
+
+        // Loop through the matrices, generating a random element between 0 and 100 for each slot.
+#pragma omp for
+        for (auto i = 0; i < length; i++)
+        {
+            m1[i] = randomElement<T>(rand_r(&seed));
+        }
+#pragma omp for
+        for (auto i = 0; i < length; i++)
+        {
+            m2[i] = randomElement<T>(rand_r(&seed));
+        }
+    }
+
+    // Store the time before the execution of the algorithm, for computing run time
+    auto start = high_resolution_clock::now();
+
+    multiplyStrassen(m1, m2, m3, size);
+
+    auto stop = high_resolution_clock::now();
+
+    // Compute the run time of the algorithm
+    auto duration = duration_cast<microseconds>(stop - start);
+
+    delete[] m1;
+    delete[] m2;
+    delete[] m3;
+
+    return duration;
+}
+
+#pragma endregion
+
+
+#pragma region Fixed Size Version
+
+// Multiplies two N x N matrices, where N is known at compile time.
+// Each row of the result is summed up in N accumulators, with the loops over them fully unrolled so the row stays
+// in registers and gets vectorised. The loops over the rows and the shared dimension have constant bounds too, so
+// the compiler is free to unroll them as well.
+template <typename T, unsigned long N>
+void multiplyFixed(T const m1[], T const m2[], T m3[])
+{
+    static_assert(N >= FIXED_MIN_SIZE && N <= FIXED_MAX_SIZE, "Fixed size multiplies are only for small matrices");
+
+    for (auto i = 0; i < N; i++)
+    {
+        accumulator_t<T> row[N] = {};
+
+        for (auto k = 0; k < N; k++)
+        {
+            accumulator_t<T> const aValue = m1[i * N + k];
+
+#pragma GCC unroll 64
+            for (auto j = 0; j < N; j++)
+            {
+                row[j] += aValue * m2[k * N + j];
+            }
+        }
+
+#pragma GCC unroll 64
+        for (auto j = 0; j < N; j++)
+        {
+            m3[i * N + j] = (T)row[j];
+        }
+    }
+}
+
+
+// Signature of the fixed size multiplies, so they can be stored in a table.
+template <typename T>
+using fixed_multiply_t = void (*)(T const m1[], T const m2[], T m3[]);
+
+
+// Builds a table of the fixed size multiplies, one for every size from FIXED_MIN_SIZE up.
+template <typename T, size_t... Offsets>
+constexpr array<fixed_multiply_t<T>, sizeof...(Offsets)> makeFixedTable(index_sequence<Offsets...>)
+{
+    return {multiplyFixed<T, FIXED_MIN_SIZE + Offsets>...};
+}
+
+
+// Multiplies two small matrices, looking up the fixed size multiply for their size.
+// Sizes outside of the table fall back to the packed multiply.
+template <typename T>
+void multiplySmall(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    static constexpr auto table = makeFixedTable<T>(make_index_sequence<FIXED_MAX_SIZE - FIXED_MIN_SIZE + 1>());
+
+    if (size >= FIXED_MIN_SIZE && size <= FIXED_MAX_SIZE)
+    {
+        table[size - FIXED_MIN_SIZE](m1, m2, m3);
+    }
+    else
+    {
+        multiplyPackedSequential(m1, m2, m3, size);
+    }
+}
+
+
+// Times multiplying FIXED_COUNT pairs of small FIXED_SIZE x FIXED_SIZE matrices, one after another.
+template <typename T>
+microseconds fixedRun()
+{
+    unsigned long constexpr length = FIXED_SIZE * FIXED_SIZE;
+
+    // Allocate memory for all the small matrices, one after another.
+    T *m1 = new T[length * FIXED_COUNT];
+    T *m2 = new T[length * FIXED_COUNT];
+    T *m3 = new T[length * FIXED_COUNT];
+
+    // Generate a seed for the PRNG based on the time.
+    unsigned int seed = time(nullptr);
+
+    // Loop through the matrices, generating a random element between 0 and 100 for each slot.
+    for (auto i = 0; i < length * FIXED_COUNT; i++)
+    {
+        m1[i] = randomElement<T>(rand_r(&seed));
+        m2[i] = randomElement<T>(rand_r(&seed));
+    }
+
+    // Store the time before the execution of the algorithm, for computing run time
+    auto start = high_resolution_clock::now();
+
+    for (auto i = 0; i < FIXED_COUNT; i++)
+    {
+        multiplySmall(&m1[i * length], &m2[i * length], &m3[i * length], FIXED_SIZE);
+    }
+
+    auto stop = high_resolution_clock::now();
+
+    // Compute the run time of the algorithm
+    auto duration = duration_cast<microseconds>(stop - start);
+
+    delete[] m1;
+    delete[] m2;
+    delete[] m3;
+
+    return duration;
+}
+
+#pragma endregion
+
+
+#pragma region Batched Version
+
+// Works out how many groups of BATCH_LANES matrices a batch takes up in the interleaved layout.
+unsigned long batchGroups(unsigned long const count)
+{
+    return (count + BATCH_LANES - 1) / BATCH_LANES;
+}
+
+
+// Copies a batch of n x n matrices stored one after another into the interleaved layout.
+// The batch is split into groups of BATCH_LANES matrices, and inside of a group the same element of every matrix
+// is stored next to each other. That way a vector register holds the same element of BATCH_LANES matrices, and
+// one vector instruction works on all of them at once. The last group is padded out with zeroed matrices.
+template <typename T>
+void interleaveBatch(T const matrices[], T interleaved[], unsigned long const n, unsigned long const count)
+{
+    auto const length = n * n;
+
+    fill(interleaved, interleaved + batchGroups(count) * length * BATCH_LANES, (T)0);
+
+    for (auto matrix = 0; matrix < count; matrix++)
+    {
+        T *group = &interleaved[matrix / BATCH_LANES * length * BATCH_LANES];
+        auto const lane = matrix % BATCH_LANES;
+
+        for (auto i = 0; i < length; i++)
+        {
+            group[i * BATCH_LANES + lane] = matrices[matrix * length + i];
+        }
+    }
+}
+
+
+// Copies a batch of matrices in the interleaved layout back out into matrices stored one after another.
+template <typename T>
+void deinterleaveBatch(T const interleaved[], T matrices[], unsigned long const n, unsigned long const count)
+{
+    auto const length = n * n;
+
+    for (auto matrix = 0; matrix < count; matrix++)
+    {
+        T const *group = &interleaved[matrix / BATCH_LANES * length * BATCH_LANES];
+        auto const lane = matrix % BATCH_LANES;
+
+        for (auto i = 0; i < length; i++)
+        {
+            matrices[matrix * length + i] = group[i * BATCH_LANES + lane];
+        }
+    }
+}
+
+
+// Multiplies a batch of count pairs of n x n matrices stored in the interleaved layout.
+// The groups are split up between the threads, and inside of a group the innermost loop goes across the lanes,
+// so each step of the multiply is done for BATCH_LANES matrices with one vector instruction.
+// Nothing is allocated or transposed, so the only per call overhead is the one parallel region.
+template <typename T>
+void multiplyBatched(T const m1[], T const m2[], T m3[], unsigned long const n, unsigned long const count)
+{
+    auto const groups = batchGroups(count);
+    auto const groupLength = n * n * BATCH_LANES;
+
+#pragma omp parallel for default(none) firstprivate(n, groups, groupLength) shared(m1, m2, m3)
+    for (auto group = 0; group < groups; group++)
+    {
+        T const *a = &m1[group * groupLength];
+        T const *b = &m2[group * groupLength];
+        T *c = &m3[group * groupLength];
+
+        for (auto i = 0; i < n; i++)
+        {
+            for (auto j = 0; j < n; j++)
+            {
+                // Sum up the multiplication of row and column for every matrix in the group at once.
+                accumulator_t<T> accumulator[BATCH_LANES] = {};
+
+                for (auto k = 0; k < n; k++)
+                {
+                    T const *aLanes = &a[(i * n + k) * BATCH_LANES];
+                    T const *bLanes = &b[(k * n + j) * BATCH_LANES];
+
+#pragma omp simd
+                    for (auto lane = 0; lane < BATCH_LANES; lane++)
+                    {
+                        accumulator[lane] += (accumulator_t<T>)aLanes[lane] * bLanes[lane];
+                    }
+                }
+
+                T *cLanes = &c[(i * n + j) * BATCH_LANES];
+
+#pragma omp simd
+                for (auto lane = 0; lane < BATCH_LANES; lane++)
+                {
+                    cLanes[lane] = (T)accumulator[lane];
+                }
+            }
+        }
+    }
+}
+
+
+// Times multiplying a batch of FIXED_COUNT pairs of small FIXED_SIZE x FIXED_SIZE matrices in one call.
+template <typename T>
+microseconds batchedRun()
+{
+    // Set the number of threads OMP can use.
+    omp_set_num_threads(THREAD_COUNT);
+
+    unsigned long constexpr length = FIXED_SIZE * FIXED_SIZE;
+    auto const interleavedLength = batchGroups(FIXED_COUNT) * length * BATCH_LANES;
+
+    // Allocate memory for the batches, the inputs are generated one after another then interleaved.
+    T *matrices = new T[length * FIXED_COUNT];
+    T *m1 = new T[interleavedLength];
+    T *m2 = new T[interleavedLength];
+    T *m3 = new T[interleavedLength];
+
+    // Generate a seed for the PRNG based on the time.
+    unsigned int seed = time(nullptr);
+
+    // Fill each batch with random elements between 0 and 100, and interleave it.
+    for (auto matrix: {m1, m2})
+    {
+        for (auto i = 0; i < length * FIXED_COUNT; i++)
+        {
+            matrices[i] = randomElement<T>(rand_r(&seed));
+        }
+
+        interleaveBatch(matrices, matrix, FIXED_SIZE, FIXED_COUNT);
+    }
+
+    // Store the time before the execution of the algorithm, for computing run time
+    auto start = high_resolution_clock::now();
+
+    multiplyBatched(m1, m2, m3, FIXED_SIZE, FIXED_COUNT);
+
+    auto stop = high_resolution_clock::now();
+
+    // Compute the run time of the algorithm
+    auto duration = duration_cast<microseconds>(stop - start);
+
+    delete[] matrices;
+    delete[] m1;
+    delete[] m2;
+    delete[] m3;
+
+    return duration;
+}
+
+#pragma endregion
+
+
+#pragma region Sparse Version
+
+// A matrix in compressed sparse row (CSR) form, where only the non-zero elements are stored.
+// The elements of row i are values[rowStarts[i]] up to values[rowStarts[i + 1]], with their columns in columns.
+// The same arrays read with the rows and columns swapped are the compressed sparse column (CSC) form of the
+// transpose, so CSC is never stored separately.
+template <typename T>
+struct CsrMatrix
+{
+    unsigned long rows = 0;
+    unsigned long cols = 0;
+    vector<unsigned long> rowStarts;
+    vector<unsigned long> columns;
+    vector<T> values;
+};
+
+
+// Estimates the fraction of the elements of a matrix that are non-zero, from DENSITY_SAMPLES elements picked
+// at random. The samples are random rather than evenly spaced so a pattern in the matrix can't line up with them.
+// Small matrices are counted in full.
+template <typename T>
+double estimateDensity(T const matrix[], unsigned long const length)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    unsigned long nonZeros = 0;
+
+    if (length <= DENSITY_SAMPLES)
+    {
+        for (auto i = 0; i < length; i++)
+        {
+            nonZeros += matrix[i] != 0;
+        }
+
+        return (double)nonZeros / length;
+    }
+
+    // A fixed seed, so the same matrix always takes the same path.
+    minstd_rand generator(1);
+    uniform_int_distribution<unsigned long> distribution(0, length - 1);
+
+    for (auto i = 0; i < DENSITY_SAMPLES; i++)
+    {
+        nonZeros += matrix[distribution(generator)] != 0;
+    }
+
+    return (double)nonZeros / DENSITY_SAMPLES;
+}
+
+
+// Compresses a dense rows x cols matrix into CSR form.
+template <typename T>
+CsrMatrix<T> toCsr(T const matrix[], unsigned long const rows, unsigned long const cols)
+{
+    CsrMatrix<T> csr{rows, cols};
+    csr.rowStarts.reserve(rows + 1);
+    csr.rowStarts.push_back(0);
+
+    for (auto i = 0; i < rows; i++)
+    {
+        for (auto j = 0; j < cols; j++)
+        {
+            if (matrix[i * cols + j] != 0)
+            {
+                csr.columns.push_back(j);
+                csr.values.push_back(matrix[i * cols + j]);
+            }
+        }
+
+        csr.rowStarts.push_back(csr.columns.size());
+    }
+
+    return csr;
+}
+
+
+// Expands a CSR matrix back out into a dense one.
+template <typename T>
+void toDense(CsrMatrix<T> const &csr, T matrix[])
+{
+    fill(matrix, matrix + csr.rows * csr.cols, (T)0);
+
+    for (auto i = 0; i < csr.rows; i++)
+    {
+        for (auto p = csr.rowStarts[i]; p < csr.rowStarts[i + 1]; p++)
+        {
+            matrix[i * csr.cols + csr.columns[p]] = csr.values[p];
+        }
+    }
+}
+
+
+// Multiplies a CSR matrix with a dense one into a dense result.
+// Each non-zero of a row of the first matrix scales a row of the second one and adds it on to the row of the
+// result, so the dense matrix is always read a row at a time. The rows are split up between the threads, and each
+// thread sums its rows up in its own accumulator row.
+template <typename T>
+void multiplyCsrDense(CsrMatrix<T> const &a, T const b[], T c[])
+{
+    auto const cols = a.cols;
+
+#pragma omp parallel default(none) firstprivate(cols) shared(a, b, c)
+    {
+        vector<accumulator_t<T>> sums(cols);
+
+#pragma omp for schedule(dynamic, 16)
+        for (auto i = 0ul; i < a.rows; i++)
+        {
+            fill(sums.begin(), sums.end(), 0);
+
+            for (auto p = a.rowStarts[i]; p < a.rowStarts[i + 1]; p++)
+            {
+                accumulator_t<T> const value = a.values[p];
+                T const *bRow = &b[a.columns[p] * cols];
+
+                for (auto j = 0; j < cols; j++)
+                {
+                    sums[j] += value * bRow[j];
+                }
+            }
+
+            for (auto j = 0; j < cols; j++)
+            {
+                c[i * cols + j] = (T)sums[j];
+            }
+        }
+    }
+}
+
+
+// Multiplies two CSR matrices into a CSR result with Gustavson's algorithm.
+// Each row of the result is built up in a sparse accumulator, a dense row of sums along with a list of the
+// columns that have been touched, so only the non-zeros of each matrix are ever visited. The rows are split up
+// between the threads, and each thread has its own accumulator.
+// The rows are gone through twice, first to count the non-zeros of each row so the result can be laid out, then
+// again to fill in the values.
+template <typename T>
+CsrMatrix<T> multiplyCsr(CsrMatrix<T> const &a, CsrMatrix<T> const &b)
+{
+    CsrMatrix<T> c{a.rows, b.cols};
+    c.rowStarts.assign(a.rows + 1, 0);
+
+#pragma omp parallel default(none) shared(a, b, c)
+    {
+        // The sparse accumulator, touched holds the last row that put a sum in each column.
+        // a.rows is never a row, so it marks a column as untouched.
+        vector<accumulator_t<T>> sums(b.cols);
+        vector<unsigned long> touched(b.cols, a.rows);
+        vector<unsigned long> touchedColumns;
+
+        // Count the non-zeros of each row of the result.
+#pragma omp for schedule(dynamic, 16)
+        for (auto i = 0ul; i < a.rows; i++)
+        {
+            unsigned long count = 0;
+
+            for (auto p = a.rowStarts[i]; p < a.rowStarts[i + 1]; p++)
+            {
+                auto const k = a.columns[p];
+
+                for (auto q = b.rowStarts[k]; q < b.rowStarts[k + 1]; q++)
+                {
+                    if (touched[b.columns[q]] != i)
+                    {
+                        touched[b.columns[q]] = i;
+                        count++;
+                    }
+                }
+            }
+
+            c.rowStarts[i + 1] = count;
+        }
+
+        // Turn the counts into where each row starts, and make room for the elements.
+#pragma omp single
+        {
+            partial_sum(c.rowStarts.begin(), c.rowStarts.end(), c.rowStarts.begin());
+            c.columns.resize(c.rowStarts[a.rows]);
+            c.values.resize(c.rowStarts[a.rows]);
+        }
+
+        fill(touched.begin(), touched.end(), a.rows);
+
+        // Sum up each row of the result, then write it out with its columns in order.
+#pragma omp for schedule(dynamic, 16)
+        for (auto i = 0ul; i < a.rows; i++)
+        {
+            touchedColumns.clear();
+
+            for (auto p = a.rowStarts[i]; p < a.rowStarts[i + 1]; p++)
+            {
+                auto const k = a.columns[p];
+                accumulator_t<T> const value = a.values[p];
+
+                for (auto q = b.rowStarts[k]; q < b.rowStarts[k + 1]; q++)
+                {
+                    auto const j = b.columns[q];
+
+                    if (touched[j] != i)
+                    {
+                        touched[j] = i;
+                        sums[j] = 0;
+                        touchedColumns.push_back(j);
+                    }
+
+                    sums[j] += value * b.values[q];
+                }
+            }
+
+            sort(touchedColumns.begin(), touchedColumns.end());
+
+            auto position = c.rowStarts[i];
+            for (auto j: touchedColumns)
+            {
+                c.columns[position] = j;
+                c.values[position] = (T)sums[j];
+                position++;
+            }
+        }
+    }
+
+    return c;
+}
+
+
+// Multiplies two matrices, picking a sparse or dense multiply from how many of their elements are non-zero.
+// A first matrix under SPARSE_DENSITY goes through CSR, multiplied with the second one in CSR as well if it is
+// also sparse or as it is if not. Anything else goes through the dense packed multiply.
+template <typename T>
+void multiplyAuto(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    auto const length = size * size;
+
+    if (estimateDensity(m1, length) >= SPARSE_DENSITY)
+    {
+        multiplyPackedOmp(m1, m2, m3, size);
+        return;
+    }
+
+    auto const a = toCsr(m1, size, size);
+
+    if (estimateDensity(m2, length) < SPARSE_DENSITY)
+    {
+        toDense(multiplyCsr(a, toCsr(m2, size, size)), m3);
+    }
+    else
+    {
+        multiplyCsrDense(a, m2, m3);
+    }
+}
+
+
+// Times multiplying two matrices where SPARSE_ZERO_PERCENT of the elements are zero, converting them to CSR
+// included.
+template <typename T>
+microseconds sparseRun(unsigned long size, unsigned long length)
+{
+    // Set the number of threads OMP can use.
+    omp_set_num_threads(THREAD_COUNT);
+
+    // Allocate memory for the matrices
+    T *m1 = new T[length];
+    T *m2 = new T[length];
+    T *m3 = new T[length];
+
+    // Generate a seed for the PRNG based on the time.
+    unsigned int seed = time(nullptr);
+
+    // Fill the matrices, with most of the elements zero and the rest between 0 and 100.
+    for (auto matrix: {m1, m2})
+    {
+        for (auto i = 0; i < length; i++)
+        {
+            matrix[i] = rand_r(&seed) % 100 < SPARSE_ZERO_PERCENT ? (T)0 : randomElement<T>(rand_r(&seed));
+        }
+    }
+
+    // Store the time before the execution of the algorithm, for computing run time
+    auto start = high_resolution_clock::now();
+
+    multiplyAuto(m1, m2, m3, size);
+
+    auto stop = high_resolution_clock::now();
+
+    // Compute the run time of the algorithm
+    auto duration = duration_cast<microseconds>(stop - start);
+
+    delete[] m1;
+    delete[] m2;
+    delete[] m3;
+
+    return duration;
+}
+
+#pragma endregion
+
+
+#pragma region Quantized Version
+
+// How many elements of the shared dimension are packed next to each other for each column of the second matrix.
+// Each group fills a 32 bit lane, so one multiply-add sums all of them into the lane.
+template <typename Q>
+constexpr unsigned long quantizedGroup = 4 / sizeof(Q);
+
+
+// Signature of the kernels that compute a MICRO_ROWS x MICRO_COLS block of the result from quantized matrices.
+template <typename QA, typename QB>
+using quantized_kernel_t = void (*)(QA const a[], QB const bStrip[], int32_t block[MICRO_ROWS][MICRO_COLS],
+                                    unsigned long const depth);
+
+
+// Checks every element of a matrix fits in Q, so it can be quantized without losing anything.
+template <typename Q, typename T>
+bool fitsIn(T const matrix[], unsigned long const length)
+{
+    return all_of(matrix, matrix + length, [](T const element)
+    {
+        return element >= numeric_limits<Q>::min() && element <= numeric_limits<Q>::max() &&
+               element == (T)(Q)element;
+    });
+}
+
+
+// Checks the sums of pairs of products the AVX2 kernel makes can't go past what it holds them in, going by the
+// biggest elements of each matrix. For 8 bit elements vpmaddubsw saturates them at 16 bits, and for 16 bit ones
+// vpmaddwd wraps them around at 32 bits.
+template <typename QA, typename QB, typename T>
+bool pairsFit(T const m1[], T const m2[], unsigned long const length)
+{
+    auto const largest = [](T const matrix[], unsigned long const length)
+    {
+        int64_t largest = 0;
+        for (auto i = 0; i < length; i++)
+        {
+            largest = max(largest, matrix[i] < 0 ? -(int64_t)matrix[i] : (int64_t)matrix[i]);
+        }
+
+        return largest;
+    };
+
+    auto constexpr limit = sizeof(QB) == 1 ? (int64_t)numeric_limits<int16_t>::max() :
+                                             (int64_t)numeric_limits<int32_t>::max();
+
+    return 2 * largest(m1, length) * largest(m2, length) <= limit;
+}
+
+
+// Packs the first matrix into Q row after row.
+// The rows are padded out with zeros to depth, and extra rows of zeros are added to fill out the last MICRO_ROWS.
+template <typename Q, typename T>
+void quantizeA(T const matrix[], Q packed[], unsigned long const rows, unsigned long const cols,
+               unsigned long const paddedRows, unsigned long const depth)
+{
+    for (auto i = 0; i < paddedRows; i++)
+    {
+        for (auto k = 0; k < depth; k++)
+        {
+            *packed++ = i < rows && k < cols ? (Q)matrix[i * cols + k] : 0;
+        }
+    }
+}
+
+
+// Packs the second matrix into Q in strips of MICRO_COLS columns.
+// Inside a strip every quantizedGroup<Q> elements of the shared dimension are stored next to each other for each
+// column, with zeros padding out the edges.
+template <typename Q, typename T>
+void quantizeB(T const matrix[], Q packed[], unsigned long const rows, unsigned long const cols,
+               unsigned long const depth)
+{
+    auto constexpr group = quantizedGroup<Q>;
+
+    for (auto j = 0; j < cols; j += MICRO_COLS)
+    {
+        for (auto k = 0; k < depth; k += group)
+        {
+            for (auto jj = 0; jj < MICRO_COLS; jj++)
+            {
+                for (auto g = 0; g < group; g++)
+                {
+                    *packed++ = k + g < rows && j + jj < cols ? (Q)matrix[(k + g) * cols + j + jj] : 0;
+                }
+            }
+        }
+    }
+}
+
+
+// Computes a block of the result from quantized matrices one element at a time.
+template <typename QA, typename QB>
+void quantizedKernelScalar(QA const a[], QB const bStrip[], int32_t block[MICRO_ROWS][MICRO_COLS],
+                           unsigned long const depth)
+{
+    auto constexpr group = quantizedGroup<QB>;
+
+    for (auto i = 0; i < MICRO_ROWS; i++)
+    {
+        for (auto j = 0; j < MICRO_COLS; j++)
+        {
+            block[i][j] = 0;
+        }
+
+        for (auto k = 0; k < depth; k++)
+        {
+            // The groups of the shared dimension sit next to each other for each column in the strip.
+            QB const *bGroup = &bStrip[k / group * MICRO_COLS * group + k % group];
+
+            for (auto j = 0; j < MICRO_COLS; j++)
+            {
+                block[i][j] += (int32_t)a[i * depth + k] * bGroup[j * group];
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Computes a block of the result from quantized matrices with AVX2, one register of sums for each row.
+// Each step broadcasts a group of the shared dimension from a row of the first matrix across a register, and
+// multiplies it with the same group from all MICRO_COLS columns of the strip at once.
+// 8 bit elements use vpmaddubsw, summing pairs of products into 16 bits, then vpmaddwd with ones to sum those
+// pairs into 32 bits. 16 bit elements use vpmaddwd straight away.
+template <typename QA, typename QB>
+__attribute__((target("avx2")))
+void quantizedKernelAvx2(QA const a[], QB const bStrip[], int32_t block[MICRO_ROWS][MICRO_COLS],
+                         unsigned long const depth)
+{
+    static_assert(MICRO_COLS * 4 == sizeof(__m256i), "A strip of the second matrix has to fill one register");
+
+    auto constexpr group = quantizedGroup<QB>;
+    auto const ones = _mm256_set1_epi16(1);
+
+    __m256i sums[MICRO_ROWS];
+    for (auto i = 0; i < MICRO_ROWS; i++)
+    {
+        sums[i] = _mm256_setzero_si256();
+    }
+
+    for (auto k = 0; k < depth; k += group)
+    {
+        auto const b = _mm256_loadu_si256((__m256i const *)&bStrip[k * MICRO_COLS]);
+
+        for (auto i = 0; i < MICRO_ROWS; i++)
+        {
+            int32_t aGroup;
+            memcpy(&aGroup, &a[i * depth + k], sizeof(aGroup));
+            auto const aBroadcast = _mm256_set1_epi32(aGroup);
+
+            if constexpr (sizeof(QB) == 1)
+            {
+                auto const pairs = _mm256_maddubs_epi16(aBroadcast, b);
+                sums[i] = _mm256_add_epi32(sums[i], _mm256_madd_epi16(pairs, ones));
+            }
+            else
+            {
+                sums[i] = _mm256_add_epi32(sums[i], _mm256_madd_epi16(aBroadcast, b));
+            }
+        }
+    }
+
+    for (auto i = 0; i < MICRO_ROWS; i++)
+    {
+        _mm256_storeu_si256((__m256i *)block[i], sums[i]);
+    }
+}
+#endif
+
+
+// Picks the quantized kernel to use, based on what the CPU supports.
+template <typename QA, typename QB>
+quantized_kernel_t<QA, QB> selectQuantizedKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return quantizedKernelAvx2<QA, QB>;
+    }
+#endif
+
+    return quantizedKernelScalar<QA, QB>;
+}
+
+
+// Multiplies two matrices with their elements quantized to QA and QB, summing the products up in 32 bits.
+// Both matrices are packed once up front, into a quarter or a half of the memory of 32 bit elements, then the
+// blocks of the result are split up between the threads.
+// The elements have to fit in QA and QB, see fitsIn. For the 8 bit multiply QA is uint8_t and QB is int8_t, to
+// match vpmaddubsw, which saturates each sum of a pair of products at 16 bits. So it is only exact while those
+// pairs stay under 32768, as they do for elements between 0 and 100, see pairsFit.
+template <typename QA, typename QB, typename T>
+void multiplyQuantized(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    static_assert(quantizedGroup<QA> == quantizedGroup<QB>, "Both matrices have to be packed in the same groups");
+
+    auto constexpr group = quantizedGroup<QB>;
+    auto const depth = (size + group - 1) / group * group;
+    auto const paddedRows = (size + MICRO_ROWS - 1) / MICRO_ROWS * MICRO_ROWS;
+    auto const paddedCols = (size + MICRO_COLS - 1) / MICRO_COLS * MICRO_COLS;
+
+    vector<QA> aPacked(paddedRows * depth);
+    vector<QB> bPacked(paddedCols * depth);
+    quantizeA(m1, aPacked.data(), size, size, paddedRows, depth);
+    quantizeB(m2, bPacked.data(), size, size, depth);
+
+    auto const kernel = selectQuantizedKernel<QA, QB>();
+
+#pragma omp parallel for collapse(2) schedule(dynamic) default(none) firstprivate(size, depth, kernel) \
+    shared(m3, aPacked, bPacked)
+    for (auto i = 0; i < size; i += MICRO_ROWS)
+    {
+        for (auto j = 0; j < size; j += MICRO_COLS)
+        {
+            int32_t block[MICRO_ROWS][MICRO_COLS];
+            kernel(&aPacked[i * depth], &bPacked[j * depth], block, depth);
+
+            // Only write back the part of the block that is inside of the matrix.
+            for (auto ii = 0; ii < min<unsigned long>(MICRO_ROWS, size - i); ii++)
+            {
+                for (auto jj = 0; jj < min<unsigned long>(MICRO_COLS, size - j); jj++)
+                {
+                    m3[(i + ii) * size + j + jj] = (T)block[ii][jj];
+                }
+            }
+        }
+    }
+}
+
+
+// Multiplies two matrices quantized to QA and QB if they fit, and the sums of pairs of their products do too.
+// Falls back on the packed multiply if not.
+template <typename QA, typename QB, typename T>
+void multiplyQuantizedIfFits(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    auto const length = size * size;
+
+    if (fitsIn<QA>(m1, length) && fitsIn<QB>(m2, length) && pairsFit<QA, QB>(m1, m2, length))
+    {
+        multiplyQuantized<QA, QB>(m1, m2, m3, size);
+    }
+    else
+    {
+        multiplyPackedOmp(m1, m2, m3, size);
+    }
+}
+
+
+// Checks multiplying size x size matrices filled with a and b quantized to QA and QB gives the same result as the
+// packed 32 bit multiply, whether it is quantized or falls back.
+template <typename T, typename QA, typename QB>
+bool checkQuantized(T const a, T const b, unsigned long const size)
+{
+    vector<T> m1(size * size, a);
+    vector<T> m2(size * size, b);
+    vector<T> quantized(size * size);
+    vector<T> expected(size * size);
+
+    multiplyQuantizedIfFits<QA, QB>(m1.data(), m2.data(), quantized.data(), size);
+    multiplyPackedOmp(m1.data(), m2.data(), expected.data(), size);
+
+    return quantized == expected;
+}
+
+
+// Times multiplying two matrices quantized to QA and QB, with the check that they fit and the packing included.
+// Falls back on the packed multiply if they don't fit.
+template <typename T, typename QA, typename QB>
+microseconds quantizedRun(unsigned long size, unsigned long length)
+{
+    // Set the number of threads OMP can use.
+    omp_set_num_threads(THREAD_COUNT);
+
+    // Allocate memory for the matrices
+    T *m1 = new T[length];
+    T *m2 = new T[length];
+    T *m3 = new T[length];
+
+    // Generate a seed for the PRNG based on the time.
+    unsigned int seed = time(nullptr);
+
+    // Fill the matrices with whole numbers between 0 and 100, like the rest of the runs use.
+    for (auto matrix: {m1, m2})
+    {
+        for (auto i = 0; i < length; i++)
+        {
+            matrix[i] = (T)(rand_r(&seed) % 100);
+        }
+    }
+
+    // Store the time before the execution of the algorithm, for computing run time
+    auto start = high_resolution_clock::now();
+
+    multiplyQuantizedIfFits<QA, QB>(m1, m2, m3, size);
+
+    auto stop = high_resolution_clock::now();
+
+    // Compute the run time of the algorithm
+    auto duration = duration_cast<microseconds>(stop - start);
+
+    delete[] m1;
+    delete[] m2;
+    delete[] m3;
+
+    return duration;
+}
+
+#pragma endregion
+
+
+// Return the average run time of a list of runs.
+unsigned long average(vector<microseconds> runs)
+{
+    return (reduce(runs.begin(), runs.end()) / runs.size()).count();
+}
+
+
+int main()
+{
+    // Set up the matrix column size, and total length of the storage arrays
+    unsigned long constexpr size = SIZE;
+    unsigned long constexpr length = size * size;
+
+    // Initialise a spaces string to blank out a console line.
+    int line_width = getenv("COLUMNS") ? atoi(getenv("COLUMNS")) : 80;
+    string spaces(line_width - 1, ' ');
+
+    // Set fields to be left justified
+    cout << left;
+
+    // Run each algorithm a number of times, storing the run times and displaying the running average.
+    // Later they will be used to show a final comparison.
+    cout << "Sequential Runs" << endl;
+    vector<microseconds> sequentialRuns;
+    for (auto i = 0; i < RUNS / 10; i++)
+    {
+        sequentialRuns.push_back(sequentialRun<matrix_t>(size, length));
 
         cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << sequentialRuns.size() << "Average: "
              << average(sequentialRuns) << flush;
@@ -354,7 +1948,7 @@ int main()
     vector<microseconds> stdThreadRuns;
     for (auto i = 0; i < RUNS; i++)
     {
-        stdThreadRuns.push_back(stdThreadRun(size, length));
+        stdThreadRuns.push_back(stdThreadRun<matrix_t>(size, length));
 
         cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << stdThreadRuns.size() << "Average: "
              << average(stdThreadRuns) << flush;
@@ -365,17 +1959,99 @@ int main()
     vector<microseconds> ompRuns;
     for (auto i = 0; i < RUNS; i++)
     {
-        ompRuns.push_back(ompRun(size, length));
+        ompRuns.push_back(ompRun<matrix_t>(size, length));
 
         cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << ompRuns.size() << "Average: "
              << average(ompRuns) << flush;
     }
+    cout << endl << "------------------------------" << endl;
+
+    cout << "Strassen Runs" << endl;
+    vector<microseconds> strassenRuns;
+    for (auto i = 0; i < RUNS; i++)
+    {
+        strassenRuns.push_back(strassenRun<matrix_t>(size, length));
+
+        cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << strassenRuns.size() << "Average: "
+             << average(strassenRuns) << flush;
+    }
+    cout << endl << "------------------------------" << endl;
+
+    cout << "Fixed Size Runs (" << FIXED_COUNT << " x " << FIXED_SIZE << "x" << FIXED_SIZE << ")" << endl;
+    vector<microseconds> fixedRuns;
+    for (auto i = 0; i < RUNS / 10; i++)
+    {
+        fixedRuns.push_back(fixedRun<matrix_t>());
+
+        cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << fixedRuns.size() << "Average: "
+             << average(fixedRuns) << flush;
+    }
+    cout << endl << "------------------------------" << endl;
+
+    cout << "Batched Runs (" << FIXED_COUNT << " x " << FIXED_SIZE << "x" << FIXED_SIZE << ")" << endl;
+    vector<microseconds> batchedRuns;
+    for (auto i = 0; i < RUNS; i++)
+    {
+        batchedRuns.push_back(batchedRun<matrix_t>());
+
+        cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << batchedRuns.size() << "Average: "
+             << average(batchedRuns) << flush;
+    }
+    cout << endl << "------------------------------" << endl;
+
+    cout << "Sparse Runs (" << SPARSE_ZERO_PERCENT << "% zeros)" << endl;
+    vector<microseconds> sparseRuns;
+    for (auto i = 0; i < RUNS; i++)
+    {
+        sparseRuns.push_back(sparseRun<matrix_t>(size, length));
+
+        cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << sparseRuns.size() << "Average: "
+             << average(sparseRuns) << flush;
+    }
+    cout << endl << "------------------------------" << endl;
+
+    // Elements that fit in 8 and 16 bits, but with pairs of products that don't fit in the sums of the AVX2 kernels,
+    // have to come out the same as the 32 bit multiply.
+    if (!checkQuantized<matrix_t, uint8_t, int8_t>(200, 120, 16) ||
+        !checkQuantized<matrix_t, uint8_t, int8_t>(255, -128, 16) ||
+        !checkQuantized<matrix_t, int16_t, int16_t>(32767, -32768, 2))
+    {
+        cerr << "The quantized multiplies don't match the 32 bit multiply" << endl;
+        return 1;
+    }
+
+    cout << "Int8 Runs" << endl;
+    vector<microseconds> int8Runs;
+    for (auto i = 0; i < RUNS; i++)
+    {
+        int8Runs.push_back(quantizedRun<matrix_t, uint8_t, int8_t>(size, length));
+
+        cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << int8Runs.size() << "Average: "
+             << average(int8Runs) << flush;
+    }
+    cout << endl << "------------------------------" << endl;
+
+    cout << "Int16 Runs" << endl;
+    vector<microseconds> int16Runs;
+    for (auto i = 0; i < RUNS; i++)
+    {
+        int16Runs.push_back(quantizedRun<matrix_t, int16_t, int16_t>(size, length));
+
+        cout << '\r' << spaces << '\r' << "Runs: " << setw(5) << int16Runs.size() << "Average: "
+             << average(int16Runs) << flush;
+    }
     cout << endl << "------------------------------" << endl << endl;
 
     // Print out all the averages for comparison.
     cout << "Sequential Average: " << average(sequentialRuns) << endl;
     cout << "std::thread Average: " << average(stdThreadRuns) << endl;
     cout << "OMP Average: " << average(ompRuns) << endl;
+    cout << "Strassen Average: " << average(strassenRuns) << endl;
+    cout << "Fixed Size Average: " << average(fixedRuns) << endl;
+    cout << "Batched Average: " << average(batchedRuns) << endl;
+    cout << "Sparse Average: " << average(sparseRuns) << endl;
+    cout << "Int8 Average: " << average(int8Runs) << endl;
+    cout << "Int16 Average: " << average(int16Runs) << endl;
 
     return 0;
 }
\ No newline at end of file
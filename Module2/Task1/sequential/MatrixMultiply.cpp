@@ -2,14 +2,81 @@
 #include <cstdlib>
 #include <ctime>
 #include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+#define BLOCKED_MULTIPLY  // If the cache-blocked multiply should be used instead of the naive transposed one
+
+// Block sizes for the cache-blocked multiply, each one chosen so its working set stays inside a cache level.
+#define L1_BLOCK 256  // Depth of the shared dimension, keeps a MICRO_COLS wide strip of the second matrix in L1.
+#define L2_BLOCK 128  // Rows of the first matrix, keeps an L2_BLOCK x L1_BLOCK block of it in L2.
+#define L3_BLOCK 1024  // Columns of the second matrix, keeps an L1_BLOCK x L3_BLOCK panel of it in L3.
+
+// Size of the block of the result matrix that the micro-kernel keeps in registers.
+#define MICRO_ROWS 4
+#define MICRO_COLS 8
+
+static_assert(L2_BLOCK % MICRO_ROWS == 0 && L3_BLOCK % MICRO_COLS == 0, "Blocks must be made of whole micro-blocks");
+
+// Sizes for the cache-oblivious transpose.
+#define TRANSPOSE_TILE 8  // Size of the square tiles transposed in registers, a tile of ints fills 8 AVX2 registers.
+#define TRANSPOSE_LEAF 64  // Size of the blocks the recursive transpose stops splitting at.
+
+static_assert(TRANSPOSE_TILE == 8 && TRANSPOSE_LEAF >= 2 * TRANSPOSE_TILE, "The tile kernels work on 8 x 8 tiles");
 
 
 using namespace std::chrono;
 using namespace std;
 
 
+// The type of the elements of the matrices, one of int32_t, int64_t, float or double.
+using matrix_t = int32_t;
+
+
+// The type that the products are summed up in for each type of element.
+// Integers wrap around the same whether they are summed wider or not, so they are summed in their own type.
+// Floats are summed up as doubles to hold onto the precision over long sums. The cache-blocked multiply only widens the
+// sums within each L1_BLOCK deep block of the shared dimension, rounding the running total back to float after each.
+template <typename T>
+struct Accumulator
+{
+    using type = T;
+};
+
+template <>
+struct Accumulator<float>
+{
+    using type = double;
+};
+
+template <typename T>
+using accumulator_t = typename Accumulator<T>::type;
+
+
+// Turns a random integer into an element between 0 and 100, with two decimal places for floating point types.
+template <typename T>
+T randomElement(int const random)
+{
+    if constexpr (is_floating_point_v<T>)
+    {
+        return (T)(random % 10000) / 100;
+    }
+    else
+    {
+        return (T)(random % 100);
+    }
+}
+
+
 // Helper function to print arrays
-void printMatrix(int const matrix[], int const size)
+template <typename T>
+void printMatrix(T const matrix[], int const size)
 {
     for (auto i = 0; i < std::min(20, size); i++)
     {
@@ -28,47 +95,165 @@ void printMatrix(int const matrix[], int const size)
 }
 
 
-// Transposes a matrix into another pointer.
-void transpose(int const inputMatrix[], int outputMatrix[], int const size)
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile one element at a time.
+// The tile is read in full before any of it is written, so the input and output can be the same tile.
+template <typename T>
+void transposeTileScalar(T const input[], int const inputStride, T output[], int const outputStride)
 {
-    for (auto i = 0; i < size; i++)
+    T tile[TRANSPOSE_TILE][TRANSPOSE_TILE];
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++)
     {
-        for (auto j = 0; j < size; j++)
+        for (auto j = 0; j < TRANSPOSE_TILE; j++)
         {
-            outputMatrix[j * size + i] = inputMatrix[i * size + j];
+            tile[j][i] = input[i * inputStride + j];
+        }
+    }
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++)
+    {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++)
+        {
+            output[i * outputStride + j] = tile[i][j];
         }
     }
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// Transposes an 8 x 8 tile inside of 8 AVX2 registers.
+// Pairs of rows are interleaved 32 bits at a time, then 64 bits at a time, then the 128 bit halves are swapped
+// over, which leaves each register holding a column.
+template <typename T>
+__attribute__((target("avx2")))
+void transposeTileAvx2(T const input[], int const inputStride, T output[], int const outputStride)
+{
+    static_assert(sizeof(T) == 4, "The AVX2 tile kernel works on 32 bit elements");
 
-int main()
+    __m256i rows[8];
+    for (auto i = 0; i < 8; i++)
+    {
+        rows[i] = _mm256_loadu_si256((__m256i const *)&input[i * inputStride]);
+    }
+
+    __m256i pairs[8];
+    for (auto i = 0; i < 8; i += 2)
+    {
+        pairs[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+    }
+
+    __m256i quads[8];
+    for (auto i = 0; i < 8; i += 4)
+    {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+
+    for (auto i = 0; i < 4; i++)
+    {
+        auto const low = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20);
+        auto const high = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31);
+        _mm256_storeu_si256((__m256i *)&output[i * outputStride], low);
+        _mm256_storeu_si256((__m256i *)&output[(i + 4) * outputStride], high);
+    }
+}
+#endif
+
+// If the CPU supports the AVX2 tile kernel, checked once when the program starts.
+#if defined(__x86_64__) || defined(__i386__)
+bool const transposeAvx2 = __builtin_cpu_supports("avx2");
+#endif
+
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile with the best kernel for the element type.
+// Only 32 bit elements fill an 8 x 8 tile of AVX2 registers, anything else is done one element at a time.
+template <typename T>
+void transposeTile(T const input[], int const inputStride, T output[], int const outputStride)
 {
-    // Set up the matrix column size, and total length of the storage arrays
-    unsigned long constexpr size = 1024;
-    unsigned long constexpr length = size * size;
+#if defined(__x86_64__) || defined(__i386__)
+    if constexpr (sizeof(T) == 4)
+    {
+        if (transposeAvx2)
+        {
+            transposeTileAvx2(input, inputStride, output, outputStride);
+            return;
+        }
+    }
+#endif
 
-    // Seed the PRNG engine.
-    srand(time(nullptr));
+    transposeTileScalar(input, inputStride, output, outputStride);
+}
 
-    // Allocate memory for the matrices
-    // The matrices will be stored as 1D arrays, instead of 2D arrays, to help with caching.
-    int *m1 = (int *)malloc(sizeof(int *) * length);
-    int *m2 = (int *)malloc(sizeof(int *) * length);
-    int *m3 = (int *)malloc(sizeof(int *) * length);
+// Transposes a block that fits in cache, a tile at a time, with the edges that don't make up a whole tile done
+// one element at a time.
+template <typename T>
+void transposeLeaf(T const input[], int const inputStride, T output[], int const outputStride,
+                   int const rows, int const cols)
+{
+    auto const tileRows = rows / TRANSPOSE_TILE * TRANSPOSE_TILE;
+    auto const tileCols = cols / TRANSPOSE_TILE * TRANSPOSE_TILE;
 
-    // Loop through the input matrices, generating random integer between 0 and 100 for each slot.
-    for (int i = 0; i < length; i++)
+    for (auto i = 0; i < tileRows; i += TRANSPOSE_TILE)
     {
-        m1[i] = rand() % 100;
-        m2[i] = rand() % 100;
+        for (auto j = 0; j < tileCols; j += TRANSPOSE_TILE)
+        {
+            transposeTile(&input[i * inputStride + j], inputStride, &output[j * outputStride + i], outputStride);
+        }
     }
 
-    // Store the time before the execution of the algorithm, for computing run time
-    auto start = high_resolution_clock::now();
+    for (auto i = 0; i < rows; i++)
+    {
+        for (auto j = i < tileRows ? tileCols : 0; j < cols; j++)
+        {
+            output[j * outputStride + i] = input[i * inputStride + j];
+        }
+    }
+}
+
+// Transposes a rows x cols block of the input into a cols x rows block of the output.
+// The longer side is split in half until the block fits in cache, so the transpose makes good use of every cache
+// level without having to know their sizes.
+template <typename T>
+void transposeBlock(T const input[], int const inputStride, T output[], int const outputStride,
+                    int const rows, int const cols)
+{
+    if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF)
+    {
+        transposeLeaf(input, inputStride, output, outputStride, rows, cols);
+    }
+    else if (rows >= cols)
+    {
+        // Split on a tile boundary, so only the real edges of the matrix are left out of the tile kernel.
+        auto const half = rows / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transposeBlock(input, inputStride, output, outputStride, half, cols);
+        transposeBlock(&input[half * inputStride], inputStride, &output[half], outputStride, rows - half, cols);
+    }
+    else
+    {
+        auto const half = cols / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transposeBlock(input, inputStride, output, outputStride, rows, half);
+        transposeBlock(&input[half], inputStride, &output[half * outputStride], outputStride, rows, cols - half);
+    }
+}
+
 
+// Transposes a matrix into another pointer.
+template <typename T>
+void transpose(T const inputMatrix[], T outputMatrix[], int const size)
+{
+    transposeBlock(inputMatrix, size, outputMatrix, size, size, size);
+}
+
+
+// Multiplies two matrices the naive way, with a dot product of a row of the first matrix and a row of the
+// transposed second matrix for every element of the result.
+template <typename T>
+void multiplyNaive(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
     // Transpose the second matrix to make it so that it is multiplying rows by rows.
     // This further helps with caching, it uses contiguous memory instead of jumping around.
-    int *m2Transposed = new int[length];
+    T *m2Transposed = new T[size * size];
     transpose(m2, m2Transposed, size);
 
     // Compute the vector addition for each element of the input matrices.
@@ -78,15 +263,193 @@ int main()
         for (int j = 0; j < size; j++)
         {
             // Sum up the multiplication of row and column of the input matrices.
-            int temp = 0;
+            accumulator_t<T> temp = 0;
             for (int k = 0; k < size; k++)
             {
                 temp += m1[i * size + k] * m2Transposed[j * size + k];
             }
-            m3[i * size + j] = temp;
+            m3[i * size + j] = (T)temp;
         }
     }
 
+    delete[] m2Transposed;
+}
+
+
+// Allocates a buffer for a packed panel, aligned to a cache line so the panels never straddle one.
+template <typename T>
+T *allocatePacked(unsigned long const count)
+{
+    auto const bytes = (count * sizeof(T) + 63) / 64 * 64;
+    return (T *)aligned_alloc(64, bytes);
+}
+
+
+// Copies a rows x depth block of the first matrix into a packed buffer.
+// The block is stored as MICRO_ROWS tall strips, each one laid out column after column, so the micro-kernel
+// reads it contiguously. Strips at the edge of the matrix are padded out with zeros.
+template <typename T>
+void packA(T const m1[], T packed[], unsigned long const size, unsigned long const rows,
+           unsigned long const depth)
+{
+    for (auto i = 0; i < rows; i += MICRO_ROWS)
+    {
+        auto const height = min<unsigned long>(MICRO_ROWS, rows - i);
+
+        for (auto k = 0; k < depth; k++)
+        {
+            for (auto ii = 0; ii < MICRO_ROWS; ii++)
+            {
+                *packed++ = ii < height ? m1[(i + ii) * size + k] : 0;
+            }
+        }
+    }
+}
+
+
+// Copies a depth x width strip of the second matrix into a packed buffer, laid out row after row.
+// The strip is at most MICRO_COLS wide, and is padded out with zeros to that width.
+template <typename T>
+void packBStrip(T const m2[], T packed[], unsigned long const size, unsigned long const depth,
+                unsigned long const width)
+{
+    for (auto k = 0; k < depth; k++)
+    {
+        for (auto j = 0; j < MICRO_COLS; j++)
+        {
+            *packed++ = j < width ? m2[k * size + j] : 0;
+        }
+    }
+}
+
+
+// Computes a rows x cols block of the result from a packed strip of each matrix.
+// The partial sums for the whole MICRO_ROWS x MICRO_COLS block are held in registers, the padding in the strips
+// means the loops always have constant bounds so they can be unrolled and vectorised.
+// The first block of the shared dimension stores its sums, the rest add onto them, so the sums are only as wide as
+// accumulator_t within a block and are rounded back to T between blocks.
+template <typename T>
+void microKernel(T const aStrip[], T const bStrip[], T c[], unsigned long const size,
+                 unsigned long const depth, unsigned long const rows, unsigned long const cols, bool const first)
+{
+    accumulator_t<T> accumulator[MICRO_ROWS][MICRO_COLS] = {};
+
+    for (auto k = 0; k < depth; k++)
+    {
+        for (auto i = 0; i < MICRO_ROWS; i++)
+        {
+            accumulator_t<T> const aValue = aStrip[k * MICRO_ROWS + i];
+
+            for (auto j = 0; j < MICRO_COLS; j++)
+            {
+                accumulator[i][j] += aValue * bStrip[k * MICRO_COLS + j];
+            }
+        }
+    }
+
+    // Only write back the part of the block that is inside of the matrix.
+    for (auto i = 0; i < rows; i++)
+    {
+        for (auto j = 0; j < cols; j++)
+        {
+            c[i * size + j] = (T)(first ? accumulator[i][j] : c[i * size + j] + accumulator[i][j]);
+        }
+    }
+}
+
+
+// Multiplies a packed block of the first matrix with a packed panel of the second matrix, walking over the
+// register sized blocks of the result.
+template <typename T>
+void multiplyPackedBlock(T const aPacked[], T const bPacked[], T c[], unsigned long const size,
+                         unsigned long const rows, unsigned long const cols, unsigned long const depth,
+                         bool const first)
+{
+    for (auto j = 0; j < cols; j += MICRO_COLS)
+    {
+        for (auto i = 0; i < rows; i += MICRO_ROWS)
+        {
+            microKernel(&aPacked[i * depth], &bPacked[j * depth], &c[i * size + j], size, depth,
+                        min<unsigned long>(MICRO_ROWS, rows - i), min<unsigned long>(MICRO_COLS, cols - j), first);
+        }
+    }
+}
+
+
+// Multiplies two matrices by splitting the work into blocks that fit into each level of the cache.
+// The columns of the result are split up for L3, then the shared dimension for L1, then the rows for L2.
+// Only the panels of each matrix that the current block needs are packed, so there is no full transposed copy.
+template <typename T>
+void multiplyBlocked(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    // Buffers for the packed panels, only ever one block of each matrix in size.
+    T *aPacked = allocatePacked<T>(L2_BLOCK * L1_BLOCK);
+    T *bPacked = allocatePacked<T>(L1_BLOCK * L3_BLOCK);
+
+    for (auto jBlock = 0; jBlock < size; jBlock += L3_BLOCK)
+    {
+        auto const cols = min<unsigned long>(L3_BLOCK, size - jBlock);
+
+        for (auto kBlock = 0; kBlock < size; kBlock += L1_BLOCK)
+        {
+            auto const depth = min<unsigned long>(L1_BLOCK, size - kBlock);
+
+            // Pack the panel of the second matrix, it gets reused for every row block.
+            for (auto j = 0; j < cols; j += MICRO_COLS)
+            {
+                packBStrip(&m2[kBlock * size + jBlock + j], &bPacked[j * depth], size, depth,
+                           min<unsigned long>(MICRO_COLS, cols - j));
+            }
+
+            for (auto iBlock = 0; iBlock < size; iBlock += L2_BLOCK)
+            {
+                auto const rows = min<unsigned long>(L2_BLOCK, size - iBlock);
+
+                packA(&m1[iBlock * size + kBlock], aPacked, size, rows, depth);
+                multiplyPackedBlock(aPacked, bPacked, &m3[iBlock * size + jBlock], size, rows, cols, depth,
+                                    kBlock == 0);
+            }
+        }
+    }
+
+    free(aPacked);
+    free(bPacked);
+}
+
+
+int main()
+{
+    // Set up the matrix column size, and total length of the storage arrays
+    unsigned long constexpr size = 1024;
+    unsigned long constexpr length = size * size;
+
+    // Seed the PRNG engine.
+    srand(time(nullptr));
+
+    // Allocate memory for the matrices
+    // The matrices will be stored as 1D arrays, instead of 2D arrays, to help with caching.
+    matrix_t *m1 = (matrix_t *)malloc(sizeof(matrix_t) * length);
+    matrix_t *m2 = (matrix_t *)malloc(sizeof(matrix_t) * length);
+    matrix_t *m3 = (matrix_t *)malloc(sizeof(matrix_t) * length);
+
+    // Loop through the input matrices, generating a random element between 0 and 100 for each slot.
+    for (int i = 0; i < length; i++)
+    {
+        m1[i] = randomElement<matrix_t>(rand());
+        m2[i] = randomElement<matrix_t>(rand());
+    }
+
+    // Store the time before the execution of the algorithm, for computing run time
+    auto start = high_resolution_clock::now();
+
+#ifdef BLOCKED_MULTIPLY
+    // Multiply the matrices block by block, keeping the working set in the caches.
+    multiplyBlocked(m1, m2, m3, size);
+#else
+    // Multiply the matrices with the original row by row algorithm.
+    multiplyNaive(m1, m2, m3, size);
+#endif
+
     // Store the end time of the algorithm.
     auto stop = high_resolution_clock::now();
 
@@ -4,6 +4,15 @@
 #include <chrono>
 #include <thread>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <barrier>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 using namespace std::chrono;
@@ -12,8 +21,247 @@ using namespace std;
 
 #define THREAD_COUNT 8
 
+//#define PACKED_MULTIPLY  // If the packed panel multiply should be used instead of the transposed dot product one
+
+// Block sizes for the packed multiply, each one chosen so its working set stays inside a cache level.
+#define L1_BLOCK 256  // Depth of the shared dimension, keeps a MICRO_COLS wide strip of the second matrix in L1.
+#define L2_BLOCK 128  // Rows of the first matrix, keeps an L2_BLOCK x L1_BLOCK block of it in L2.
+#define L3_BLOCK 1024  // Columns of the second matrix, keeps an L1_BLOCK x L3_BLOCK panel of it in L3.
+
+// Size of the block of the result matrix that the micro-kernel keeps in registers.
+#define MICRO_ROWS 4
+#define MICRO_COLS 8
+
+static_assert(L2_BLOCK % MICRO_ROWS == 0 && L3_BLOCK % MICRO_COLS == 0, "Blocks must be made of whole micro-blocks");
+
+// Sizes for the cache-oblivious transpose.
+#define TRANSPOSE_TILE 8  // Size of the square tiles transposed in registers, a tile of ints fills 8 AVX2 registers.
+#define TRANSPOSE_LEAF 64  // Size of the blocks the recursive transpose stops splitting at.
+
+static_assert(TRANSPOSE_TILE == 8 && TRANSPOSE_LEAF >= 2 * TRANSPOSE_TILE, "The tile kernels work on 8 x 8 tiles");
+
+#pragma region Element Types
+
+// The type of the elements of the matrices, one of int32_t, int64_t, float or double.
+using matrix_t = int32_t;
+
+
+// The type that the products are summed up in for each type of element.
+// Integers wrap around the same whether they are summed wider or not, so they are summed in their own type.
+// Floats are summed up as doubles to hold onto the precision over long sums. The packed multiply only widens the
+// sums within each L1_BLOCK deep block of the shared dimension, rounding the running total back to float after each.
+template <typename T>
+struct Accumulator
+{
+    using type = T;
+};
+
+template <>
+struct Accumulator<float>
+{
+    using type = double;
+};
+
+template <typename T>
+using accumulator_t = typename Accumulator<T>::type;
+
+
+// Turns a random integer into an element between 0 and 100, with two decimal places for floating point types.
+template <typename T>
+T randomElement(int const random)
+{
+    if constexpr (is_floating_point_v<T>)
+    {
+        return (T)(random % 10000) / 100;
+    }
+    else
+    {
+        return (T)(random % 100);
+    }
+}
+
+#pragma endregion
+
+
+#pragma region Dot Product Kernels
+
+// Signature of the kernels that compute a single element of the result, as the dot product of two rows.
+using dot_product_t = int32_t (*)(int32_t const row1[], int32_t const row2[], int const size);
+
+
+// Computes the dot product of two rows one element at a time.
+// Used as the fallback when the CPU doesn't support any of the vector instruction sets, and for every other type.
+template <typename T>
+T dotProductScalar(T const row1[], T const row2[], int const size)
+{
+    accumulator_t<T> result = 0;
+    for (auto k = 0; k < size; k++)
+    {
+        result += (accumulator_t<T>)row1[k] * row2[k];
+    }
+
+    return (T)result;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Computes the dot product of two rows 8 elements at a time with AVX2.
+// Two accumulators are used to hide the latency of the multiply, the leftover elements are done one at a time.
+__attribute__((target("avx2")))
+int32_t dotProductAvx2(int32_t const row1[], int32_t const row2[], int const size)
+{
+    __m256i sum1 = _mm256_setzero_si256();
+    __m256i sum2 = _mm256_setzero_si256();
+
+    auto k = 0;
+    for (; k + 16 <= size; k += 16)
+    {
+        auto a1 = _mm256_loadu_si256((__m256i const *)&row1[k]);
+        auto b1 = _mm256_loadu_si256((__m256i const *)&row2[k]);
+        auto a2 = _mm256_loadu_si256((__m256i const *)&row1[k + 8]);
+        auto b2 = _mm256_loadu_si256((__m256i const *)&row2[k + 8]);
+
+        sum1 = _mm256_add_epi32(sum1, _mm256_mullo_epi32(a1, b1));
+        sum2 = _mm256_add_epi32(sum2, _mm256_mullo_epi32(a2, b2));
+    }
+
+    for (; k + 8 <= size; k += 8)
+    {
+        auto a = _mm256_loadu_si256((__m256i const *)&row1[k]);
+        auto b = _mm256_loadu_si256((__m256i const *)&row2[k]);
+
+        sum1 = _mm256_add_epi32(sum1, _mm256_mullo_epi32(a, b));
+    }
+
+    // Add the lanes of the accumulators together.
+    auto sum = _mm256_add_epi32(sum1, sum2);
+    auto half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    int result = _mm_cvtsi128_si32(half);
+    for (; k < size; k++)
+    {
+        result += row1[k] * row2[k];
+    }
+
+    return result;
+}
+
+
+// Computes the dot product of two rows 16 elements at a time with AVX-512.
+// The leftover elements are done with a masked load instead of a scalar loop.
+__attribute__((target("avx512f")))
+int32_t dotProductAvx512(int32_t const row1[], int32_t const row2[], int const size)
+{
+    __m512i sum1 = _mm512_setzero_si512();
+    __m512i sum2 = _mm512_setzero_si512();
+
+    auto k = 0;
+    for (; k + 32 <= size; k += 32)
+    {
+        auto a1 = _mm512_loadu_si512(&row1[k]);
+        auto b1 = _mm512_loadu_si512(&row2[k]);
+        auto a2 = _mm512_loadu_si512(&row1[k + 16]);
+        auto b2 = _mm512_loadu_si512(&row2[k + 16]);
+
+        sum1 = _mm512_add_epi32(sum1, _mm512_mullo_epi32(a1, b1));
+        sum2 = _mm512_add_epi32(sum2, _mm512_mullo_epi32(a2, b2));
+    }
+
+    for (; k < size; k += 16)
+    {
+        // Only load the lanes that are still inside of the rows.
+        auto mask = (__mmask16)(size - k >= 16 ? 0xFFFF : (1 << (size - k)) - 1);
+        auto a = _mm512_maskz_loadu_epi32(mask, &row1[k]);
+        auto b = _mm512_maskz_loadu_epi32(mask, &row2[k]);
+
+        sum1 = _mm512_add_epi32(sum1, _mm512_mullo_epi32(a, b));
+    }
+
+    // Add the lanes of the accumulators together. They are stored and summed rather than going through
+    // _mm512_reduce_add_epi32, which makes GCC 12 warn about its own headers.
+    alignas(64) int lanes[16];
+    _mm512_store_si512(lanes, _mm512_add_epi32(sum1, sum2));
+
+    int result = 0;
+    for (auto lane: lanes)
+    {
+        result += lane;
+    }
+
+    return result;
+}
+
+#endif
+
+
+// Picks the fastest dot product kernel the CPU supports, by checking its CPUID flags.
+dot_product_t selectDotProduct()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return dotProductAvx512;
+    }
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return dotProductAvx2;
+    }
+#endif
+
+    return dotProductScalar<int32_t>;
+}
+
+
+// Gives the name of a dot product kernel, for printing out which one is in use.
+string dotProductName(dot_product_t const kernel)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (kernel == dotProductAvx512)
+    {
+        return "AVX-512";
+    }
+
+    if (kernel == dotProductAvx2)
+    {
+        return "AVX2";
+    }
+#endif
+
+    return "Scalar";
+}
+
+
+// The dot product kernel to use for 32 bit integers, picked once at startup.
+dot_product_t const dotProductKernel = selectDotProduct();
+
+
+// Computes the dot product of two rows with the best kernel for the element type.
+// Only 32 bit integers have vector kernels, anything else is done one element at a time.
+template <typename T>
+T dotProduct(T const row1[], T const row2[], int const size)
+{
+    if constexpr (is_same_v<T, int32_t>)
+    {
+        return dotProductKernel(row1, row2, size);
+    }
+    else
+    {
+        return dotProductScalar(row1, row2, size);
+    }
+}
+
+#pragma endregion
+
+
 // Helper function to print arrays
-void printMatrix(int const matrix[], int const size)
+template <typename T>
+void printMatrix(T const matrix[], int const size)
 {
     for (auto i = 0; i < std::min(20, size); i++)
     {
@@ -31,19 +279,165 @@ void printMatrix(int const matrix[], int const size)
 }
 
 
+#pragma region Transpose Kernels
+
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile one element at a time.
+// The tile is read in full before any of it is written, so the input and output can be the same tile.
+template <typename T>
+void transposeTileScalar(T const input[], int const inputStride, T output[], int const outputStride)
+{
+    T tile[TRANSPOSE_TILE][TRANSPOSE_TILE];
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++)
+    {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++)
+        {
+            tile[j][i] = input[i * inputStride + j];
+        }
+    }
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++)
+    {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++)
+        {
+            output[i * outputStride + j] = tile[i][j];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Transposes an 8 x 8 tile inside of 8 AVX2 registers.
+// Pairs of rows are interleaved 32 bits at a time, then 64 bits at a time, then the 128 bit halves are swapped
+// over, which leaves each register holding a column.
+template <typename T>
+__attribute__((target("avx2")))
+void transposeTileAvx2(T const input[], int const inputStride, T output[], int const outputStride)
+{
+    static_assert(sizeof(T) == 4, "The AVX2 tile kernel works on 32 bit elements");
+
+    __m256i rows[8];
+    for (auto i = 0; i < 8; i++)
+    {
+        rows[i] = _mm256_loadu_si256((__m256i const *)&input[i * inputStride]);
+    }
+
+    __m256i pairs[8];
+    for (auto i = 0; i < 8; i += 2)
+    {
+        pairs[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+    }
+
+    __m256i quads[8];
+    for (auto i = 0; i < 8; i += 4)
+    {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+
+    for (auto i = 0; i < 4; i++)
+    {
+        auto const low = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20);
+        auto const high = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31);
+        _mm256_storeu_si256((__m256i *)&output[i * outputStride], low);
+        _mm256_storeu_si256((__m256i *)&output[(i + 4) * outputStride], high);
+    }
+}
+#endif
+
+// If the CPU supports the AVX2 tile kernel, checked once when the program starts.
+#if defined(__x86_64__) || defined(__i386__)
+bool const transposeAvx2 = __builtin_cpu_supports("avx2");
+#endif
+
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile with the best kernel for the element type.
+// Only 32 bit elements fill an 8 x 8 tile of AVX2 registers, anything else is done one element at a time.
+template <typename T>
+void transposeTile(T const input[], int const inputStride, T output[], int const outputStride)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if constexpr (sizeof(T) == 4)
+    {
+        if (transposeAvx2)
+        {
+            transposeTileAvx2(input, inputStride, output, outputStride);
+            return;
+        }
+    }
+#endif
+
+    transposeTileScalar(input, inputStride, output, outputStride);
+}
+
+// Transposes a block that fits in cache, a tile at a time, with the edges that don't make up a whole tile done
+// one element at a time.
+template <typename T>
+void transposeLeaf(T const input[], int const inputStride, T output[], int const outputStride,
+                   int const rows, int const cols)
+{
+    auto const tileRows = rows / TRANSPOSE_TILE * TRANSPOSE_TILE;
+    auto const tileCols = cols / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    for (auto i = 0; i < tileRows; i += TRANSPOSE_TILE)
+    {
+        for (auto j = 0; j < tileCols; j += TRANSPOSE_TILE)
+        {
+            transposeTile(&input[i * inputStride + j], inputStride, &output[j * outputStride + i], outputStride);
+        }
+    }
+
+    for (auto i = 0; i < rows; i++)
+    {
+        for (auto j = i < tileRows ? tileCols : 0; j < cols; j++)
+        {
+            output[j * outputStride + i] = input[i * inputStride + j];
+        }
+    }
+}
+
+// Transposes a rows x cols block of the input into a cols x rows block of the output.
+// The longer side is split in half until the block fits in cache, so the transpose makes good use of every cache
+// level without having to know their sizes.
+template <typename T>
+void transposeBlock(T const input[], int const inputStride, T output[], int const outputStride,
+                    int const rows, int const cols)
+{
+    if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF)
+    {
+        transposeLeaf(input, inputStride, output, outputStride, rows, cols);
+    }
+    else if (rows >= cols)
+    {
+        // Split on a tile boundary, so only the real edges of the matrix are left out of the tile kernel.
+        auto const half = rows / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transposeBlock(input, inputStride, output, outputStride, half, cols);
+        transposeBlock(&input[half * inputStride], inputStride, &output[half], outputStride, rows - half, cols);
+    }
+    else
+    {
+        auto const half = cols / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transposeBlock(input, inputStride, output, outputStride, rows, half);
+        transposeBlock(&input[half], inputStride, &output[half * outputStride], outputStride, rows, cols - half);
+    }
+}
+
+
+#pragma endregion
+
+
 // Transposes a matrix into another pointer.
-// Splits up the rows between threads.
-void transpose(int const inputMatrix[], int outputMatrix[], int const size)
+// Splits up the rows between threads in bands of TRANSPOSE_LEAF rows, each one transposed cache-obliviously.
+template <typename T>
+void transpose(T const inputMatrix[], T outputMatrix[], int const size)
 {
     // Worker function to transpose the matrix.
     auto worker = [=](int const threadId, int const threadCount)
     {
-        for (auto i = threadId; i < size; i += threadCount)
+        for (auto i = threadId * TRANSPOSE_LEAF; i < size; i += threadCount * TRANSPOSE_LEAF)
         {
-            for (auto j = 0; j < size; j++)
-            {
-                outputMatrix[j * size + i] = inputMatrix[i * size + j];
-            }
+            transposeBlock(&inputMatrix[i * size], size, &outputMatrix[i], size, min(TRANSPOSE_LEAF, size - i), size);
         }
     };
 
@@ -62,31 +456,209 @@ void transpose(int const inputMatrix[], int outputMatrix[], int const size)
 }
 
 
+#pragma region Packed Panels
+
+// Allocates a buffer for a packed panel, aligned to a cache line so the panels never straddle one.
+template <typename T>
+T *allocatePacked(unsigned long const count)
+{
+    auto const bytes = (count * sizeof(T) + 63) / 64 * 64;
+    return (T *)aligned_alloc(64, bytes);
+}
+
+
+// Copies a rows x depth block of the first matrix into a packed buffer.
+// The block is stored as MICRO_ROWS tall strips, each one laid out column after column, so the micro-kernel
+// reads it contiguously. Strips at the edge of the matrix are padded out with zeros.
+template <typename T>
+void packA(T const m1[], T packed[], unsigned long const size, unsigned long const rows,
+           unsigned long const depth)
+{
+    for (unsigned long i = 0; i < rows; i += MICRO_ROWS)
+    {
+        auto const height = min<unsigned long>(MICRO_ROWS, rows - i);
+
+        for (unsigned long k = 0; k < depth; k++)
+        {
+            for (unsigned long ii = 0; ii < MICRO_ROWS; ii++)
+            {
+                *packed++ = ii < height ? m1[(i + ii) * size + k] : 0;
+            }
+        }
+    }
+}
+
+
+// Copies a depth x width strip of the second matrix into a packed buffer, laid out row after row.
+// The strip is at most MICRO_COLS wide, and is padded out with zeros to that width.
+template <typename T>
+void packBStrip(T const m2[], T packed[], unsigned long const size, unsigned long const depth,
+                unsigned long const width)
+{
+    for (unsigned long k = 0; k < depth; k++)
+    {
+        for (unsigned long j = 0; j < MICRO_COLS; j++)
+        {
+            *packed++ = j < width ? m2[k * size + j] : 0;
+        }
+    }
+}
+
+
+// Computes a rows x cols block of the result from a packed strip of each matrix.
+// The partial sums for the whole MICRO_ROWS x MICRO_COLS block are held in registers, the padding in the strips
+// means the loops always have constant bounds so they can be unrolled and vectorised.
+// The first block of the shared dimension stores its sums, the rest add onto them, so the sums are only as wide as
+// accumulator_t within a block and are rounded back to T between blocks.
+template <typename T>
+void microKernel(T const aStrip[], T const bStrip[], T c[], unsigned long const size,
+                 unsigned long const depth, unsigned long const rows, unsigned long const cols, bool const first)
+{
+    accumulator_t<T> accumulator[MICRO_ROWS][MICRO_COLS] = {};
+
+    for (unsigned long k = 0; k < depth; k++)
+    {
+        for (auto i = 0; i < MICRO_ROWS; i++)
+        {
+            accumulator_t<T> const aValue = aStrip[k * MICRO_ROWS + i];
+
+            for (auto j = 0; j < MICRO_COLS; j++)
+            {
+                accumulator[i][j] += aValue * bStrip[k * MICRO_COLS + j];
+            }
+        }
+    }
+
+    // Only write back the part of the block that is inside of the matrix.
+    for (unsigned long i = 0; i < rows; i++)
+    {
+        for (unsigned long j = 0; j < cols; j++)
+        {
+            c[i * size + j] = (T)(first ? accumulator[i][j] : c[i * size + j] + accumulator[i][j]);
+        }
+    }
+}
+
+
+// Multiplies a packed block of the first matrix with a packed panel of the second matrix, walking over the
+// register sized blocks of the result.
+template <typename T>
+void multiplyPackedBlock(T const aPacked[], T const bPacked[], T c[], unsigned long const size,
+                         unsigned long const rows, unsigned long const cols, unsigned long const depth,
+                         bool const first)
+{
+    for (unsigned long j = 0; j < cols; j += MICRO_COLS)
+    {
+        for (unsigned long i = 0; i < rows; i += MICRO_ROWS)
+        {
+            microKernel(&aPacked[i * depth], &bPacked[j * depth], &c[i * size + j], size, depth,
+                        min<unsigned long>(MICRO_ROWS, rows - i), min<unsigned long>(MICRO_COLS, cols - j), first);
+        }
+    }
+}
+
+
+// Multiplies two matrices with packed panels, splitting the rows of the result between threads.
+// The threads share the packing of each panel of the second matrix, then each one packs and multiplies its own
+// row blocks of the first matrix. Barriers keep the threads in step so a panel isn't repacked while still in use.
+template <typename T>
+void multiplyPacked(T const m1[], T const m2[], T m3[], unsigned long const size)
+{
+    // Shrink the row blocks for small matrices so every thread still gets a block to work on.
+    auto const rowsPerThread = (size + THREAD_COUNT - 1) / THREAD_COUNT;
+    auto const rowBlock = min<unsigned long>(L2_BLOCK, (rowsPerThread + MICRO_ROWS - 1) / MICRO_ROWS * MICRO_ROWS);
+
+    // The panel of the second matrix is shared between all the threads.
+    T *bPacked = allocatePacked<T>(L1_BLOCK * L3_BLOCK);
+    std::barrier sync(THREAD_COUNT);
+
+    // Worker function to multiply the row blocks assigned to a thread, cyclically.
+    auto worker = [&](int const threadId)
+    {
+        T *aPacked = allocatePacked<T>(L2_BLOCK * L1_BLOCK);
+
+        for (unsigned long jBlock = 0; jBlock < size; jBlock += L3_BLOCK)
+        {
+            auto const cols = min<unsigned long>(L3_BLOCK, size - jBlock);
+
+            for (unsigned long kBlock = 0; kBlock < size; kBlock += L1_BLOCK)
+            {
+                auto const depth = min<unsigned long>(L1_BLOCK, size - kBlock);
+
+                // Pack this thread's share of the strips of the panel, then wait for the others to pack theirs.
+                for (unsigned long j = threadId * MICRO_COLS; j < cols; j += THREAD_COUNT * MICRO_COLS)
+                {
+                    packBStrip(&m2[kBlock * size + jBlock + j], &bPacked[j * depth], size, depth,
+                               min<unsigned long>(MICRO_COLS, cols - j));
+                }
+                sync.arrive_and_wait();
+
+                for (auto iBlock = threadId * rowBlock; iBlock < size; iBlock += THREAD_COUNT * rowBlock)
+                {
+                    auto const rows = min<unsigned long>(rowBlock, size - iBlock);
+
+                    packA(&m1[iBlock * size + kBlock], aPacked, size, rows, depth);
+                    multiplyPackedBlock(aPacked, bPacked, &m3[iBlock * size + jBlock], size, rows, cols, depth,
+                                        kBlock == 0);
+                }
+
+                // Wait for everyone to finish with the panel before it gets repacked.
+                sync.arrive_and_wait();
+            }
+        }
+
+        free(aPacked);
+    };
+
+    // Start the workers, then wait for them to finish.
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; i++)
+    {
+        threads.emplace_back(worker, i);
+    }
+
+    for (auto &thread: threads)
+    {
+        thread.join();
+    }
+
+    free(bPacked);
+}
+
+#pragma endregion
+
+
 int main()
 {
     // Set up the matrix column size, and total length of the storage arrays
     unsigned long constexpr size = 1024;
     unsigned long constexpr length = size * size;
 
+#ifndef PACKED_MULTIPLY
+    cout << "Dot product kernel: " << (is_same_v<matrix_t, int32_t> ? dotProductName(dotProductKernel) : "Scalar")
+         << endl;
+#endif
+
     // Worker function to fill a matrix with random values using threads.
     // Splits the matrix into blocks for each thread to calculate.
-    auto randomiseWorker = [&](int const block, int const blockSize, int matrix[])
+    auto randomiseWorker = [&](int const block, int const blockSize, matrix_t matrix[])
     {
         // Generate a seed for the PRNG engine with the time and thread id.
         unsigned int seed = time(nullptr) * (hash<std::thread::id>()(std::this_thread::get_id()) + 1);
 
-        // Loop through the matrix, generating a random integer between 0 and 100 for each slot.
+        // Loop through the matrix, generating a random element between 0 and 100 for each slot.
         for (auto i = block * blockSize; i < (block + 1) * blockSize; i++)
         {
-            matrix[i] = rand_r(&seed) % 100;
+            matrix[i] = randomElement<matrix_t>(rand_r(&seed));
         }
     };
 
+#ifndef PACKED_MULTIPLY
     // Worker function to calculate the matrix multiplication of matrices.
     // Each row will be calculated by a different thread, cyclically.
     auto multiplyWorker = [&](
-            int const threadId, int const assignedThreads, int const matrix1[], int const matrix2Transposed[],
-            int matrix3[], int const size
+            int const threadId, int const assignedThreads, matrix_t const matrix1[],
+            matrix_t const matrix2Transposed[], matrix_t matrix3[], int const size
     )
     {
         // i represents the row and j represents the column of the output matrix that is being calculated.
@@ -95,20 +667,16 @@ int main()
             for (auto j = 0; j < size; j++)
             {
                 // Sum up the multiplication of row and column of the input matrices.
-                int temp = 0;
-                for (auto k = 0; k < size; k++)
-                {
-                    temp += matrix1[i * size + k] * matrix2Transposed[j * size + k];
-                }
-                matrix3[i * size + j] = temp;
+                matrix3[i * size + j] = dotProduct(&matrix1[i * size], &matrix2Transposed[j * size], size);
             }
         }
     };
+#endif
 
     // Allocate memory for the matrices
-    int *m1 = new int[length];
-    int *m2 = new int[length];
-    int *m3 = new int[length];
+    matrix_t *m1 = new matrix_t[length];
+    matrix_t *m2 = new matrix_t[length];
+    matrix_t *m3 = new matrix_t[length];
 
     // Randomise the input matrices, parallelising the calculations with threads.
     {
@@ -139,10 +707,13 @@ int main()
     auto start = high_resolution_clock::now();
 
     // Compute the matrix multiplication of the matrices.
+#ifdef PACKED_MULTIPLY
+    multiplyPacked(m1, m2, m3, size);
+#else
     {
         // Transpose the second matrix to make it so that it is multiplying rows by rows.
         // This further helps with caching, it uses contiguous memory instead of jumping around.
-        int *m2Transposed = new int[length];
+        matrix_t *m2Transposed = new matrix_t[length];
         transpose(m2, m2Transposed, size);
 
         // Start worker threads to compute the matrix multiplication.
@@ -160,6 +731,7 @@ int main()
 
         delete[] m2Transposed;
     }
+#endif
 
     // Store the time after the execution of the algorithm.
     auto stop = high_resolution_clock::now();
@@ -1,9 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <CL/cl.h>
 
 #define PRINT 1
 
+// Set to 1 to time the kernel with every work-group size the device allows, saving the fastest for later runs
+#define TUNE 0
+// The number of times each work-group size is timed, keeping the fastest
+#define TUNE_RUNS 3
+// Where the tuned work-group sizes are kept, by size of vector and device
+#define TUNING_FILENAME "./vector_ops.cl.tuning"
+
 int SZ = 8;
 int *v;
 
@@ -24,12 +33,32 @@ cl_event event = NULL;
 
 int err;
 
+// The number of work items in each work-group, or 0 to leave it to the implementation
+size_t local_size = 0;
+
+// Whether the buffers use the host vectors in place, rather than holding copies of them
+int zero_copy = 0;
+
 // Finds a valid device to use and returns its ID
 cl_device_id create_device();
 // Sets up a context for a given kernel, detecting the platform and device to use automatically.
 void setup_openCL_device_context_queue_kernel(char *filename, char *kernelname);
 // Builds the program from the file for the context and device.
 cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename);
+// Loads and builds a cached binary of a program, returning NULL if there isn't a usable one.
+cl_program load_program_binary(cl_context ctx, cl_device_id dev, const char *cache_filename, const char *cache_key);
+// Saves the binary of a built program so later runs can skip compiling it.
+void save_program_binary(cl_program program, const char *cache_filename, const char *cache_key);
+// Loads the work-group size tuned for this device and size of vector in an earlier run, if there is one.
+void load_local_size();
+// Times the kernel with every work-group size that fits, then uses and saves the fastest.
+void tune_local_size();
+// Saves the work-group size tuned for this device and size of vector, replacing any it had before.
+void save_local_size(size_t size);
+// Checks if a line of the tuning file is for this device and size of vector, and if so gets its work-group size.
+int read_tuning_line(char *line, const char *device_name, size_t *size);
+// Rounds a size of vector up to the bucket its tuning is kept under, the next power of 2.
+int size_bucket(int size);
 // Creates a memory buffer for the kernel and pushes data to it
 void setup_kernel_memory();
 // Copies function arguments to the kernel function
@@ -37,6 +66,9 @@ void copy_kernel_args();
 // Free's all the dynamic memory leftover
 void free_memory();
 
+// Hashes a string, used to name the cached program binaries.
+unsigned long long hash_string(const char *string, size_t size);
+
 void init(int *&A, int size);
 void print(int *A, int size);
 
@@ -56,6 +88,12 @@ int main(int argc, char **argv)
 
     setup_openCL_device_context_queue_kernel((char *)"./vector_ops.cl", (char *)"square_magnitude");
 
+    // Use the fastest work-group size for this device and size of vector, tuning it first if asked to
+    if (TUNE)
+        tune_local_size();
+    else
+        load_local_size();
+
     setup_kernel_memory();
     copy_kernel_args();
 
@@ -63,14 +101,24 @@ int main(int argc, char **argv)
     //
     // The rest of the arguments define the arrays that are used to specify information about the
     // work items and groups that will be executed
-    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 0, NULL, &event);
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, local_size > 0 ? &local_size : NULL, 0, NULL, &event);
     clWaitForEvents(1, &event);
 
     // Adds a command to read the result array from the buffer back into v
     //
     // blocking_read is set to true to make sure it is synchronous.
     // The other arguments define where in the buffer to read and where to save
-    clEnqueueReadBuffer(queue, bufV, CL_TRUE, 0, SZ * sizeof(int), &v[0], 0, NULL, NULL);
+    if (zero_copy)
+    {
+        // The buffer is v itself, so mapping it just makes sure the results are there without copying them
+        int *mapped = (int *)clEnqueueMapBuffer(queue, bufV, CL_TRUE, CL_MAP_READ, 0, SZ * sizeof(int), 0, NULL, NULL, &err);
+        clEnqueueUnmapMemObject(queue, bufV, mapped, 0, NULL, NULL);
+        clFinish(queue);
+    }
+    else
+    {
+        clEnqueueReadBuffer(queue, bufV, CL_TRUE, 0, SZ * sizeof(int), &v[0], 0, NULL, NULL);
+    }
 
     // result vector
     print(v, SZ);
@@ -82,7 +130,12 @@ int main(int argc, char **argv)
 
 void init(int *&A, int size)
 {
-    A = (int *)malloc(sizeof(int) * size);
+    // Page aligned, so a device that shares memory with the host can use it in place
+    if (posix_memalign((void **)&A, sysconf(_SC_PAGESIZE), sizeof(int) * size) != 0)
+    {
+        perror("Couldn't allocate a vector");
+        exit(1);
+    }
 
     for (long i = 0; i < size; i++)
     {
@@ -150,8 +203,164 @@ void copy_kernel_args()
     }
 }
 
+void load_local_size()
+{
+    FILE *tuning_handle;
+    char device_name[256], line[512];
+    size_t size;
+
+    tuning_handle = fopen(TUNING_FILENAME, "r");
+    if (tuning_handle == NULL)
+    {
+        return;
+    }
+
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    while (fgets(line, sizeof(line), tuning_handle) != NULL)
+    {
+        // Every work-group has to be the same size, so it has to divide the vector, which isn't a given in its bucket
+        if (read_tuning_line(line, device_name, &size) && (size == 0 || SZ % size == 0))
+        {
+            local_size = size;
+        }
+    }
+    fclose(tuning_handle);
+}
+
+void tune_local_size()
+{
+    char device_name[256];
+    size_t global[1] = {(size_t)SZ};
+    size_t max_size, candidate, best_size = 0;
+    cl_ulong start, end, best_time = 0;
+    cl_event run;
+    cl_mem scratch;
+
+    // The kernel runs on a scratch buffer, so the vector is left as it is
+    scratch = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, NULL);
+    clSetKernelArg(kernel, 0, sizeof(int), (void *)&SZ);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&scratch);
+
+    // The kernel can have a lower limit than the device, depending on how many registers it needs
+    clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_size), &max_size, NULL);
+
+    // Try leaving it to the implementation, then every power of 2 from 16 up that fits and divides the vector
+    for (candidate = 0; candidate <= max_size; candidate = candidate == 0 ? 16 : candidate * 2)
+    {
+        if (candidate > 0 && SZ % candidate != 0)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < TUNE_RUNS; i++)
+        {
+            if (clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, candidate > 0 ? &candidate : NULL, 0, NULL,
+                                       &run) < 0)
+            {
+                break;
+            }
+            clWaitForEvents(1, &run);
+            clGetEventProfilingInfo(run, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+            clGetEventProfilingInfo(run, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+            clReleaseEvent(run);
+
+            if (best_time == 0 || end - start < best_time)
+            {
+                best_time = end - start > 0 ? end - start : 1;
+                best_size = candidate;
+            }
+        }
+    }
+
+    clReleaseMemObject(scratch);
+
+    local_size = best_size;
+    save_local_size(best_size);
+
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    printf("Tuned %s for vectors of up to %d: work-group size %zu (0 is the implementation's choice)\n", device_name,
+           size_bucket(SZ), best_size);
+}
+
+void save_local_size(size_t size)
+{
+    FILE *tuning_handle, *temp_handle;
+    char device_name[256], line[512], temp_filename[1100];
+    size_t line_size;
+    int written = 1;
+
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+
+    // Copy every other line into a temporary file along with this one, then rename that into place like the binaries
+    snprintf(temp_filename, sizeof(temp_filename), "%s.%d.tmp", TUNING_FILENAME, (int)getpid());
+    temp_handle = fopen(temp_filename, "w");
+    if (temp_handle == NULL)
+    {
+        return;
+    }
+
+    tuning_handle = fopen(TUNING_FILENAME, "r");
+    if (tuning_handle != NULL)
+    {
+        while (fgets(line, sizeof(line), tuning_handle) != NULL)
+        {
+            if (!read_tuning_line(line, device_name, &line_size))
+            {
+                written = written && fprintf(temp_handle, "%s\n", line) >= 0;
+            }
+        }
+        fclose(tuning_handle);
+    }
+    written = written && fprintf(temp_handle, "%d %zu %s\n", size_bucket(SZ), size, device_name) >= 0;
+
+    if (fclose(temp_handle) == 0 && written)
+    {
+        rename(temp_filename, TUNING_FILENAME);
+    }
+    else
+    {
+        remove(temp_filename);
+    }
+}
+
+int read_tuning_line(char *line, const char *device_name, size_t *size)
+{
+    int bucket, name_start = 0;
+
+    // Each line is a size bucket, the work-group size, then the device name
+    line[strcspn(line, "\r\n")] = '\0';
+    if (sscanf(line, "%d %zu %n", &bucket, size, &name_start) != 2 || name_start == 0)
+    {
+        return 0;
+    }
+
+    return bucket == size_bucket(SZ) && strcmp(line + name_start, device_name) == 0;
+}
+
+int size_bucket(int size)
+{
+    int bucket = 1;
+    while (bucket < size)
+    {
+        bucket *= 2;
+    }
+
+    return bucket;
+}
+
 void setup_kernel_memory()
 {
+    // A device that shares memory with the host, like a CPU, can work on the vectors where they are.
+    // So the buffers just wrap them rather than copying them over.
+    cl_bool unified_memory = CL_FALSE;
+    clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified_memory), &unified_memory, NULL);
+    if (unified_memory == CL_TRUE)
+    {
+        bufV = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, SZ * sizeof(int), v, NULL);
+        zero_copy = 1;
+        return;
+    }
+
     // Create a buffer to hold the input vector
     // It is created as a read write buffer, meaning it can be used as a general storage.
     bufV = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, NULL);
@@ -176,8 +385,9 @@ void setup_openCL_device_context_queue_kernel(char *filename, char *kernelname)
 
     program = build_program(context, device_id, filename);
 
-    // Create a command queue for a specific device
-    queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
+    // Create a command queue for a specific device, timing its commands when tuning
+    cl_queue_properties properties[] = {CL_QUEUE_PROPERTIES, TUNE ? CL_QUEUE_PROFILING_ENABLE : 0, 0};
+    queue = clCreateCommandQueueWithProperties(context, device_id, properties, &err);
     if (err < 0)
     {
         perror("Couldn't create a command queue");
@@ -217,6 +427,23 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
     fread(program_buffer, sizeof(char), program_size, program_handle);
     fclose(program_handle);
 
+    // The compiled binary is cached next to the source, keyed by the device, driver, build options and source.
+    // A binary only works for the same device and driver that built it.
+    char device_name[256], driver_version[256], cache_key[1024], cache_filename[1024];
+    clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(driver_version), driver_version, NULL);
+    snprintf(cache_key, sizeof(cache_key), "%s|%s|%s|%llx", device_name, driver_version, "",
+             hash_string(program_buffer, program_size));
+    snprintf(cache_filename, sizeof(cache_filename), "%s.%llx.bin", filename,
+             hash_string(cache_key, strlen(cache_key)));
+
+    program = load_program_binary(ctx, dev, cache_filename, cache_key);
+    if (program != NULL)
+    {
+        free(program_buffer);
+        return program;
+    }
+
     // Loads a program and compiles it for a given context
     program = clCreateProgramWithSource(ctx, 1,
                                         (const char **)&program_buffer, &program_size, &err);
@@ -250,9 +477,114 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
         exit(1);
     }
 
+    save_program_binary(program, cache_filename, cache_key);
+
     return program;
 }
 
+unsigned long long hash_string(const char *string, size_t size)
+{
+    // 64 bit FNV-1a
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ (unsigned char)string[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+cl_program load_program_binary(cl_context ctx, cl_device_id dev, const char *cache_filename, const char *cache_key)
+{
+    FILE *cache_handle;
+    char cached_key[1024];
+    unsigned char *binary;
+    size_t binary_size;
+    cl_int binary_status;
+    cl_program program;
+
+    cache_handle = fopen(cache_filename, "rb");
+    if (cache_handle == NULL)
+    {
+        return NULL;
+    }
+
+    // The first line of the file is the key it was saved under, in case two keys hash the same
+    if (fgets(cached_key, sizeof(cached_key), cache_handle) == NULL ||
+        strncmp(cached_key, cache_key, strlen(cache_key)) != 0 || cached_key[strlen(cache_key)] != '\n')
+    {
+        fclose(cache_handle);
+        return NULL;
+    }
+
+    // The rest of it is the binary
+    long binary_start = ftell(cache_handle);
+    fseek(cache_handle, 0, SEEK_END);
+    binary_size = ftell(cache_handle) - binary_start;
+    fseek(cache_handle, binary_start, SEEK_SET);
+    binary = (unsigned char *)malloc(binary_size);
+    binary_size = fread(binary, 1, binary_size, cache_handle);
+    fclose(cache_handle);
+
+    program = clCreateProgramWithBinary(ctx, 1, &dev, &binary_size, (const unsigned char **)&binary,
+                                        &binary_status, &err);
+    free(binary);
+
+    // Even a binary program has to be built, though there is nothing left to compile.
+    // If the driver won't take it, it is removed rather than tried again on every run.
+    if (err < 0 || binary_status < 0 || clBuildProgram(program, 1, &dev, NULL, NULL, NULL) < 0)
+    {
+        if (program != NULL)
+        {
+            clReleaseProgram(program);
+        }
+        remove(cache_filename);
+        return NULL;
+    }
+
+    return program;
+}
+
+void save_program_binary(cl_program program, const char *cache_filename, const char *cache_key)
+{
+    FILE *temp_handle;
+    char temp_filename[1100];
+    unsigned char *binary;
+    size_t binary_size;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL) < 0 ||
+        binary_size == 0)
+    {
+        return;
+    }
+
+    binary = (unsigned char *)malloc(binary_size);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) < 0)
+    {
+        free(binary);
+        return;
+    }
+
+    // Write it to a temporary file and rename that into place, so nothing ever loads a half written binary
+    snprintf(temp_filename, sizeof(temp_filename), "%s.%d.tmp", cache_filename, (int)getpid());
+    temp_handle = fopen(temp_filename, "wb");
+    if (temp_handle != NULL)
+    {
+        int written = fprintf(temp_handle, "%s\n", cache_key) >= 0 &&
+                      fwrite(binary, 1, binary_size, temp_handle) == binary_size;
+        if (fclose(temp_handle) == 0 && written)
+        {
+            rename(temp_filename, cache_filename);
+        }
+        else
+        {
+            remove(temp_filename);
+        }
+    }
+
+    free(binary);
+}
+
 cl_device_id create_device() {
 
    cl_platform_id platform;
@@ -1,24 +1,53 @@
 #include <random>
 #include <algorithm>
 #include <chrono>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <fstream>
 #include <mpi.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include "MatrixMultiplyCl.h"
+#include "MultiDeviceMultiplyCl.h"
 
 //#define PRINT_INPUTS_AND_OUTPUTS  // If the input and output matrices should be printed
 //#define DEBUG
 #define UNCOUNTED_TRANSPOSE  // If the transpose should happen before the timer or after
 #define NON_ROOT_PRIORITY  // If the remaining rows should be assigned with priority to non-root nodes
+#define COMPACT_TRANSFER  // If the input matrices should be sent as 8 bit elements when all of them fit
+//#define SHARED_MATRIX2  // If matrix2 should be held once per node in a shared window instead of by every process
+//#define FILE_IO  // If the matrices should be read from and written to files with MPI-IO instead of going through root
+//#define STATIONARY_MATRIX2  // If STREAM_MATRICES matrix1s should be multiplied with one matrix2 kept on the devices
+//#define TUNE_KERNEL  // If the kernel should be tuned for this size of matrices first, saving the result for later runs
 
 
 // Type aliases for our usage
 using matrix_t = int;
 using my_size_t = int;
+using compact_t = uint8_t;  // The type the input matrices are sent as with COMPACT_TRANSFER
 
 
 // The size of the rows and columns of the matrix
 constexpr my_size_t MATRIX_SIZE = 4096;
 
+// The files the input matrices are read from and the result is written to with FILE_IO, as rows of binary ints.
+constexpr const char *MATRIX1_FILE = "matrix1.bin";
+constexpr const char *MATRIX2_FILE = "matrix2.bin";
+constexpr const char *RESULT_FILE = "result.bin";
+
+// The number of matrix1s multiplied with the same matrix2 with STATIONARY_MATRIX2.
+constexpr my_size_t STREAM_MATRICES = 8;
+
+// Sizes for the cache-oblivious transpose.
+constexpr my_size_t TRANSPOSE_TILE = 8;  // Size of the square tiles transposed in registers, a tile of ints fills 8 AVX2 registers.
+constexpr my_size_t TRANSPOSE_LEAF = 64;  // Size of the blocks the recursive transpose stops splitting at.
+
+static_assert(TRANSPOSE_TILE == 8 && TRANSPOSE_LEAF >= 2 * TRANSPOSE_TILE, "The tile kernels work on 8 x 8 tiles");
+
 
 // Print out a matrix, along with its name, to the given output.
 void print_matrix(std::string const& name, const matrix_t matrix[], my_size_t const& size, std::ostream& stream = std::cout) {
@@ -56,8 +85,8 @@ void print_vector(std::string const& name, matrix_t const matrix[], my_size_t co
     stream << std::endl;
 }
 
-// Randomise the input matrix
-void randomise_matrix(matrix_t matrix[], my_size_t const& size)
+// Randomise the given number of rows of an input matrix
+void randomise_rows(matrix_t matrix[], my_size_t const& rows, my_size_t const& size)
 {
     // Seed a PRNG with a CRNG provided by the system.
     std::random_device randomDevice;
@@ -65,39 +94,182 @@ void randomise_matrix(matrix_t matrix[], my_size_t const& size)
 
     std::uniform_int_distribution<> distribution(0, 100);
 
-    // Loop through the matrix, randomly generating elements.
-    for (auto i = 0; i < size * size; i++)
+    // Loop through the rows, randomly generating elements.
+    for (auto i = 0; i < rows * size; i++)
     {
         matrix[i] = distribution(generator);
     }
 }
 
+// Randomise the input matrix
+void randomise_matrix(matrix_t matrix[], my_size_t const& size)
+{
+    randomise_rows(matrix, size, size);
+}
+
 // Templated function to print out a variable with its name.
 template <typename T>
 void print_var(std::string const& name, T value) {
     std::cout << std::endl << name << ": " << value << std::endl;
 }
 
-// Transposes the input matrix
-// Helps with caching by keeping the access sequential when accessing
-// what would originally be the columns.
-void transpose_matrix(matrix_t matrix[], my_size_t const& size) {
-    // Create a temporary matrix for the intermediate result.
-    auto *matrixTemp = new matrix_t[size * size]();
+// Signature of the kernels that transpose a single TRANSPOSE_TILE x TRANSPOSE_TILE tile between two matrices.
+using transpose_tile_t = void (*)(const matrix_t input[], my_size_t inputStride, matrix_t output[], my_size_t outputStride);
+
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile one element at a time.
+// The tile is read in full before any of it is written, so the input and output can be the same tile.
+void transpose_tile_scalar(const matrix_t input[], my_size_t inputStride, matrix_t output[], my_size_t outputStride) {
+    matrix_t tile[TRANSPOSE_TILE][TRANSPOSE_TILE];
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++) {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++) {
+            tile[j][i] = input[i * inputStride + j];
+        }
+    }
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++) {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++) {
+            output[i * outputStride + j] = tile[i][j];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Transposes an 8 x 8 tile inside of 8 AVX2 registers.
+// Pairs of rows are interleaved 32 bits at a time, then 64 bits at a time, then the 128 bit halves are swapped
+// over, which leaves each register holding a column. All of the tile is loaded before any of it is stored.
+__attribute__((target("avx2")))
+void transpose_tile_avx2(const matrix_t input[], my_size_t inputStride, matrix_t output[], my_size_t outputStride) {
+    __m256i rows[8];
+    for (auto i = 0; i < 8; i++) {
+        rows[i] = _mm256_loadu_si256((const __m256i *)&input[i * inputStride]);
+    }
+
+    __m256i pairs[8];
+    for (auto i = 0; i < 8; i += 2) {
+        pairs[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+    }
+
+    __m256i quads[8];
+    for (auto i = 0; i < 8; i += 4) {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+
+    for (auto i = 0; i < 4; i++) {
+        auto low = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20);
+        auto high = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31);
+        _mm256_storeu_si256((__m256i *)&output[i * outputStride], low);
+        _mm256_storeu_si256((__m256i *)&output[(i + 4) * outputStride], high);
+    }
+}
+#endif
+
+// Picks the tile kernel to use, based on what the CPU supports.
+// The AVX2 kernel needs the elements to be 32 bits.
+transpose_tile_t select_transpose_tile() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (sizeof(matrix_t) == 4 && __builtin_cpu_supports("avx2")) {
+        return transpose_tile_avx2;
+    }
+#endif
+
+    return transpose_tile_scalar;
+}
+
+// The tile kernel to use, picked once when the program starts.
+transpose_tile_t const transpose_tile = select_transpose_tile();
+
+// Swaps the tile at a with the transpose of the tile at b, transposing both of them.
+void swap_tiles(matrix_t a[], matrix_t b[], my_size_t stride) {
+    matrix_t tile[TRANSPOSE_TILE * TRANSPOSE_TILE];
+    transpose_tile(a, stride, tile, TRANSPOSE_TILE);
+    transpose_tile(b, stride, a, stride);
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++) {
+        std::copy_n(&tile[i * TRANSPOSE_TILE], TRANSPOSE_TILE, &b[i * stride]);
+    }
+}
+
+// Swaps the rows x cols block at a with the transpose of the cols x rows block at b, when they both fit in cache.
+// Whole tiles go through the tile kernel, the edges that don't make up a whole tile are done one element at a time.
+void transpose_swap_leaf(matrix_t a[], matrix_t b[], my_size_t stride, my_size_t rows, my_size_t cols) {
+    auto tileRows = rows / TRANSPOSE_TILE * TRANSPOSE_TILE;
+    auto tileCols = cols / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    for (auto i = 0; i < tileRows; i += TRANSPOSE_TILE) {
+        for (auto j = 0; j < tileCols; j += TRANSPOSE_TILE) {
+            swap_tiles(&a[i * stride + j], &b[j * stride + i], stride);
+        }
+    }
+
+    for (auto i = 0; i < rows; i++) {
+        for (auto j = i < tileRows ? tileCols : 0; j < cols; j++) {
+            std::swap(a[i * stride + j], b[j * stride + i]);
+        }
+    }
+}
+
+// Transposes a square block on the diagonal in place, when it fits in cache.
+void transpose_diagonal_leaf(matrix_t matrix[], my_size_t stride, my_size_t size) {
+    auto tileSize = size / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    for (auto i = 0; i < tileSize; i += TRANSPOSE_TILE) {
+        // The tile on the diagonal is transposed onto itself, the ones above it are swapped with the ones below.
+        transpose_tile(&matrix[i * stride + i], stride, &matrix[i * stride + i], stride);
+
+        for (auto j = i + TRANSPOSE_TILE; j < tileSize; j += TRANSPOSE_TILE) {
+            swap_tiles(&matrix[i * stride + j], &matrix[j * stride + i], stride);
+        }
+    }
 
-    // Loop through the matrix, transposing it into the temp matrix
     for (auto i = 0; i < size; i++) {
-        for (auto j = 0; j < size; j++) {
-            matrixTemp[j * size + i] = matrix[i * size + j];
+        for (auto j = std::max(i + 1, tileSize); j < size; j++) {
+            std::swap(matrix[i * stride + j], matrix[j * stride + i]);
         }
     }
+}
+// Swaps the rows x cols block at a with the transpose of the cols x rows block at b.
+// The longer side is split in half until the blocks fit in cache, so every cache level gets used well without
+// having to know their sizes.
+void transpose_swap(matrix_t a[], matrix_t b[], my_size_t stride, my_size_t rows, my_size_t cols) {
+    if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF) {
+        transpose_swap_leaf(a, b, stride, rows, cols);
+    } else if (rows >= cols) {
+        // Split on a tile boundary, so only the real edges of the matrix are left out of the tile kernel.
+        auto half = rows / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transpose_swap(a, b, stride, half, cols);
+        transpose_swap(&a[half * stride], &b[half], stride, rows - half, cols);
+    } else {
+        auto half = cols / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transpose_swap(a, b, stride, rows, half);
+        transpose_swap(&a[half], &b[half * stride], stride, rows, cols - half);
+    }
+}
 
-    // Copy the transposed matrix back into the original matrix
-    for (auto i = 0; i < size * size; i++) {
-        matrix[i] = matrixTemp[i];
+// Transposes a square block on the diagonal in place.
+// The two blocks on its diagonal are transposed in place, and the two off of it are swapped with each other.
+void transpose_diagonal(matrix_t matrix[], my_size_t stride, my_size_t size) {
+    if (size <= TRANSPOSE_LEAF) {
+        transpose_diagonal_leaf(matrix, stride, size);
+        return;
     }
 
-    delete[] matrixTemp;
+    auto half = size / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+    transpose_diagonal(matrix, stride, half);
+    transpose_diagonal(&matrix[half * stride + half], stride, size - half);
+    transpose_swap(&matrix[half], &matrix[half * stride], stride, half, size - half);
+}
+
+// Transposes the input matrix in place
+// Helps with caching by keeping the access sequential when accessing
+// what would originally be the columns.
+// Works recursively on tiles, so no temporary matrix is needed.
+void transpose_matrix(matrix_t matrix[], my_size_t const& size) {
+    transpose_diagonal(matrix, size, size);
 }
 
 // Set up the control arrays for Scatterv
@@ -165,6 +337,135 @@ void matrix_vector_multiply(const matrix_t rowVector[], const matrix_t matrixTra
     }
 }
 
+// Checks every element of a matrix fits in compact_t, so it can be sent in compact form without losing anything.
+bool fits_compact(const matrix_t matrix[], my_size_t count) {
+    return std::all_of(matrix, matrix + count, [](matrix_t element) {
+        return element >= std::numeric_limits<compact_t>::min() && element <= std::numeric_limits<compact_t>::max();
+    });
+}
+
+// Packs a matrix into compact_t elements.
+void pack_compact(const matrix_t matrix[], compact_t compact[], my_size_t count) {
+    for (auto i = 0; i < count; i++) {
+        compact[i] = (compact_t)matrix[i];
+    }
+}
+
+// Unpacks compact_t elements back out into a matrix.
+void unpack_compact(const compact_t compact[], matrix_t matrix[], my_size_t count) {
+    for (auto i = 0; i < count; i++) {
+        matrix[i] = compact[i];
+    }
+}
+
+// Broadcasts a matrix from the root process, as compact_t elements if compact is set.
+// Sending the compact form cuts the bytes sent down to a quarter, for the cost of packing and unpacking it.
+void broadcast_matrix(int rank, matrix_t matrix[], my_size_t count, bool compact,
+                      MPI::Intracomm const& comm = MPI::COMM_WORLD) {
+    if (!compact) {
+        comm.Bcast(matrix, count, MPI::INT, 0);
+        return;
+    }
+
+    std::vector<compact_t> buffer(count);
+    if (rank == 0) {
+        pack_compact(matrix, buffer.data(), count);
+    }
+
+    comm.Bcast(buffer.data(), count, MPI::UNSIGNED_CHAR, 0);
+
+    if (rank != 0) {
+        unpack_compact(buffer.data(), matrix, count);
+    }
+}
+
+// Scatters the rows of a matrix from the root process into the slab of each process, as compact_t elements if
+// compact is set. The root process keeps its rows in place at the start of the full matrix.
+void scatter_matrix(int rank, const matrix_t matrix[], matrix_t slab[], int counts[], int displs[], my_size_t size,
+                    bool compact) {
+    if (!compact) {
+        if (rank == 0) {
+            MPI::COMM_WORLD.Scatterv(matrix, counts, displs, MPI::INT, MPI::IN_PLACE, counts[rank], MPI::INT, 0);
+        } else {
+            MPI::COMM_WORLD.Scatterv(nullptr, counts, displs, MPI::INT, slab, counts[rank], MPI::INT, 0);
+        }
+        return;
+    }
+
+    if (rank == 0) {
+        std::vector<compact_t> buffer(size * size);
+        pack_compact(matrix, buffer.data(), size * size);
+        MPI::COMM_WORLD.Scatterv(buffer.data(), counts, displs, MPI::UNSIGNED_CHAR, MPI::IN_PLACE, counts[rank],
+                                 MPI::UNSIGNED_CHAR, 0);
+    } else {
+        std::vector<compact_t> buffer(counts[rank]);
+        MPI::COMM_WORLD.Scatterv(nullptr, counts, displs, MPI::UNSIGNED_CHAR, buffer.data(), counts[rank],
+                                 MPI::UNSIGNED_CHAR, 0);
+        unpack_compact(buffer.data(), slab, counts[rank]);
+    }
+}
+
+// A copy of matrix2 shared by all the processes on a node, held in a window allocated by the first one of them.
+struct SharedMatrix {
+    MPI::Intracomm nodeComm;
+    MPI::Intracomm leaderComm;
+    MPI_Win window;
+    matrix_t *data;
+};
+
+// Shares a matrix from the root process with every process, keeping a single copy of it on each node.
+// The first process on each node allocates the matrix in a shared window that the others on the node map in, then
+// it is only broadcast between those first processes, so each node receives it once rather than once per process.
+SharedMatrix share_matrix(int rank, const matrix_t matrix[], my_size_t count, bool compact) {
+    SharedMatrix shared{};
+
+    MPI_Comm nodeComm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+    shared.nodeComm = nodeComm;
+
+    // The processes keep their order, so the root process leads its node and is the root between the leaders too.
+    auto leader = shared.nodeComm.Get_rank() == 0;
+    shared.leaderComm = MPI::COMM_WORLD.Split(leader ? 0 : MPI::UNDEFINED, rank);
+
+    MPI_Aint bytes = leader ? (MPI_Aint)count * sizeof(matrix_t) : 0;
+    MPI_Win_allocate_shared(bytes, sizeof(matrix_t), MPI_INFO_NULL, nodeComm, &shared.data, &shared.window);
+    if (!leader) {
+        int dispUnit;
+        MPI_Win_shared_query(shared.window, 0, &bytes, &dispUnit, &shared.data);
+    }
+
+    if (leader) {
+        if (rank == 0) {
+            std::copy(matrix, matrix + count, shared.data);
+        }
+
+        broadcast_matrix(rank, shared.data, count, compact, shared.leaderComm);
+    }
+
+    // Make sure the leader has written all of the matrix before anyone on the node reads it.
+    MPI_Win_fence(0, shared.window);
+
+    return shared;
+}
+
+// Frees the window and the communicators of a shared matrix.
+void free_shared_matrix(SharedMatrix& shared) {
+    MPI_Win_free(&shared.window);
+
+    if (shared.leaderComm != MPI::COMM_NULL) {
+        shared.leaderComm.Free();
+    }
+    shared.nodeComm.Free();
+}
+
+// The OpenCL matrix multiply, created on first use and kept for the rest of the run.
+// This way the program is only built once, and the device buffers are reused by every multiply after the first.
+// It uses every device there is, splitting the rows of each process between them.
+MultiDeviceMultiplyCl& opencl_engine() {
+    static MultiDeviceMultiplyCl engine("multiply.cl", "matrix_multiply");
+    return engine;
+}
+
 // Multiplies two vectors using MPI and OpenMP
 // The second matrix will be transposed and broadcast, then the rows of the first matrix are spread between all the
 // processes in the MPI group.
@@ -177,8 +478,29 @@ void multiply(int rank, int matrix1[], int matrix2[], int resultMatrix[], my_siz
     }
 #endif
 
+#ifdef COMPACT_TRANSFER
+    // Only send the compact form of the input matrices if every element of both of them fits in it.
+    int compact = rank == 0 && fits_compact(matrix1, size * size) && fits_compact(matrix2, size * size);
+    MPI::COMM_WORLD.Bcast(&compact, 1, MPI::INT, 0);
+#else
+    int compact = false;
+#endif
+
+#ifdef SHARED_MATRIX2
+    // Share matrix2 between the processes on each node, only broadcasting it between nodes
+    auto shared = share_matrix(rank, matrix2, size * size, compact);
+    matrix2 = shared.data;
+#else
+    // Only the root process holds the full matrices, the others allocate their own copy of matrix2 to broadcast into.
+    host_vector matrix2Copy;
+    if (rank != 0) {
+        matrix2Copy.resize(size * size);
+        matrix2 = matrix2Copy.data();
+    }
+
     // Broadcast matrix2
-    MPI::COMM_WORLD.Bcast(matrix2, size * size, MPI::INT, 0);
+    broadcast_matrix(rank, matrix2, size * size, compact);
+#endif
 
     // Init the counts and displs arrays
     auto groupSize = MPI::COMM_WORLD.Get_size();
@@ -199,15 +521,164 @@ void multiply(int rank, int matrix1[], int matrix2[], int resultMatrix[], my_siz
     // Broadcast the counts matrix
     MPI::COMM_WORLD.Bcast(counts, groupSize, MPI::INT, 0);
 
+    // Allocate the slabs of matrix1 and the result for the rows this process gets, the root process works on its
+    // rows in place at the start of the full matrices.
+    host_vector slabBuffer;
+    host_vector resultBuffer;
+    if (rank != 0) {
+        slabBuffer.resize(counts[rank]);
+        resultBuffer.resize(counts[rank]);
+    }
+    auto *slab = rank == 0 ? matrix1 : slabBuffer.data();
+    auto *resultSlab = rank == 0 ? resultMatrix : resultBuffer.data();
+
     // Scatter matrix one across all the processes
-    MPI::COMM_WORLD.Scatterv(matrix1, counts, displs, MPI::INT, matrix1, size * size, MPI::INT, 0);
+    scatter_matrix(rank, matrix1, slab, counts, displs, size, compact);
 
     // Process the matrix multiplications through OpenCL using our matrix multiply class
-    MatrixMultiplyCl matrixMultiplyCl("multiply.cl", "matrix_multiply");
-    matrixMultiplyCl.process_matrices(matrix1, matrix2, resultMatrix, counts[rank] / size, size);
+    opencl_engine().process_matrices(slab, matrix2, resultSlab, counts[rank] / size, size);
 
     // Collect the results back
-    MPI::COMM_WORLD.Gatherv(resultMatrix, counts[rank], MPI::INT, resultMatrix, counts, displs, MPI::INT, 0);
+    if (rank == 0) {
+        MPI::COMM_WORLD.Gatherv(MPI::IN_PLACE, counts[rank], MPI::INT, resultMatrix, counts, displs, MPI::INT, 0);
+    } else {
+        MPI::COMM_WORLD.Gatherv(resultSlab, counts[rank], MPI::INT, nullptr, counts, displs, MPI::INT, 0);
+    }
+
+#ifdef SHARED_MATRIX2
+    free_shared_matrix(shared);
+#endif
+}
+
+// Multiplies STREAM_MATRICES matrix1s, one after another in matrices1, with the same matrix2, like a fixed matrix of
+// weights. matrix2 is only transposed, broadcast and pinned on the devices once, then each process gets its rows of
+// every matrix1 and multiplies them all as one stream, so the small slabs share launches of the kernel.
+void stream_multiply(int rank, matrix_t matrices1[], matrix_t matrix2[], matrix_t results[], my_size_t size) {
+#ifndef UNCOUNTED_TRANSPOSE
+    // Transpose matrix 2 in the root process.
+    if (rank == 0) {
+        transpose_matrix(matrix2, size);
+    }
+#endif
+
+#ifdef COMPACT_TRANSFER
+    // Only send the compact form of the input matrices if every element of all of them fits in it.
+    int compact = rank == 0 && fits_compact(matrices1, STREAM_MATRICES * size * size) &&
+        fits_compact(matrix2, size * size);
+    MPI::COMM_WORLD.Bcast(&compact, 1, MPI::INT, 0);
+#else
+    int compact = false;
+#endif
+
+    // Broadcast matrix2 and pin it on the devices, where it stays for every matrix1
+    host_vector matrix2Copy;
+    if (rank != 0) {
+        matrix2Copy.resize(size * size);
+        matrix2 = matrix2Copy.data();
+    }
+    broadcast_matrix(rank, matrix2, size * size, compact);
+    opencl_engine().pin_matrix2(matrix2, size);
+
+    // Split up the rows the same way for every matrix1
+    auto groupSize = MPI::COMM_WORLD.Get_size();
+    int counts[groupSize];
+    int displs[groupSize];
+    if (rank == 0) {
+        setup_scatter_arrays(size, groupSize, counts, displs);
+    }
+    MPI::COMM_WORLD.Bcast(counts, groupSize, MPI::INT, 0);
+
+    // Allocate the slabs of every matrix1 and result for the rows this process gets, the root process works on its
+    // rows in place at the start of each of the full matrices.
+    host_vector slabBuffer;
+    host_vector resultBuffer;
+    if (rank != 0) {
+        slabBuffer.resize(STREAM_MATRICES * counts[rank]);
+        resultBuffer.resize(STREAM_MATRICES * counts[rank]);
+    }
+
+    std::vector<StreamMatrix> stream;
+    for (my_size_t matrix = 0; matrix < STREAM_MATRICES; matrix++) {
+        auto *slab = rank == 0 ? matrices1 + (size_t)matrix * size * size : slabBuffer.data() + matrix * counts[rank];
+        auto *resultSlab = rank == 0 ? results + (size_t)matrix * size * size :
+            resultBuffer.data() + matrix * counts[rank];
+
+        scatter_matrix(rank, slab, slab, counts, displs, size, compact);
+        stream.push_back({slab, resultSlab, counts[rank] / size});
+    }
+
+    // Process every slab through OpenCL as one stream
+    opencl_engine().process_stream(stream);
+
+    // Collect the results of each matrix back
+    for (auto const &matrix : stream) {
+        if (rank == 0) {
+            MPI::COMM_WORLD.Gatherv(MPI::IN_PLACE, counts[rank], MPI::INT, matrix.results, counts, displs, MPI::INT, 0);
+        } else {
+            MPI::COMM_WORLD.Gatherv(matrix.results, counts[rank], MPI::INT, nullptr, counts, displs, MPI::INT, 0);
+        }
+    }
+}
+
+// Reads count elements of a matrix file into a buffer, starting at the given element.
+// Every process reads its part at the same time, so MPI-IO can combine them into fewer, larger reads.
+void read_elements(const char *fileName, matrix_t buffer[], my_size_t offset, my_size_t count) {
+    auto file = MPI::File::Open(MPI::COMM_WORLD, fileName, MPI::MODE_RDONLY, MPI::INFO_NULL);
+    file.Read_at_all((MPI::Offset)offset * sizeof(matrix_t), buffer, count, MPI::INT);
+    file.Close();
+}
+
+// Writes count elements from a buffer into a matrix file of total elements, starting at the given element.
+// Every process writes its part at the same time, so MPI-IO can combine them into fewer, larger writes.
+void write_elements(const char *fileName, const matrix_t buffer[], my_size_t offset, my_size_t count, my_size_t total) {
+    auto file = MPI::File::Open(MPI::COMM_WORLD, fileName, MPI::MODE_CREATE | MPI::MODE_WRONLY, MPI::INFO_NULL);
+    // An existing file could be bigger, from a run with larger matrices, so it is cut down to size first
+    file.Set_size((MPI::Offset)total * sizeof(matrix_t));
+    file.Write_at_all((MPI::Offset)offset * sizeof(matrix_t), buffer, count, MPI::INT);
+    file.Close();
+}
+
+// Makes sure there is an input matrix of the right size in the given file, randomising one if there is not.
+// Each process randomises and writes its own rows, so the root process never has to hold all of it.
+void prepare_input_file(int rank, const char *fileName, const int counts[], const int displs[], my_size_t size) {
+    int ready = rank == 0 && (std::streamoff)std::ifstream(fileName, std::ios::binary | std::ios::ate).tellg() ==
+        (std::streamoff)(size * size * sizeof(matrix_t));
+    MPI::COMM_WORLD.Bcast(&ready, 1, MPI::INT, 0);
+
+    if (ready) {
+        return;
+    }
+
+    std::vector<matrix_t> rows(counts[rank]);
+    randomise_rows(rows.data(), counts[rank] / size, size);
+    write_elements(fileName, rows.data(), displs[rank], counts[rank], size * size);
+}
+
+// Multiplies the matrices in MATRIX1_FILE and MATRIX2_FILE into RESULT_FILE using MPI-IO.
+// Each process reads its own rows of matrix1 and all of matrix2 straight from the files, then writes its rows of the
+// result straight into the result file, so none of the matrices have to go through the root process.
+void file_multiply(int rank, my_size_t size) {
+    // Every process works out the same split of the rows, so it does not need to be sent around.
+    auto groupSize = MPI::COMM_WORLD.Get_size();
+    int counts[groupSize];
+    int displs[groupSize];
+    setup_scatter_arrays(size, groupSize, counts, displs);
+
+    prepare_input_file(rank, MATRIX1_FILE, counts, displs, size);
+    prepare_input_file(rank, MATRIX2_FILE, counts, displs, size);
+
+    host_vector slab(counts[rank]);
+    host_vector matrix2(size * size);
+    host_vector resultSlab(counts[rank]);
+    read_elements(MATRIX1_FILE, slab.data(), displs[rank], counts[rank]);
+    read_elements(MATRIX2_FILE, matrix2.data(), 0, size * size);
+
+    // Transpose matrix2 for the kernel, each process working on its own copy.
+    transpose_matrix(matrix2.data(), size);
+
+    opencl_engine().process_matrices(slab.data(), matrix2.data(), resultSlab.data(), counts[rank] / size, size);
+
+    write_elements(RESULT_FILE, resultSlab.data(), displs[rank], counts[rank], size * size);
 }
 
 int main(int argc, char *argv[])
@@ -233,10 +704,96 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    // Initialise the matrices
-    auto *matrix1 = new matrix_t[size * size]();
-    auto *matrix2 = new matrix_t[size * size]();
-    auto *resultMatrix = new matrix_t[size * size]();
+#ifdef TUNE_KERNEL
+    // Only the root process tunes, the others load what it saved when they set up OpenCL
+    if (rank == 0) {
+        opencl_engine().tune(size);
+    }
+    MPI::COMM_WORLD.Barrier();
+#endif
+
+    // Set up OpenCL before anything is timed, so building the program for this size of matrices isn't counted as part
+    // of the multiply
+    opencl_engine().prepare(size);
+
+#ifdef FILE_IO
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Multiply the matrices in the files, the root process does not hold any of them
+        file_multiply(rank, size);
+
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start);
+        std::cout << std::endl << (rank == 0 ? "Total Time Taken: " : "Node Total Time Taken: ") << duration.count()
+                  << " microseconds" << std::endl;
+
+        MPI::Finalize();
+        return 0;
+    }
+#endif
+
+#ifdef STATIONARY_MATRIX2
+    {
+        // Only the root process holds the full matrices, the others allocate just what they get sent.
+        host_vector matrices1;
+        host_vector matrix2;
+        host_vector results;
+        if (rank == 0) {
+            matrices1.resize(STREAM_MATRICES * size * size);
+            matrix2.resize(size * size);
+            results.resize(STREAM_MATRICES * size * size);
+
+            for (my_size_t matrix = 0; matrix < STREAM_MATRICES; matrix++) {
+                randomise_matrix(matrices1.data() + (size_t)matrix * size * size, size);
+            }
+            randomise_matrix(matrix2.data(), size);
+
+#ifdef PRINT_INPUTS_AND_OUTPUTS
+            // Only the first of the matrix1s and its result are printed
+            print_matrix("matrix1", matrices1.data(), size);
+            print_matrix("matrix2", matrix2.data(), size);
+#endif
+
+#ifdef UNCOUNTED_TRANSPOSE
+            transpose_matrix(matrix2.data(), size);
+#endif
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Multiply every matrix1 with matrix2
+        stream_multiply(rank, matrices1.data(), matrix2.data(), results.data(), size);
+
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start);
+
+#ifdef PRINT_INPUTS_AND_OUTPUTS
+        if (rank == 0) {
+            print_matrix("resultMatrix", results.data(), size);
+        }
+#endif
+
+        std::cout << std::endl << (rank == 0 ? "Total Time Taken: " : "Node Total Time Taken: ") << duration.count()
+                  << " microseconds" << std::endl;
+
+        MPI::Finalize();
+        return 0;
+    }
+#endif
+
+    // Initialise the matrices, only the root process holds all of them.
+    // The other processes allocate just what they get sent once the work has been split up.
+    // They are page aligned, so a device that shares memory with the host can use them in place.
+    host_vector matrix1Buffer;
+    host_vector matrix2Buffer;
+    host_vector resultBuffer;
+    if (rank == 0) {
+        matrix1Buffer.resize(size * size);
+        matrix2Buffer.resize(size * size);
+        resultBuffer.resize(size * size);
+    }
+    auto *matrix1 = rank == 0 ? matrix1Buffer.data() : nullptr;
+    auto *matrix2 = rank == 0 ? matrix2Buffer.data() : nullptr;
+    auto *resultMatrix = rank == 0 ? resultBuffer.data() : nullptr;
 
     // If the process is root, then randomise the matrix and then start the multiplication, or just start the multiplication
     if (rank == 0) {
@@ -279,11 +836,6 @@ int main(int argc, char *argv[])
         std::cout << std::endl << "Node Total Time Taken: " << duration.count() << " microseconds" << std::endl;
     }
 
-    // Free up the allocated memory
-    delete[] matrix1;
-    delete[] matrix2;
-    delete[] resultMatrix;
-
     // Finalise and return
     MPI::Finalize();
     return 0;
@@ -3,35 +3,59 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <algorithm>
+#include <bit>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
 
 
-// Initialises the matrix multiply with a .cl file and kernel function name
-MatrixMultiplyCl::MatrixMultiplyCl(std::string const &filename, std::string const &kernelName) {
-    this->select_device();
+// Initialises the matrix multiply with a .cl file and kernel function name, on the preferred device
+MatrixMultiplyCl::MatrixMultiplyCl(std::string const &filename, std::string const &kernelName)
+    : MatrixMultiplyCl(filename, kernelName, select_device()) {}
+
+// Initialises the matrix multiply with a .cl file and kernel function name, on the given device
+MatrixMultiplyCl::MatrixMultiplyCl(std::string const &filename, std::string const &kernelName, cl_device_id deviceId)
+    : deviceId(deviceId), filename(filename), kernelName(kernelName) {
+    this->check_memory();
 
     this->create_context();
 
-    this->build_program(filename);
+    this->build_kernel();
 
     this->create_queue();
-    this->create_kernel(kernelName);
+
+    this->load_tuning();
 }
 
 // Destructor manages cleaning up the OpenCL objects and memory
 MatrixMultiplyCl::~MatrixMultiplyCl() {
-    clReleaseMemObject(this->matrix1);
-    clReleaseMemObject(this->matrix2Transposed);
-    clReleaseMemObject(this->results);
+    // The buffers are only created when they are first needed, and pin_matrix2 creates just the one for matrix2
+    for (auto buffer : {this->matrix1, this->matrix2Transposed, this->results}) {
+        if (buffer != nullptr) {
+            clReleaseMemObject(buffer);
+        }
+    }
+
+    for (auto const &[options, variant] : this->variants) {
+        clReleaseKernel(variant.kernel);
+        clReleaseProgram(variant.program);
+    }
 
-    clReleaseKernel(this->kernel);
     clReleaseCommandQueue(this->queue);
-    clReleaseProgram(this->program);
     clReleaseContext(this->context);
+
+    // This only does anything for sub-devices, the others belong to their platform
+    clReleaseDevice(this->deviceId);
 }
 
 // Select a device, either GPU or CPU to use
-void MatrixMultiplyCl::select_device() {
+cl_device_id MatrixMultiplyCl::select_device() {
     cl_platform_id platform;
+    cl_device_id deviceId;
     int err;
 
     // First select the platform
@@ -42,17 +66,89 @@ void MatrixMultiplyCl::select_device() {
     }
 
     // Then select the device to use, in priority order of GPU then CPU
-    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &this->deviceId, nullptr);
+    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &deviceId, nullptr);
     if (err == CL_DEVICE_NOT_FOUND) {
         std::cerr << "GPU not found, searching for CPU" << std::endl;
 
-        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &this->deviceId, nullptr);
+        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &deviceId, nullptr);
     }
 
     if (err < 0) {
         std::cerr << "Couldn't find any valid devices" << std::endl;
         exit(err);
     }
+
+    return deviceId;
+}
+
+// Splits a CPU device into a sub-device for each NUMA node, so the cores of each node work on their own share of the
+// rows. Gives back just the device itself if it is not a CPU, or can't be split.
+static std::vector<cl_device_id> numa_sub_devices(cl_device_id deviceId) {
+    cl_device_type type;
+    clGetDeviceInfo(deviceId, CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
+
+    cl_device_partition_property properties[] = {
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+    };
+    cl_uint count = 0;
+    if (!(type & CL_DEVICE_TYPE_CPU) || clCreateSubDevices(deviceId, properties, 0, nullptr, &count) < 0 ||
+        count < 2) {
+        return {deviceId};
+    }
+
+    std::vector<cl_device_id> subDevices(count);
+    clCreateSubDevices(deviceId, properties, count, subDevices.data(), nullptr);
+
+    return subDevices;
+}
+
+// Finds every device of every platform, with CPUs split up by NUMA node
+std::vector<cl_device_id> MatrixMultiplyCl::find_devices() {
+    cl_uint platformCount = 0;
+    int err = clGetPlatformIDs(0, nullptr, &platformCount);
+    if (err < 0 || platformCount == 0) {
+        std::cerr << "Couldn't identify a platform" << std::endl;
+        exit(err < 0 ? err : CL_DEVICE_NOT_FOUND);
+    }
+
+    std::vector<cl_platform_id> platforms(platformCount);
+    clGetPlatformIDs(platformCount, platforms.data(), nullptr);
+
+    std::vector<cl_device_id> deviceIds;
+    for (auto platform : platforms) {
+        cl_uint deviceCount = 0;
+        if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr, &deviceCount) < 0 || deviceCount == 0) {
+            continue;
+        }
+
+        std::vector<cl_device_id> platformDevices(deviceCount);
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, deviceCount, platformDevices.data(), nullptr);
+
+        for (auto deviceId : platformDevices) {
+            auto subDevices = numa_sub_devices(deviceId);
+            deviceIds.insert(deviceIds.end(), subDevices.begin(), subDevices.end());
+        }
+    }
+
+    if (deviceIds.empty()) {
+        std::cerr << "Couldn't find any valid devices" << std::endl;
+        exit(CL_DEVICE_NOT_FOUND);
+    }
+
+    return deviceIds;
+}
+
+// Check how the device can use host memory
+void MatrixMultiplyCl::check_memory() {
+    // A device that shares memory with the host, like a CPU, can work on the matrices where they are rather than on
+    // copies of them, as long as they are aligned as it needs. The alignment is given in bits.
+    cl_bool unifiedMemory = CL_FALSE;
+    clGetDeviceInfo(this->deviceId, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unifiedMemory), &unifiedMemory, nullptr);
+    this->unifiedMemory = unifiedMemory == CL_TRUE;
+
+    cl_uint alignment = 0;
+    clGetDeviceInfo(this->deviceId, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignment), &alignment, nullptr);
+    this->hostAlignment = std::max<size_t>(alignment / 8, sizeof(int));
 }
 
 // Create the device context
@@ -70,15 +166,117 @@ void MatrixMultiplyCl::create_context() {
 void MatrixMultiplyCl::create_queue() {
     int err;
 
-    this->queue = clCreateCommandQueueWithProperties(this->context, this->deviceId, nullptr, &err);
+    // Ask for an out of order queue, so the transfers and kernels of different chunks can overlap, with their order
+    // kept by events instead. Not every device supports that, in which case they just run in order.
+    cl_queue_properties properties[] = {
+        CL_QUEUE_PROPERTIES, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE, 0
+    };
+    this->queue = clCreateCommandQueueWithProperties(this->context, this->deviceId, properties, &err);
+    if (err == CL_INVALID_QUEUE_PROPERTIES) {
+        properties[1] = CL_QUEUE_PROFILING_ENABLE;
+        this->queue = clCreateCommandQueueWithProperties(this->context, this->deviceId, properties, &err);
+    }
+
     if (err < 0) {
         std::cerr << "Couldn't create a command queue" << std::endl;
         exit(err);
     }
 }
 
-// Load the given program and compile it
-void MatrixMultiplyCl::build_program(std::string const &filename) {
+// Hashes a string with 64 bit FNV-1a, used to name the cached program binaries
+static uint64_t hash_string(std::string const &string) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : string) {
+        hash = (hash ^ c) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Gets a string from clGetDeviceInfo
+static std::string device_string(cl_device_id deviceId, cl_device_info info) {
+    size_t size;
+    clGetDeviceInfo(deviceId, info, 0, nullptr, &size);
+
+    std::string value(size, '\0');
+    clGetDeviceInfo(deviceId, info, size, value.data(), nullptr);
+    value.resize(value.find('\0'));
+
+    return value;
+}
+
+// Works out the key a compiled program is cached under.
+// A binary only works for the device and driver that built it, from the same source and with the same options.
+std::string MatrixMultiplyCl::program_cache_key(std::string const &source, std::string const &options) {
+    return device_string(this->deviceId, CL_DEVICE_NAME) + "|" + device_string(this->deviceId, CL_DRIVER_VERSION) +
+        "|" + options + "|" + std::to_string(hash_string(source));
+}
+
+// Loads and builds a cached program binary, if there is one for the given key.
+// Returns false if there isn't, or the driver won't take it, so the program gets built from source instead.
+bool MatrixMultiplyCl::load_program_binary(std::string const &cacheFilename, std::string const &key,
+                                           std::string const &options) {
+    std::ifstream cacheFile(cacheFilename, std::ios::binary);
+    std::string cachedKey;
+    if (!std::getline(cacheFile, cachedKey) || cachedKey != key) {
+        return false;
+    }
+
+    std::string binary((std::istreambuf_iterator<char>(cacheFile)), std::istreambuf_iterator<char>());
+    auto *binaryData = (const unsigned char *)binary.data();
+    auto binarySize = binary.size();
+    int binaryStatus;
+    int err;
+
+    this->program = clCreateProgramWithBinary(this->context, 1, &this->deviceId, &binarySize, &binaryData,
+                                              &binaryStatus, &err);
+    auto built = err >= 0 && binaryStatus >= 0 &&
+        clBuildProgram(this->program, 1, &this->deviceId, options.c_str(), nullptr, nullptr) >= 0;
+    if (!built) {
+        // The driver won't take the binary, so remove it rather than trying it again on every run, even if the
+        // program built from source can't be saved in its place
+        if (this->program != nullptr) {
+            clReleaseProgram(this->program);
+        }
+        cacheFile.close();
+        std::remove(cacheFilename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Saves the binary of the built program under the given key.
+// It is written to a temporary file first and then renamed into place, so other processes never load half of it.
+void MatrixMultiplyCl::save_program_binary(std::string const &cacheFilename, std::string const &key) {
+    size_t binarySize;
+    if (clGetProgramInfo(this->program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, nullptr) < 0 ||
+        binarySize == 0) {
+        return;
+    }
+
+    std::string binary(binarySize, '\0');
+    auto *binaryData = (unsigned char *)binary.data();
+    if (clGetProgramInfo(this->program, CL_PROGRAM_BINARIES, sizeof(binaryData), &binaryData, nullptr) < 0) {
+        return;
+    }
+
+    auto tempFilename = cacheFilename + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream tempFile(tempFilename, std::ios::binary);
+        tempFile << key << '\n' << binary;
+
+        if (!tempFile) {
+            std::remove(tempFilename.c_str());
+            return;
+        }
+    }
+
+    std::rename(tempFilename.c_str(), cacheFilename.c_str());
+}
+
+// Load the given program and compile it, or load its binary from the cache if it has been compiled before
+void MatrixMultiplyCl::build_program(std::string const &filename, std::string const &options) {
     std::ifstream programFile;
     int err;
 
@@ -91,31 +289,28 @@ void MatrixMultiplyCl::build_program(std::string const &filename) {
         throw;
     }
 
-    // Get the size
-    programFile.seekg(0, std::ios_base::end);
-    size_t programSize = programFile.tellg();
-
-    // Go back to the start
-    programFile.seekg(0);
-
-    // Create the buffer source and null-terminate it
-    char *sourceBuffer = new char[programSize + 1];
-    sourceBuffer[programSize] = '\0';
-
-    // Read out the source into the buffer
-    programFile.read(sourceBuffer, (std::streamsize)programSize);
+    // Read out the source
+    std::string source((std::istreambuf_iterator<char>(programFile)), std::istreambuf_iterator<char>());
     programFile.close();
 
+    // The compiled binary is cached next to the source, named after the hash of its key
+    auto key = this->program_cache_key(source, options);
+    auto cacheFilename = filename + "." + std::to_string(hash_string(key)) + ".bin";
+    if (this->load_program_binary(cacheFilename, key, options)) {
+        return;
+    }
+
     // Create the program for the context
-    this->program = clCreateProgramWithSource(this->context, 1, (const char **)&sourceBuffer, &programSize, &err);
+    auto *sourceBuffer = source.c_str();
+    auto programSize = source.size();
+    this->program = clCreateProgramWithSource(this->context, 1, &sourceBuffer, &programSize, &err);
     if (err < 0) {
         std::cout << "Program failed to compile" << std::endl;
         exit(err);
     }
-    delete[] sourceBuffer;
 
     // Finally compile the program
-    err = clBuildProgram(this->program, 0, nullptr, nullptr, nullptr, nullptr);
+    err = clBuildProgram(this->program, 0, nullptr, options.c_str(), nullptr, nullptr);
     if (err < 0) {
         size_t logSize;
 
@@ -130,6 +325,8 @@ void MatrixMultiplyCl::build_program(std::string const &filename) {
 
         exit(err);
     }
+
+    this->save_program_binary(cacheFilename, key);
 }
 
 // Create the kernel to use from the loaded program with the given name
@@ -143,34 +340,594 @@ void MatrixMultiplyCl::create_kernel(std::string const &kernelName) {
     }
 }
 
-// Processes the given matrices and gives an output
-void MatrixMultiplyCl::process_matrices(matrix_t matrix1[], matrix_t matrix2Transposed[], matrix_t results[], my_size_t rows, my_size_t cols) {
-    cl_event event = nullptr;
+// Makes sure a buffer holds at least the given number of bytes, replacing it with a bigger one if it does not
+void MatrixMultiplyCl::reserve_buffer(cl_mem &buffer, size_t &capacity, size_t size, cl_mem_flags flags) {
+    if (buffer != nullptr && capacity >= size) {
+        return;
+    }
+
+    if (buffer != nullptr) {
+        clReleaseMemObject(buffer);
+    }
+
+    int err;
+    buffer = clCreateBuffer(this->context, flags, size, nullptr, &err);
+    if (err < 0) {
+        std::cerr << "Couldn't create a buffer" << std::endl;
+        exit(err);
+    }
+
+    capacity = size;
+}
+
+// Creates a buffer that uses the given host memory in place, for devices that share memory with the host
+cl_mem MatrixMultiplyCl::wrap_buffer(void *host, size_t size, cl_mem_flags flags) {
+    int err;
+    auto buffer = clCreateBuffer(this->context, flags | CL_MEM_USE_HOST_PTR, size, host, &err);
+    if (err < 0) {
+        std::cerr << "Couldn't create a buffer" << std::endl;
+        exit(err);
+    }
+
+    return buffer;
+}
+
+// Checks if host memory is aligned well enough for the device to use it in place
+bool MatrixMultiplyCl::is_aligned(void const *host) const {
+    return reinterpret_cast<uintptr_t>(host) % this->hostAlignment == 0;
+}
+
+// Build the general variant of the program and create its kernel, giving each work-item more of its tile to work on
+// until a work-group fits on the device
+void MatrixMultiplyCl::build_kernel() {
+    size_t maxWorkGroupSize;
+    clGetDeviceInfo(this->deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxWorkGroupSize), &maxWorkGroupSize,
+                    nullptr);
+
+    for (auto &config = this->defaultConfig; ; config.workPerItem *= 2) {
+        auto localSize = (size_t)(config.tileSize / config.workPerItem);
+        auto workGroupSize = localSize * localSize;
+        auto last = config.workPerItem == config.tileSize;
+        if (workGroupSize > maxWorkGroupSize && !last) {
+            continue;
+        }
+
+        auto options = this->kernel_options(config, 0, 0);
+        this->build_program(this->filename, options);
+        this->create_kernel(this->kernelName);
+
+        // The kernel itself can have a lower limit than the device, depending on how many registers it needs
+        size_t kernelWorkGroupSize;
+        clGetKernelWorkGroupInfo(this->kernel, this->deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelWorkGroupSize),
+                                 &kernelWorkGroupSize, nullptr);
+        if (workGroupSize <= kernelWorkGroupSize || last) {
+            this->variants[options] = {this->program, this->kernel};
+            return;
+        }
+
+        clReleaseKernel(this->kernel);
+        clReleaseProgram(this->program);
+    }
+}
+
+// Gets the configuration of the kernel tuned for matrices with about the given number of columns, or the default one
+// if it hasn't been tuned for them
+MatrixMultiplyCl::KernelConfig MatrixMultiplyCl::kernel_config(my_size_t cols) const {
+    auto tuned = this->tunedConfigs.find(size_bucket(cols));
+    if (tuned != this->tunedConfigs.end()) {
+        return tuned->second;
+    }
+
+    return this->defaultConfig;
+}
+
+// Works out the options to build the kernel with the given configuration for the given shape with, or the general
+// kernel if the shape is 0 x 0.
+// Only whole chunks of CHUNK_ROWS get a variant with their size built in, one for each number of columns up until there
+// are MAX_SHAPE_VARIANTS of them. The last chunk of a batch could be any number of rows, so it uses the general one
+// rather than building a variant just for it in the middle of a multiply.
+std::string MatrixMultiplyCl::kernel_options(KernelConfig const &config, my_size_t rows, my_size_t cols) {
+    auto options = "-DTILE_SIZE=" + std::to_string(config.tileSize) + " -DWORK_PER_ITEM=" +
+        std::to_string(config.workPerItem) + " -DVECTOR_WIDTH=" + std::to_string(config.vectorWidth);
+    if (rows != CHUNK_ROWS) {
+        return options;
+    }
+
+    auto shapeOptions = options + " -DFIXED_ROWS=" + std::to_string(rows) + " -DFIXED_COLS=" + std::to_string(cols);
+    if (this->variants.contains(shapeOptions) || this->variants.size() <= MAX_SHAPE_VARIANTS) {
+        return shapeOptions;
+    }
+
+    return options;
+}
+
+// Switch to the variant of the kernel built with the given options, building it if it hasn't been yet
+void MatrixMultiplyCl::use_variant(std::string const &options) {
+    auto variant = this->variants.find(options);
+    if (variant != this->variants.end()) {
+        this->program = variant->second.program;
+        this->kernel = variant->second.kernel;
+        return;
+    }
 
-    // Create buffers for each of the matrix buffers
-    this->matrix1 = clCreateBuffer(context, CL_MEM_READ_ONLY, rows * cols * sizeof(int), nullptr, nullptr);
-    this->matrix2Transposed = clCreateBuffer(context, CL_MEM_READ_ONLY, cols * cols * sizeof(int), nullptr, nullptr);
-    this->results = clCreateBuffer(context, CL_MEM_WRITE_ONLY, rows * cols * sizeof(int), nullptr, nullptr);
+    this->build_program(this->filename, options);
+    this->create_kernel(this->kernelName);
+    this->variants[options] = {this->program, this->kernel};
+}
+
+// Builds the variant of the kernel for whole chunks of matrices with the given number of columns, so it is ready
+// before they are multiplied
+void MatrixMultiplyCl::prepare(my_size_t cols) {
+    this->use_variant(this->kernel_options(this->kernel_config(cols), CHUNK_ROWS, cols));
+}
 
-    // Load the matrices into the memory buffers
-    clEnqueueWriteBuffer(this->queue, this->matrix1, CL_TRUE, 0, rows * cols * sizeof(int), matrix1, 0, nullptr, nullptr);
-    clEnqueueWriteBuffer(this->queue, this->matrix2Transposed, CL_TRUE, 0, cols * cols * sizeof(int), matrix2Transposed, 0, nullptr, nullptr);
-    clEnqueueWriteBuffer(this->queue, this->results, CL_TRUE, 0, rows * cols * sizeof(int), results, 0, nullptr, nullptr);
+// Queues up the kernel on a chunk of the rows in the batch's buffers, once the given events are done
+cl_event MatrixMultiplyCl::enqueue_kernel(my_size_t firstRow, my_size_t rows, my_size_t cols,
+                                         std::vector<cl_event> const &waitList) {
+    // Pick the configuration tuned for matrices of this size, and the variant of the kernel built with it for this shape
+    auto config = this->kernel_config(cols);
+    this->use_variant(this->kernel_options(config, rows, cols));
 
-    // Set all the kernel arguments
-    clSetKernelArg(this->kernel, 0, sizeof(cl_mem), (void *)&this->matrix1);
-    clSetKernelArg(this->kernel, 1, sizeof(cl_mem), (void *)&this->matrix2Transposed);
+    return this->launch_kernel(config, firstRow, rows, cols, waitList);
+}
+
+// Queues up the current variant of the kernel, built with the given configuration, on a chunk of the rows in the
+// batch's buffers, once the given events are done
+cl_event MatrixMultiplyCl::launch_kernel(KernelConfig const &config, my_size_t firstRow, my_size_t rows,
+                                         my_size_t cols, std::vector<cl_event> const &waitList) {
+    // Set all the kernel arguments, the kernel takes them as they are when it is queued
+    clSetKernelArg(this->kernel, 0, sizeof(cl_mem), (void *)&this->batch.matrix1Buffer);
+    clSetKernelArg(this->kernel, 1, sizeof(cl_mem), (void *)&this->batch.matrix2Buffer);
     clSetKernelArg(this->kernel, 2, sizeof(int), (void *)&rows);
     clSetKernelArg(this->kernel, 3, sizeof(int), (void *)&cols);
-    clSetKernelArg(this->kernel, 4, sizeof(cl_mem), (void *)&this->results);
+    clSetKernelArg(this->kernel, 4, sizeof(cl_mem), (void *)&this->batch.resultsBuffer);
+    clSetKernelArg(this->kernel, 5, sizeof(int), (void *)&firstRow);
+
+    // Set the number of work items. Each work-group computes a tile of the result, so there is one for every tile
+    // that covers the chunk, with the columns along the first dimension and rows along the second
+    size_t local[2] = {(size_t)(config.tileSize / config.workPerItem), (size_t)(config.tileSize / config.workPerItem)};
+    size_t global[2] = {(size_t)(cols + config.tileSize - 1) / config.tileSize * local[0],
+                        (size_t)(rows + config.tileSize - 1) / config.tileSize * local[1]};
+
+    cl_event multiplied = nullptr;
+    clEnqueueNDRangeKernel(this->queue, this->kernel, 2, nullptr, global, local, waitList.size(),
+                           waitList.empty() ? nullptr : waitList.data(), &multiplied);
+    this->batch.kernelEvents.push_back(multiplied);
+
+    return multiplied;
+}
+
+// Queues up the processing of the given matrices, which carries on while the host does other things, like queueing
+// work on other devices. The results are only there once finish_matrices has been called.
+// The rows are split into chunks of CHUNK_ROWS, and each chunk is written, multiplied and read back as a chain of
+// events rather than waiting on each step. So the device can multiply one chunk while the next one is being written
+// and the one before is being read back.
+// If the device shares memory with the host, the buffers wrap the matrices instead, so there is nothing to write, and
+// each chunk of the result is mapped rather than read, which doesn't copy it either.
+void MatrixMultiplyCl::start_matrices(matrix_t matrix1[], matrix_t matrix2Transposed[], matrix_t results[], my_size_t rows, my_size_t cols) {
+    auto matrix1Size = (size_t)rows * cols * sizeof(int);
+    auto matrix2Size = (size_t)cols * cols * sizeof(int);
+
+    auto &batch = this->batch;
+    batch.zeroCopy = this->unifiedMemory && this->is_aligned(matrix1) && this->is_aligned(matrix2Transposed) &&
+        this->is_aligned(results);
+    std::vector<cl_event> matrix2Written;
+
+    if (batch.zeroCopy) {
+        // Wrap the matrices where they are, for this call only, as they can be somewhere else on the next
+        batch.matrix1Buffer = this->wrap_buffer(matrix1, matrix1Size, CL_MEM_READ_ONLY);
+        batch.matrix2Buffer = this->wrap_buffer(matrix2Transposed, matrix2Size, CL_MEM_READ_ONLY);
+        batch.resultsBuffer = this->wrap_buffer(results, matrix1Size, CL_MEM_WRITE_ONLY);
+    } else {
+        // Make sure the buffers are big enough for the matrices, reusing the ones from the last call if they are
+        this->reserve_buffer(this->matrix1, this->matrix1Capacity, matrix1Size, CL_MEM_READ_ONLY);
+        this->reserve_buffer(this->matrix2Transposed, this->matrix2TransposedCapacity, matrix2Size, CL_MEM_READ_ONLY);
+        this->reserve_buffer(this->results, this->resultsCapacity, matrix1Size, CL_MEM_WRITE_ONLY);
+        batch.matrix1Buffer = this->matrix1;
+        batch.matrix2Buffer = this->matrix2Transposed;
+        batch.resultsBuffer = this->results;
+
+        // Every chunk needs all of matrix2, so it goes first. It takes the place of any pinned matrix2.
+        this->pinnedCols = 0;
+        cl_event written;
+        clEnqueueWriteBuffer(this->queue, batch.matrix2Buffer, CL_FALSE, 0, matrix2Size, matrix2Transposed, 0, nullptr,
+                             &written);
+        matrix2Written.push_back(written);
+        batch.otherEvents.push_back(written);
+    }
 
-    // Set the number of work items. In this case it is the number of elements in the result matrix
-    size_t global[1] = {(size_t)rows * cols};
+    for (my_size_t firstRow = 0; firstRow < rows; firstRow += CHUNK_ROWS) {
+        auto chunkRows = std::min(CHUNK_ROWS, rows - firstRow);
+        auto offset = (size_t)firstRow * cols;
+        auto size = (size_t)chunkRows * cols * sizeof(int);
+
+        // The kernel waits for matrix2 and the chunk of matrix1 to be on the device, if they had to be written
+        auto waitList = matrix2Written;
+        if (!batch.zeroCopy) {
+            // Load the chunk of matrix1 into its place in the buffer
+            cl_event written;
+            clEnqueueWriteBuffer(this->queue, batch.matrix1Buffer, CL_FALSE, offset * sizeof(int), size,
+                                 matrix1 + offset, 0, nullptr, &written);
+            waitList.push_back(written);
+            batch.otherEvents.push_back(written);
+        }
+
+        // Multiply the chunk once its inputs are ready
+        auto multiplied = this->enqueue_kernel(firstRow, chunkRows, cols, waitList);
+
+        // Get the results of the chunk once it has been multiplied
+        cl_event read;
+        if (batch.zeroCopy) {
+            int err;
+            auto mapped = clEnqueueMapBuffer(this->queue, batch.resultsBuffer, CL_FALSE, CL_MAP_READ,
+                                             offset * sizeof(int), size, 1, &multiplied, &read, &err);
+            batch.mappedResults.push_back(mapped);
+        } else {
+            clEnqueueReadBuffer(this->queue, batch.resultsBuffer, CL_FALSE, offset * sizeof(int), size,
+                                results + offset, 1, &multiplied, &read);
+        }
+        batch.readEvents.push_back(read);
+    }
+
+    // Send the commands to the device now, rather than whenever they are first waited on
+    clFlush(this->queue);
+}
+
+// Waits for the matrices queued by start_matrices or start_stream to be processed, then cleans up after them
+void MatrixMultiplyCl::finish_matrices() {
+    auto &batch = this->batch;
+
+    // Wait for all of the results to be read back
+    clWaitForEvents(batch.readEvents.size(), batch.readEvents.data());
+
+    // Add up how long the kernels ran for
+    this->kernelTime = 0;
+    for (auto event : batch.kernelEvents) {
+        cl_ulong start;
+        cl_ulong end;
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
+        this->kernelTime += end - start;
+    }
+
+    // Work out how long the device was busy for, from the first command starting to the last result being read
+    cl_ulong firstStart = UINT64_MAX;
+    cl_ulong lastEnd = 0;
+    for (auto const &events : {batch.kernelEvents, batch.readEvents, batch.otherEvents}) {
+        for (auto event : events) {
+            cl_ulong start;
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+            firstStart = std::min(firstStart, start);
+        }
+    }
+    for (auto event : batch.readEvents) {
+        cl_ulong end;
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
+        lastEnd = std::max(lastEnd, end);
+    }
+    this->busyTime = lastEnd > firstStart ? lastEnd - firstStart : 0;
+
+    if (batch.zeroCopy) {
+        // The mapped chunks are the results themselves, so unmapping them just hands them back
+        for (auto mapped : batch.mappedResults) {
+            clEnqueueUnmapMemObject(this->queue, batch.resultsBuffer, mapped, 0, nullptr, nullptr);
+        }
+        clFinish(this->queue);
+
+        clReleaseMemObject(batch.matrix1Buffer);
+        clReleaseMemObject(batch.matrix2Buffer);
+        clReleaseMemObject(batch.resultsBuffer);
+    }
+
+    for (auto const &events : {batch.kernelEvents, batch.readEvents, batch.otherEvents}) {
+        for (auto event : events) {
+            clReleaseEvent(event);
+        }
+    }
 
-    // Load the work items, and start the processing, assigning an event that will block untill processing is complete
-    clEnqueueNDRangeKernel(this->queue, this->kernel, 1, nullptr, global, nullptr, 0, nullptr, &event);
-    clWaitForEvents(1, &event);
+    batch = {};
+}
+
+// Processes the given matrices and gives an output
+void MatrixMultiplyCl::process_matrices(matrix_t matrix1[], matrix_t matrix2Transposed[], matrix_t results[], my_size_t rows, my_size_t cols) {
+    this->start_matrices(matrix1, matrix2Transposed, results, rows, cols);
+    this->finish_matrices();
+}
+
+// Keeps the given transposed matrix2 on the device, to multiply any number of matrices with through process_stream.
+// It stays there until process_matrices is called on a device it has to be written to.
+void MatrixMultiplyCl::pin_matrix2(matrix_t matrix2Transposed[], my_size_t cols) {
+    auto size = (size_t)cols * cols * sizeof(int);
+    this->reserve_buffer(this->matrix2Transposed, this->matrix2TransposedCapacity, size, CL_MEM_READ_ONLY);
+    clEnqueueWriteBuffer(this->queue, this->matrix2Transposed, CL_TRUE, 0, size, matrix2Transposed, 0, nullptr,
+                         nullptr);
 
-    // Read out the results
-    clEnqueueReadBuffer(this->queue, this->results, CL_TRUE, 0, rows * cols * sizeof(int), results, 0, nullptr, nullptr);
-}
\ No newline at end of file
+    this->pinnedCols = cols;
+}
+
+// Queues up the processing of as many of the given matrices with the pinned matrix2 as fit in STREAM_ROWS, or just the
+// first if it doesn't fit by itself. Gives back how many were taken, their results are only there once
+// finish_matrices is called.
+// The matrices are stacked one after another in the buffers, then multiplied in chunks of CHUNK_ROWS as if they were
+// one matrix, so a lot of small matrices share each launch of the kernel.
+size_t MatrixMultiplyCl::start_stream(StreamMatrix const matrices[], size_t count) {
+    auto cols = this->pinnedCols;
+    if (cols == 0) {
+        std::cerr << "There is no pinned matrix to multiply with" << std::endl;
+        exit(CL_INVALID_VALUE);
+    }
+
+    // Take matrices until the next one would go over STREAM_ROWS
+    size_t taken = 0;
+    my_size_t rows = 0;
+    std::vector<my_size_t> firstRows;
+    while (taken < count && (taken == 0 || rows + matrices[taken].rows <= STREAM_ROWS)) {
+        firstRows.push_back(rows);
+        rows += matrices[taken].rows;
+        taken++;
+    }
+    firstRows.push_back(rows);
+
+    auto &batch = this->batch;
+    this->reserve_buffer(this->matrix1, this->matrix1Capacity, (size_t)rows * cols * sizeof(int), CL_MEM_READ_ONLY);
+    this->reserve_buffer(this->results, this->resultsCapacity, (size_t)rows * cols * sizeof(int), CL_MEM_WRITE_ONLY);
+    batch.matrix1Buffer = this->matrix1;
+    batch.matrix2Buffer = this->matrix2Transposed;
+    batch.resultsBuffer = this->results;
+
+    // Write each matrix into its place in the stack
+    std::vector<cl_event> written(taken);
+    for (size_t matrix = 0; matrix < taken; matrix++) {
+        clEnqueueWriteBuffer(this->queue, batch.matrix1Buffer, CL_FALSE, (size_t)firstRows[matrix] * cols * sizeof(int),
+                             (size_t)matrices[matrix].rows * cols * sizeof(int), matrices[matrix].matrix1, 0, nullptr,
+                             &written[matrix]);
+        batch.otherEvents.push_back(written[matrix]);
+    }
+
+    // Multiply each chunk once every matrix it covers has been written, then read each matrix back once every chunk
+    // covering it has been multiplied
+    std::vector<std::vector<cl_event>> multiplied(taken);
+    size_t matrix = 0;
+    for (my_size_t firstRow = 0; firstRow < rows; firstRow += CHUNK_ROWS) {
+        auto chunkRows = std::min(CHUNK_ROWS, rows - firstRow);
+
+        std::vector<cl_event> waitList;
+        auto last = matrix;
+        for (; last < taken && firstRows[last] < firstRow + chunkRows; last++) {
+            waitList.push_back(written[last]);
+        }
+
+        auto event = this->enqueue_kernel(firstRow, chunkRows, cols, waitList);
+        for (auto covered = matrix; covered < last; covered++) {
+            multiplied[covered].push_back(event);
+        }
+
+        // The last matrix carries on into the next chunk, unless it ends with this one
+        matrix = firstRows[last] > firstRow + chunkRows ? last - 1 : last;
+    }
+
+    for (matrix = 0; matrix < taken; matrix++) {
+        cl_event read;
+        clEnqueueReadBuffer(this->queue, batch.resultsBuffer, CL_FALSE, (size_t)firstRows[matrix] * cols * sizeof(int),
+                            (size_t)matrices[matrix].rows * cols * sizeof(int), matrices[matrix].results,
+                            multiplied[matrix].size(), multiplied[matrix].data(), &read);
+        batch.readEvents.push_back(read);
+    }
+
+    // Send the commands to the device now, rather than whenever they are first waited on
+    clFlush(this->queue);
+
+    return taken;
+}
+
+// Multiplies each of the given matrices with the pinned matrix2
+void MatrixMultiplyCl::process_stream(std::vector<StreamMatrix> const &matrices) {
+    for (size_t first = 0; first < matrices.size(); ) {
+        first += this->start_stream(matrices.data() + first, matrices.size() - first);
+        this->finish_matrices();
+    }
+}
+
+// Gets the bucket the tuning for matrices with the given number of columns is kept under, the next power of 2
+my_size_t MatrixMultiplyCl::size_bucket(my_size_t cols) {
+    return (my_size_t)std::bit_ceil((unsigned)cols);
+}
+
+// Checks if a work-group of the kernel built with the given configuration, and its tiles in local memory, fit on the
+// device
+bool MatrixMultiplyCl::fits_device(KernelConfig const &config) const {
+    size_t maxWorkGroupSize;
+    clGetDeviceInfo(this->deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxWorkGroupSize), &maxWorkGroupSize,
+                    nullptr);
+    cl_ulong localMemSize;
+    clGetDeviceInfo(this->deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemSize), &localMemSize, nullptr);
+
+    auto localSize = (size_t)(config.tileSize / config.workPerItem);
+    auto tilesSize = (size_t)2 * config.tileSize * (config.tileSize + 1) * sizeof(int);
+
+    return config.workPerItem > 0 && config.tileSize % config.workPerItem == 0 && config.vectorWidth > 0 &&
+        config.tileSize % config.vectorWidth == 0 && localSize * localSize <= maxWorkGroupSize &&
+        tilesSize <= localMemSize;
+}
+
+// Times the general variant of the kernel built with the given configuration on TUNE_ROWS rows of matrices with the
+// given number of columns, giving back the fastest of TUNE_RUNS runs in nanoseconds, or 0 if it can't run.
+// It runs on whatever is in the buffers, as what the matrices hold makes no difference to how long it takes.
+cl_ulong MatrixMultiplyCl::time_config(KernelConfig const &config, my_size_t cols) {
+    this->use_variant(this->kernel_options(config, 0, 0));
+
+    // The kernel itself can have a lower limit than the device, depending on how many registers it needs
+    size_t kernelWorkGroupSize;
+    clGetKernelWorkGroupInfo(this->kernel, this->deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelWorkGroupSize),
+                             &kernelWorkGroupSize, nullptr);
+    auto localSize = (size_t)(config.tileSize / config.workPerItem);
+    if (localSize * localSize > kernelWorkGroupSize) {
+        return 0;
+    }
+
+    auto &batch = this->batch;
+    auto matrixSize = (size_t)TUNE_ROWS * cols * sizeof(int);
+    this->reserve_buffer(this->matrix1, this->matrix1Capacity, matrixSize, CL_MEM_READ_ONLY);
+    this->reserve_buffer(this->matrix2Transposed, this->matrix2TransposedCapacity, (size_t)cols * cols * sizeof(int),
+                         CL_MEM_READ_ONLY);
+    this->reserve_buffer(this->results, this->resultsCapacity, matrixSize, CL_MEM_WRITE_ONLY);
+    batch.matrix1Buffer = this->matrix1;
+    batch.matrix2Buffer = this->matrix2Transposed;
+    batch.resultsBuffer = this->results;
+
+    cl_ulong fastest = 0;
+    for (int run = 0; run < TUNE_RUNS; run++) {
+        auto event = this->launch_kernel(config, 0, TUNE_ROWS, cols, {});
+        if (event == nullptr) {
+            fastest = 0;
+            break;
+        }
+
+        cl_ulong start;
+        cl_ulong end;
+        clWaitForEvents(1, &event);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
+        clReleaseEvent(event);
+
+        if (fastest == 0 || end - start < fastest) {
+            fastest = std::max<cl_ulong>(end - start, 1);
+        }
+    }
+
+    batch = {};
+
+    return fastest;
+}
+
+// Times every configuration of the kernel that fits the device on matrices with the given number of columns, and
+// keeps the fastest for matrices of about that size, saving it for later runs.
+// It runs on the buffers, so any pinned matrix2 has to be pinned again afterwards.
+void MatrixMultiplyCl::tune(my_size_t cols) {
+    // Only the variants that were already built and the one picked are kept, leaving room for the shape variants
+    std::vector<std::string> builtOptions;
+    for (auto const &[options, variant] : this->variants) {
+        builtOptions.push_back(options);
+    }
+
+    auto best = this->defaultConfig;
+    cl_ulong bestTime = 0;
+    for (my_size_t tileSize : {8, 16, 32, 64}) {
+        for (my_size_t workPerItem : {1, 2, 4, 8}) {
+            for (my_size_t vectorWidth : {2, 4, 8}) {
+                KernelConfig config = {tileSize, workPerItem, vectorWidth};
+                if (!this->fits_device(config)) {
+                    continue;
+                }
+
+                auto time = this->time_config(config, cols);
+                if (time > 0 && (bestTime == 0 || time < bestTime)) {
+                    best = config;
+                    bestTime = time;
+                }
+            }
+        }
+    }
+    this->pinnedCols = 0;
+
+    auto bestOptions = this->kernel_options(best, 0, 0);
+    std::erase_if(this->variants, [&](auto const &variant) {
+        auto const &[options, kernelVariant] = variant;
+        if (options == bestOptions || std::ranges::find(builtOptions, options) != builtOptions.end()) {
+            return false;
+        }
+
+        clReleaseKernel(kernelVariant.kernel);
+        clReleaseProgram(kernelVariant.program);
+        return true;
+    });
+
+    auto bucket = size_bucket(cols);
+    this->tunedConfigs[bucket] = best;
+    this->save_tuning(bucket, best);
+
+    std::cout << "Tuned " << device_string(this->deviceId, CL_DEVICE_NAME) << " for up to " << bucket
+              << " columns: tile size " << best.tileSize << ", work per item " << best.workPerItem
+              << ", vector width " << best.vectorWidth << std::endl;
+}
+
+// Gets the name of the file the tuned configurations are kept in, next to the program
+std::string MatrixMultiplyCl::tuning_filename() const {
+    return this->filename + ".tuning";
+}
+
+// Reads a line of the tuning file, which is a size bucket, the tile size, work per item and vector width, then the
+// device name. Returns false if the line isn't one.
+static bool read_tuning_line(std::string const &line, my_size_t &bucket, my_size_t &tileSize, my_size_t &workPerItem,
+                             my_size_t &vectorWidth, std::string &deviceName) {
+    std::istringstream fields(line);
+    return fields >> bucket >> tileSize >> workPerItem >> vectorWidth >> std::ws && std::getline(fields, deviceName);
+}
+
+// Loads the configurations tuned for this device in earlier runs, if there are any
+void MatrixMultiplyCl::load_tuning() {
+    std::ifstream tuningFile(this->tuning_filename());
+    auto deviceName = device_string(this->deviceId, CL_DEVICE_NAME);
+
+    std::string line;
+    while (std::getline(tuningFile, line)) {
+        my_size_t bucket;
+        KernelConfig config;
+        std::string name;
+        if (read_tuning_line(line, bucket, config.tileSize, config.workPerItem, config.vectorWidth, name) &&
+            name == deviceName && this->fits_device(config)) {
+            this->tunedConfigs[bucket] = config;
+        }
+    }
+}
+
+// Saves the configuration tuned for this device for the given size bucket, replacing any it had before and keeping
+// every other line. Like the program binaries it goes through a temporary file, so other processes never load half
+// of it.
+void MatrixMultiplyCl::save_tuning(my_size_t bucket, KernelConfig const &config) {
+    auto tuningFilename = this->tuning_filename();
+    auto deviceName = device_string(this->deviceId, CL_DEVICE_NAME);
+
+    std::vector<std::string> lines;
+    {
+        std::ifstream tuningFile(tuningFilename);
+        std::string line;
+        while (std::getline(tuningFile, line)) {
+            my_size_t lineBucket;
+            KernelConfig lineConfig;
+            std::string name;
+            if (read_tuning_line(line, lineBucket, lineConfig.tileSize, lineConfig.workPerItem, lineConfig.vectorWidth,
+                                 name) && lineBucket == bucket && name == deviceName) {
+                continue;
+            }
+            lines.push_back(line);
+        }
+    }
+    lines.push_back(std::to_string(bucket) + " " + std::to_string(config.tileSize) + " " +
+                    std::to_string(config.workPerItem) + " " + std::to_string(config.vectorWidth) + " " + deviceName);
+
+    auto tempFilename = tuningFilename + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream tempFile(tempFilename);
+        for (auto const &line : lines) {
+            tempFile << line << '\n';
+        }
+
+        if (!tempFile) {
+            std::remove(tempFilename.c_str());
+            return;
+        }
+    }
+
+    std::rename(tempFilename.c_str(), tuningFilename.c_str());
+}
+
+// Gets how long the kernel ran for in the last call to process_matrices, in nanoseconds
+cl_ulong MatrixMultiplyCl::kernel_time() const {
+    return this->kernelTime;
+}
+
+// Gets how long the device was busy for in the last call to process_matrices, in nanoseconds
+cl_ulong MatrixMultiplyCl::busy_time() const {
+    return this->busyTime;
+}
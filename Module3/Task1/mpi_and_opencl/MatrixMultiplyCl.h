@@ -1,16 +1,95 @@
 #ifndef TASK1_MATRIXMULTIPLYCL_H
 #define TASK1_MATRIXMULTIPLYCL_H
 
+#include <map>
+#include <new>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <CL/cl.h>
 
 #include "types.h"
 
 
+// The alignment of host memory that is allocated to be used in place by the device, a page
+constexpr size_t HOST_ALIGNMENT = 4096;
+
+// Allocates memory aligned to HOST_ALIGNMENT, so a device that shares memory with the host can use it in place
+template <typename T>
+struct HostAllocator {
+    using value_type = T;
+
+    HostAllocator() = default;
+
+    template <typename U>
+    HostAllocator(HostAllocator<U> const &) {}
+
+    T *allocate(size_t count) {
+        return static_cast<T *>(::operator new(count * sizeof(T), std::align_val_t(HOST_ALIGNMENT)));
+    }
+
+    void deallocate(T *pointer, size_t) {
+        ::operator delete(pointer, std::align_val_t(HOST_ALIGNMENT));
+    }
+
+    bool operator==(HostAllocator const &) const {
+        return true;
+    }
+};
+
+// A vector of matrix elements that the device can use in place
+using host_vector = std::vector<matrix_t, HostAllocator<matrix_t>>;
+
+// A matrix to multiply with a pinned matrix2, along with where its result goes
+struct StreamMatrix {
+    matrix_t *matrix1;
+    matrix_t *results;
+    my_size_t rows;
+};
+
+
 // OpenCL Matrix Multiplication class.
 // It manages the initialisation of OpenCL on construction, then deals with running and returning results.
 class MatrixMultiplyCl {
 private:
+    // The size of the square tiles of the result each work-group of the kernel computes, unless it has been tuned
+    static constexpr my_size_t TILE_SIZE = 32;
+
+    // The number of rows and columns of its tile each work-item computes, if the work-group fits on the device
+    static constexpr my_size_t WORK_PER_ITEM = 2;
+
+    // The number of elements the kernel loads into local memory at a time
+    static constexpr my_size_t VECTOR_WIDTH = 4;
+
+    // The number of rows in each chunk that is written, multiplied and read back on its own. A multiple of every tile
+    // size keeps every chunk but the last a whole number of tiles.
+    static constexpr my_size_t CHUNK_ROWS = 256;
+
+    // The number of rows of the matrices each configuration of the kernel is timed on when tuning
+    static constexpr my_size_t TUNE_ROWS = 256;
+
+    // The number of times each configuration is timed when tuning, keeping the fastest
+    static constexpr int TUNE_RUNS = 3;
+
+    // The most rows of streamed matrices to stack up in the buffers at once
+    static constexpr my_size_t STREAM_ROWS = 4096;
+
+    // The most numbers of columns to build a kernel specialised for whole chunks of, any others use the general one
+    static constexpr size_t MAX_SHAPE_VARIANTS = 8;
+
+    // A variant of the program built with a set of options, along with its kernel
+    struct KernelVariant {
+        cl_program program;
+        cl_kernel kernel;
+    };
+
+    // The sizes the kernel is built and launched with
+    struct KernelConfig {
+        my_size_t tileSize;
+        my_size_t workPerItem;
+        my_size_t vectorWidth;
+    };
+
     // All of the base OpenCL objects
     cl_device_id deviceId;
     cl_context context;
@@ -18,27 +97,148 @@ private:
     cl_command_queue queue;
     cl_program program;
 
-    // The memory used for matrix buffering
-    cl_mem matrix1;
-    cl_mem matrix2Transposed;
-    cl_mem results;
+    // The memory used for matrix buffering, kept between calls and only reallocated when it needs to grow
+    cl_mem matrix1 = nullptr;
+    cl_mem matrix2Transposed = nullptr;
+    cl_mem results = nullptr;
+
+    // The number of columns of the matrix2 pinned in its buffer, or 0 if there isn't one
+    my_size_t pinnedCols = 0;
+
+    // The size in bytes of each of the buffers
+    size_t matrix1Capacity = 0;
+    size_t matrix2TransposedCapacity = 0;
+    size_t resultsCapacity = 0;
+
+    // Whether the device shares memory with the host, so buffers can wrap host memory rather than copy it
+    bool unifiedMemory;
+
+    // The alignment in bytes host memory needs for the device to use it in place
+    size_t hostAlignment;
+
+    // The configuration of the kernel for matrices it hasn't been tuned for
+    KernelConfig defaultConfig = {TILE_SIZE, WORK_PER_ITEM, VECTOR_WIDTH};
+
+    // The tuned configurations of the kernel for this device, by size bucket
+    std::map<my_size_t, KernelConfig> tunedConfigs;
+
+    // How long the kernel ran for in the last call to process_matrices, in nanoseconds
+    cl_ulong kernelTime = 0;
+
+    // How long the device was busy for in the last call to process_matrices, in nanoseconds
+    cl_ulong busyTime = 0;
+
+    // The buffers and commands of the matrices queued by start_matrices, for finish_matrices to wait on
+    struct Batch {
+        bool zeroCopy = false;
+        cl_mem matrix1Buffer = nullptr;
+        cl_mem matrix2Buffer = nullptr;
+        cl_mem resultsBuffer = nullptr;
+        std::vector<cl_event> kernelEvents;
+        std::vector<cl_event> readEvents;
+        std::vector<cl_event> otherEvents;
+
+        // The start of each mapped chunk of the results, to unmap them again
+        std::vector<void *> mappedResults;
+    } batch;
+
+    // Every variant of the program built so far, keyed by the options it was built with
+    std::unordered_map<std::string, KernelVariant> variants;
+
+    // The program file and kernel name, kept to build more variants from
+    std::string filename;
+    std::string kernelName;
 
     // The private methods for initialising OpenCL
-    void select_device();
+    static cl_device_id select_device();
+    void check_memory();
     void create_context();
     void create_queue();
     void create_kernel(std::string const &kernelName);
-    void build_program(std::string const &filename);
+    void build_kernel();
+
+    // The private methods for building and picking the variants of the kernel
+    KernelConfig kernel_config(my_size_t cols) const;
+    std::string kernel_options(KernelConfig const &config, my_size_t rows, my_size_t cols);
+    void use_variant(std::string const &options);
+    void build_program(std::string const &filename, std::string const &options = "");
+
+    // The private methods for caching the compiled program on disk
+    std::string program_cache_key(std::string const &source, std::string const &options);
+    bool load_program_binary(std::string const &cacheFilename, std::string const &key, std::string const &options);
+    void save_program_binary(std::string const &cacheFilename, std::string const &key);
+
+    // The private methods for tuning the kernel and keeping the results on disk
+    static my_size_t size_bucket(my_size_t cols);
+    bool fits_device(KernelConfig const &config) const;
+    cl_ulong time_config(KernelConfig const &config, my_size_t cols);
+    std::string tuning_filename() const;
+    void load_tuning();
+    void save_tuning(my_size_t bucket, KernelConfig const &config);
+
+    // Makes sure a buffer holds at least the given number of bytes, replacing it with a bigger one if it does not
+    void reserve_buffer(cl_mem &buffer, size_t &capacity, size_t size, cl_mem_flags flags);
+
+    // Creates a buffer that uses the given host memory in place, for devices that share memory with the host
+    cl_mem wrap_buffer(void *host, size_t size, cl_mem_flags flags);
+
+    // Checks if host memory is aligned well enough for the device to use it in place
+    bool is_aligned(void const *host) const;
+
+    // Queues up the kernel on a chunk of the rows in the batch's buffers, once the given events are done
+    cl_event enqueue_kernel(my_size_t firstRow, my_size_t rows, my_size_t cols, std::vector<cl_event> const &waitList);
+
+    // Queues up the current variant of the kernel, built with the given configuration, the same way
+    cl_event launch_kernel(KernelConfig const &config, my_size_t firstRow, my_size_t rows, my_size_t cols,
+                           std::vector<cl_event> const &waitList);
 
 public:
-    // Initialises the matrix multiply with a .cl file and kernel function name
+    // Initialises the matrix multiply with a .cl file and kernel function name, on the preferred device
     MatrixMultiplyCl(std::string const &filename, std::string const &kernelName);
 
+    // Initialises the matrix multiply with a .cl file and kernel function name, on the given device
+    MatrixMultiplyCl(std::string const &filename, std::string const &kernelName, cl_device_id deviceId);
+
+    // Finds every device of every platform, with CPUs split up by NUMA node
+    static std::vector<cl_device_id> find_devices();
+
     // Destructor manages cleaning up the OpenCL objects and memory
     ~MatrixMultiplyCl();
 
+    // The OpenCL objects can only be released once, so the class can't be copied
+    MatrixMultiplyCl(MatrixMultiplyCl const &) = delete;
+    MatrixMultiplyCl &operator=(MatrixMultiplyCl const &) = delete;
+
     // Processes the given matrices and gives an output
     void process_matrices(matrix_t matrix1[], matrix_t matrix2Transposed[], matrix_t results[], my_size_t rows, my_size_t cols);
+
+    // Queues up the processing of the given matrices, the results are only there once finish_matrices is called
+    void start_matrices(matrix_t matrix1[], matrix_t matrix2Transposed[], matrix_t results[], my_size_t rows, my_size_t cols);
+
+    // Waits for the matrices queued by start_matrices or start_stream to be processed
+    void finish_matrices();
+
+    // Keeps the given transposed matrix2 on the device, to multiply any number of matrices with through process_stream
+    void pin_matrix2(matrix_t matrix2Transposed[], my_size_t cols);
+
+    // Multiplies each of the given matrices with the pinned matrix2
+    void process_stream(std::vector<StreamMatrix> const &matrices);
+
+    // Queues up as many of the given matrices to multiply with the pinned matrix2 as fit, giving back how many
+    size_t start_stream(StreamMatrix const matrices[], size_t count);
+
+    // Times every configuration of the kernel that fits the device on matrices with the given number of columns, and
+    // keeps the fastest for matrices of about that size, saving it for later runs. Any pinned matrix2 is dropped.
+    void tune(my_size_t cols);
+
+    // Builds the kernel for matrices with the given number of columns ahead of multiplying them
+    void prepare(my_size_t cols);
+
+    // Gets how long the kernel ran for in the last call to process_matrices, in nanoseconds
+    cl_ulong kernel_time() const;
+
+    // Gets how long the device was busy for in the last call to process_matrices, in nanoseconds
+    cl_ulong busy_time() const;
 };
 
 
@@ -0,0 +1,166 @@
+#include "MultiDeviceMultiplyCl.h"
+
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+
+// Initialises a matrix multiply with a .cl file and kernel function name on every device
+MultiDeviceMultiplyCl::MultiDeviceMultiplyCl(std::string const &filename, std::string const &kernelName) {
+    for (auto deviceId : MatrixMultiplyCl::find_devices()) {
+        this->devices.push_back(std::make_unique<MatrixMultiplyCl>(filename, kernelName, deviceId));
+    }
+
+    // Until they are measured, every device is assumed to be as fast as the others
+    this->speeds.assign(this->devices.size(), 1.0);
+
+    // There's only something to split with more than one device
+    if (this->devices.size() > 1) {
+        this->calibrate();
+    }
+}
+
+// Times each device on its own on a small multiply, to split the first matrices between them
+void MultiDeviceMultiplyCl::calibrate() {
+    host_vector matrix1(CALIBRATION_ROWS * CALIBRATION_COLS);
+    host_vector matrix2(CALIBRATION_COLS * CALIBRATION_COLS);
+    host_vector results(CALIBRATION_ROWS * CALIBRATION_COLS);
+
+    for (size_t device = 0; device < this->devices.size(); device++) {
+        // The first run on some devices includes finishing off the build of the kernel, so only the second counts
+        for (int run = 0; run < 2; run++) {
+            this->devices[device]->process_matrices(matrix1.data(), matrix2.data(), results.data(), CALIBRATION_ROWS,
+                                                    CALIBRATION_COLS);
+        }
+
+        this->update_speed(device, CALIBRATION_ROWS, CALIBRATION_COLS);
+    }
+}
+
+// Works out how fast a device was on the matrices it last processed
+void MultiDeviceMultiplyCl::update_speed(size_t device, my_size_t rows, my_size_t cols) {
+    auto busyTime = this->devices[device]->busy_time();
+    if (busyTime > 0) {
+        this->speeds[device] = (double)rows * cols * cols / busyTime;
+    }
+}
+
+// Splits the rows between the devices in proportion to their speeds, the last device getting whatever is left over
+std::vector<my_size_t> MultiDeviceMultiplyCl::split_rows(my_size_t rows) {
+    auto totalSpeed = std::accumulate(this->speeds.begin(), this->speeds.end(), 0.0);
+
+    std::vector<my_size_t> shares(this->devices.size(), 0);
+    auto remaining = rows;
+    for (size_t device = 0; device + 1 < shares.size(); device++) {
+        auto share = (my_size_t)std::lround(rows * this->speeds[device] / totalSpeed / SHARE_ROWS) * SHARE_ROWS;
+        shares[device] = std::min(share, remaining);
+        remaining -= shares[device];
+    }
+    shares.back() += remaining;
+
+    return shares;
+}
+
+// Processes the given matrices and gives an output
+// Every device is started on its share before waiting on any of them, so they all work at the same time.
+void MultiDeviceMultiplyCl::process_matrices(matrix_t matrix1[], matrix_t matrix2Transposed[], matrix_t results[], my_size_t rows, my_size_t cols) {
+    auto shares = this->split_rows(rows);
+
+    // Writing matrix2 to the devices replaces the one pinned on them
+    this->pinnedCols = 0;
+
+    my_size_t firstRow = 0;
+    for (size_t device = 0; device < this->devices.size(); device++) {
+        if (shares[device] > 0) {
+            auto offset = (size_t)firstRow * cols;
+            this->devices[device]->start_matrices(matrix1 + offset, matrix2Transposed, results + offset,
+                                                  shares[device], cols);
+        }
+        firstRow += shares[device];
+    }
+
+    for (size_t device = 0; device < this->devices.size(); device++) {
+        if (shares[device] > 0) {
+            this->devices[device]->finish_matrices();
+            this->update_speed(device, shares[device], cols);
+        }
+    }
+}
+
+// Keeps the given transposed matrix2 on every device, to multiply any number of matrices with through process_stream
+void MultiDeviceMultiplyCl::pin_matrix2(matrix_t matrix2Transposed[], my_size_t cols) {
+    for (auto const &device : this->devices) {
+        device->pin_matrix2(matrix2Transposed, cols);
+    }
+
+    this->pinnedCols = cols;
+}
+
+// Multiplies each of the given matrices with the pinned matrix2
+// Each matrix goes to whichever device would get through it soonest, given its speed and what it has already been
+// given. Then every device works through its own matrices a group at a time, all starting their next group before
+// waiting on any of them.
+void MultiDeviceMultiplyCl::process_stream(std::vector<StreamMatrix> const &matrices) {
+    std::vector<std::vector<StreamMatrix>> dealt(this->devices.size());
+    std::vector<double> dealtRows(this->devices.size(), 0.0);
+    for (auto const &matrix : matrices) {
+        size_t soonest = 0;
+        for (size_t device = 1; device < this->devices.size(); device++) {
+            if ((dealtRows[device] + matrix.rows) / this->speeds[device] <
+                (dealtRows[soonest] + matrix.rows) / this->speeds[soonest]) {
+                soonest = device;
+            }
+        }
+
+        dealt[soonest].push_back(matrix);
+        dealtRows[soonest] += matrix.rows;
+    }
+
+    std::vector<size_t> next(this->devices.size(), 0);
+    std::vector<size_t> taken(this->devices.size(), 0);
+    for (auto remaining = matrices.size(); remaining > 0; ) {
+        for (size_t device = 0; device < this->devices.size(); device++) {
+            auto left = dealt[device].size() - next[device];
+            auto *first = dealt[device].data() + next[device];
+            taken[device] = left > 0 ? this->devices[device]->start_stream(first, left) : 0;
+        }
+
+        for (size_t device = 0; device < this->devices.size(); device++) {
+            if (taken[device] == 0) {
+                continue;
+            }
+
+            this->devices[device]->finish_matrices();
+
+            my_size_t rows = 0;
+            for (size_t matrix = next[device]; matrix < next[device] + taken[device]; matrix++) {
+                rows += dealt[device][matrix].rows;
+            }
+            this->update_speed(device, rows, this->pinnedCols);
+
+            next[device] += taken[device];
+            remaining -= taken[device];
+        }
+    }
+}
+
+// Tunes the kernel on every device for matrices with the given number of columns, saving it for later runs.
+// The tuned kernels change how fast each device is, so they are measured again, and any pinned matrix2 is dropped.
+void MultiDeviceMultiplyCl::tune(my_size_t cols) {
+    for (auto &device : this->devices) {
+        device->tune(cols);
+    }
+    this->pinnedCols = 0;
+
+    if (this->devices.size() > 1) {
+        this->calibrate();
+    }
+}
+
+// Builds the kernel on every device for matrices with the given number of columns ahead of multiplying them
+void MultiDeviceMultiplyCl::prepare(my_size_t cols) {
+    for (auto &device : this->devices) {
+        device->prepare(cols);
+    }
+}
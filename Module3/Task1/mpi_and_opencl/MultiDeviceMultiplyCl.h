@@ -0,0 +1,60 @@
+#ifndef TASK1_MULTIDEVICEMULTIPLYCL_H
+#define TASK1_MULTIDEVICEMULTIPLYCL_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MatrixMultiplyCl.h"
+#include "types.h"
+
+
+// OpenCL Matrix Multiplication across every device available.
+// Each device gets a share of the rows in proportion to how fast it has been measured to be, then they all work on
+// their shares at the same time, writing the results straight into place.
+class MultiDeviceMultiplyCl {
+private:
+    // The number of rows each share is rounded to. Being a multiple of the default tile size, it also keeps the start of every
+    // share aligned to at least 128 bytes, for devices that use the matrices in place.
+    static constexpr my_size_t SHARE_ROWS = 32;
+
+    // The size of the matrices each device is timed on when it is set up
+    static constexpr my_size_t CALIBRATION_ROWS = 64;
+    static constexpr my_size_t CALIBRATION_COLS = 256;
+
+    // The matrix multiply for each device
+    std::vector<std::unique_ptr<MatrixMultiplyCl>> devices;
+
+    // How fast each device has been measured to be, in multiply-adds per nanosecond
+    std::vector<double> speeds;
+
+    // The number of columns of the matrix2 pinned on every device, or 0 if there isn't one
+    my_size_t pinnedCols = 0;
+
+    // The private methods for measuring the devices and splitting the rows between them
+    void calibrate();
+    void update_speed(size_t device, my_size_t rows, my_size_t cols);
+    std::vector<my_size_t> split_rows(my_size_t rows);
+
+public:
+    // Initialises a matrix multiply with a .cl file and kernel function name on every device
+    MultiDeviceMultiplyCl(std::string const &filename, std::string const &kernelName);
+
+    // Processes the given matrices and gives an output
+    void process_matrices(matrix_t matrix1[], matrix_t matrix2Transposed[], matrix_t results[], my_size_t rows, my_size_t cols);
+
+    // Keeps the given transposed matrix2 on every device, to multiply any number of matrices with
+    void pin_matrix2(matrix_t matrix2Transposed[], my_size_t cols);
+
+    // Multiplies each of the given matrices with the pinned matrix2
+    void process_stream(std::vector<StreamMatrix> const &matrices);
+
+    // Tunes the kernel on every device for matrices with the given number of columns, saving it for later runs
+    void tune(my_size_t cols);
+
+    // Builds the kernel on every device for matrices with the given number of columns ahead of multiplying them
+    void prepare(my_size_t cols);
+};
+
+
+#endif
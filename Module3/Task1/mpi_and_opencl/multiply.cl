@@ -1,21 +1,131 @@
-__kernel void matrix_multiply(__global int* matrix1,
-                              __global int* matrix2Transposed,
-                              const int rows,
-                              const int cols,
-                              __global int* results)
+// The size of the square tiles of the result that each work-group computes, which is also how much of the shared
+// dimension is staged in local memory at a time. It has to be a multiple of VECTOR_WIDTH for the vector loads.
+#ifndef TILE_SIZE
+#define TILE_SIZE 32
+#endif
+
+// The number of rows and columns of its tile each work-item computes, keeping their sums in registers.
+#ifndef WORK_PER_ITEM
+#define WORK_PER_ITEM 2
+#endif
+
+// The number of elements loaded into local memory at a time, 2, 4, 8 or 16. It has to divide TILE_SIZE.
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+
+// With FIXED_ROWS and FIXED_COLS the kernel is built for just one shape of matrices, so its loops have constant bounds
+// that can be unrolled. When that shape is a whole number of tiles, nothing needs checking against the edges either.
+#ifdef FIXED_ROWS
+#define ROWS FIXED_ROWS
+#define COLS FIXED_COLS
+#if FIXED_ROWS % TILE_SIZE == 0 && FIXED_COLS % TILE_SIZE == 0
+#define EXACT_TILES
+#endif
+#else
+#define ROWS rows
+#define COLS cols
+#endif
+
+// The number of work-items along each side of a work-group.
+#define LOCAL_SIZE (TILE_SIZE / WORK_PER_ITEM)
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+#define VLOAD CONCAT(vload, VECTOR_WIDTH)
+#define VSTORE CONCAT(vstore, VECTOR_WIDTH)
+
+// Copies VECTOR_WIDTH elements of a row of a matrix into local memory, as a single vector load if they are all inside
+// the matrix, or one by one with zeros past the edges if not.
+void load_vector(__global const int* matrix, const int row, const int col, const int rows, const int cols,
+                 __local int* tile)
 {
-    // Get the offset, and from that the row and column in the result matrix to compute for
-    size_t offset = get_global_id(0);
-    size_t row = offset / cols;
-    size_t col = offset % cols;
-
-    // Loop through the given column of the second matrix and the given row of the first matrix, summing the multiplications
-    // into the result accumulator
-    int result = 0;
-    for (int i = 0; i < cols; i++) {
-        result += matrix1[row * cols + i] * matrix2Transposed[col * cols + i];
+#ifndef EXACT_TILES
+    if (row >= rows || col + VECTOR_WIDTH > cols) {
+        for (int i = 0; i < VECTOR_WIDTH; i++) {
+            tile[i] = row < rows && col + i < cols ? matrix[(size_t)row * cols + col + i] : 0;
+        }
+        return;
     }
+#endif
+
+    VSTORE(VLOAD(0, matrix + (size_t)row * cols + col), 0, tile);
+}
+
+// Multiplies the rows of matrix1 from firstRow on with the transposed matrix2, a TILE_SIZE x TILE_SIZE tile of the
+// result per work-group.
+// Dimension 0 of the range goes along the columns of the result, and dimension 1 down the rows.
+// Both matrices are read along the shared dimension, so for each slice of it the work-group loads the rows of both it
+// needs into local memory, then every work-item adds on to its results from there rather than from global memory.
+__kernel __attribute__((reqd_work_group_size(LOCAL_SIZE, LOCAL_SIZE, 1)))
+void matrix_multiply(__global const int* matrix1,
+                     __global const int* matrix2Transposed,
+                     const int rows,
+                     const int cols,
+                     __global int* results,
+                     const int firstRow)
+{
+    // Skip to the rows this kernel works on
+    matrix1 += (size_t)firstRow * COLS;
+    results += (size_t)firstRow * COLS;
+
+    // The rows of the tiles are padded by one, so work-items reading down a column don't all hit the same bank
+    __local int tile1[TILE_SIZE][TILE_SIZE + 1];
+    __local int tile2[TILE_SIZE][TILE_SIZE + 1];
 
-    // Save the result back to the offset
-    results[offset] = result;
-}
\ No newline at end of file
+    const int localCol = get_local_id(0);
+    const int localRow = get_local_id(1);
+    const int localId = localRow * LOCAL_SIZE + localCol;
+    const int tileCol = get_group_id(0) * TILE_SIZE;
+    const int tileRow = get_group_id(1) * TILE_SIZE;
+
+    // Each work-item works on every LOCAL_SIZE-th row and column of the tile, starting from its own
+    int sums[WORK_PER_ITEM][WORK_PER_ITEM];
+    for (int i = 0; i < WORK_PER_ITEM; i++) {
+        for (int j = 0; j < WORK_PER_ITEM; j++) {
+            sums[i][j] = 0;
+        }
+    }
+
+    for (int offset = 0; offset < COLS; offset += TILE_SIZE) {
+        // Load the slices of both matrices between all of the work-items, VECTOR_WIDTH elements at a time
+        for (int load = localId; load < TILE_SIZE * TILE_SIZE / VECTOR_WIDTH; load += LOCAL_SIZE * LOCAL_SIZE) {
+            const int row = load / (TILE_SIZE / VECTOR_WIDTH);
+            const int col = load % (TILE_SIZE / VECTOR_WIDTH) * VECTOR_WIDTH;
+
+            load_vector(matrix1, tileRow + row, offset + col, ROWS, COLS, &tile1[row][col]);
+            load_vector(matrix2Transposed, tileCol + row, offset + col, COLS, COLS, &tile2[row][col]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (int k = 0; k < TILE_SIZE; k++) {
+            int values2[WORK_PER_ITEM];
+            for (int j = 0; j < WORK_PER_ITEM; j++) {
+                values2[j] = tile2[localCol + j * LOCAL_SIZE][k];
+            }
+
+            for (int i = 0; i < WORK_PER_ITEM; i++) {
+                const int value1 = tile1[localRow + i * LOCAL_SIZE][k];
+                for (int j = 0; j < WORK_PER_ITEM; j++) {
+                    sums[i][j] += value1 * values2[j];
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Save the results that are inside the matrix
+    for (int i = 0; i < WORK_PER_ITEM; i++) {
+        const int row = tileRow + localRow + i * LOCAL_SIZE;
+        for (int j = 0; j < WORK_PER_ITEM; j++) {
+            const int col = tileCol + localCol + j * LOCAL_SIZE;
+#ifndef EXACT_TILES
+            if (row >= ROWS || col >= COLS) {
+                continue;
+            }
+#endif
+            results[(size_t)row * COLS + col] = sums[i][j];
+        }
+    }
+}
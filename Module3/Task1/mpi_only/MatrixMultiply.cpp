@@ -1,22 +1,82 @@
 #include <random>
 #include <algorithm>
 #include <chrono>
+#include <cstdint>
+#include <limits>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+#include <fstream>
+#include <numeric>
 #include <mpi.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 //#define PRINT_INPUTS_AND_OUTPUTS  // If the input and output matrices should be printed
 //#define DEBUG
 #define UNCOUNTED_TRANSPOSE  // If the transpose should happen before the timer or after
 #define NON_ROOT_PRIORITY  // If the remaining rows should be assigned with priority to non-root nodes
+#define COMPACT_TRANSFER  // If the input matrices should be sent as 8 bit elements when all of them fit
+//#define PIPELINED_TRANSFER  // If the rows should be sent, multiplied and sent back in overlapping chunks
+//#define SHARED_MATRIX2  // If matrix2 should be held once per node in a shared window instead of by every process
+//#define DYNAMIC_SCHEDULE  // If the processes should claim blocks of rows as they finish instead of getting a fixed split
+//#define CALIBRATED_SPLIT  // If the fixed split should be weighted by how fast each process multiplies a test block
+//#define FILE_IO  // If the matrices should be read from and written to files with MPI-IO instead of going through root
+#define PACKED_MULTIPLY  // If the rows should be multiplied with the packed gemm instead of against the transposed matrix
+#define SPARSE_MULTIPLY  // If mostly zero slabs should be multiplied in CSR form, needs PACKED_MULTIPLY
+//#define SPARSE_INPUTS  // If most of the elements of the random input matrices should be zero
+#define GRID_MULTIPLY  // If the processes should multiply blocks on a 2D grid instead of each getting all of matrix2
+//#define CANNON_MULTIPLY  // If the grid should use Cannon's algorithm instead of SUMMA, needs a square number of processes
 
 
 // Type aliases for our usage
 using matrix_t = int;
 using my_size_t = int;
+using compact_t = uint8_t;  // The type the input matrices are sent as with COMPACT_TRANSFER
 
 
 // The size of the rows and columns of the matrix
 constexpr my_size_t MATRIX_SIZE = 4096;
 
+// The files the input matrices are read from and the result is written to with FILE_IO, as rows of binary ints.
+constexpr const char *MATRIX1_FILE = "matrix1.bin";
+constexpr const char *MATRIX2_FILE = "matrix2.bin";
+constexpr const char *RESULT_FILE = "result.bin";
+
+// Block sizes for the packed multiply, each one chosen so its working set stays inside a cache level.
+constexpr my_size_t L1_BLOCK = 256;  // Depth of the shared dimension, keeps a strip of matrix2 in L1.
+constexpr my_size_t L2_BLOCK = 128;  // Rows of matrix1, keeps an L2_BLOCK x L1_BLOCK block of it in L2.
+constexpr my_size_t L3_BLOCK = 1024;  // Columns of matrix2, keeps an L1_BLOCK x L3_BLOCK panel of it in L3.
+
+// Size of the block of the result matrix that the micro-kernel keeps in registers.
+constexpr my_size_t MICRO_ROWS = 4;
+constexpr my_size_t MICRO_COLS = 8;
+
+// Sizes for the cache-oblivious transpose.
+constexpr my_size_t TRANSPOSE_TILE = 8;  // Size of the square tiles transposed in registers, a tile of ints fills 8 AVX2 registers.
+constexpr my_size_t TRANSPOSE_LEAF = 64;  // Size of the blocks the recursive transpose stops splitting at.
+
+static_assert(TRANSPOSE_TILE == 8 && TRANSPOSE_LEAF >= 2 * TRANSPOSE_TILE, "The tile kernels work on 8 x 8 tiles");
+
+// Settings for the sparse multiply.
+constexpr double SPARSE_DENSITY = 0.1;  // The fraction of non-zero elements under which a matrix is multiplied in CSR form.
+constexpr my_size_t DENSITY_SAMPLES = 4096;  // The number of elements sampled to estimate the density of a matrix.
+constexpr int SPARSE_ZERO_PERCENT = 95;  // The percentage of the elements that are zero with SPARSE_INPUTS.
+
+// The number of rows in each chunk sent, multiplied and sent back with PIPELINED_TRANSFER.
+constexpr my_size_t PIPELINE_ROWS = 32;
+
+// The number of rows in each block the processes claim with DYNAMIC_SCHEDULE.
+constexpr my_size_t SCHEDULE_ROWS = 16;
+
+// The number of rows each process multiplies to time itself with CALIBRATED_SPLIT.
+constexpr my_size_t CALIBRATION_ROWS = 16;
+
+// The widest panel of the shared dimension that SUMMA broadcasts at a time.
+constexpr my_size_t SUMMA_PANEL = 256;
+
 
 // Print out a matrix, along with its name, to the given output.
 void print_matrix(std::string const& name, const matrix_t matrix[], my_size_t const& size, std::ostream& stream = std::cout) {
@@ -54,48 +114,201 @@ void print_vector(std::string const& name, matrix_t const matrix[], my_size_t co
     stream << std::endl;
 }
 
-// Randomise the input matrix
-void randomise_matrix(matrix_t matrix[], my_size_t const& size)
+// Randomise the given number of rows of an input matrix
+void randomise_rows(matrix_t matrix[], my_size_t const& rows, my_size_t const& size)
 {
     // Seed a PRNG with a CRNG provided by the system.
     std::random_device randomDevice;
     std::mt19937 generator(randomDevice());
 
     std::uniform_int_distribution<> distribution(0, 100);
+#ifdef SPARSE_INPUTS
+    std::uniform_int_distribution<> percentDistribution(0, 99);
+#endif
 
-    // Loop through the matrix, randomly generating elements.
-    for (auto i = 0; i < size * size; i++)
+    // Loop through the rows, randomly generating elements.
+    for (auto i = 0; i < rows * size; i++)
     {
         matrix[i] = distribution(generator);
+#ifdef SPARSE_INPUTS
+        // Zero out most of the elements.
+        if (percentDistribution(generator) < SPARSE_ZERO_PERCENT)
+        {
+            matrix[i] = 0;
+        }
+#endif
     }
 }
 
+// Randomise the input matrix
+void randomise_matrix(matrix_t matrix[], my_size_t const& size)
+{
+    randomise_rows(matrix, size, size);
+}
+
 // Templated function to print out a variable with its name.
 template <typename T>
 void print_var(std::string const& name, T value) {
     std::cout << std::endl << name << ": " << value << std::endl;
 }
 
-// Transposes the input matrix
-// Helps with caching by keeping the access sequential when accessing
-// what would originally be the columns.
-void transpose_matrix(matrix_t matrix[], my_size_t const& size) {
-    // Create a temporary matrix for the intermediate result.
-    auto *matrixTemp = new matrix_t[size * size]();
+// Signature of the kernels that transpose a single TRANSPOSE_TILE x TRANSPOSE_TILE tile between two matrices.
+using transpose_tile_t = void (*)(const matrix_t input[], my_size_t inputStride, matrix_t output[], my_size_t outputStride);
+
+// Transposes a TRANSPOSE_TILE x TRANSPOSE_TILE tile one element at a time.
+// The tile is read in full before any of it is written, so the input and output can be the same tile.
+void transpose_tile_scalar(const matrix_t input[], my_size_t inputStride, matrix_t output[], my_size_t outputStride) {
+    matrix_t tile[TRANSPOSE_TILE][TRANSPOSE_TILE];
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++) {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++) {
+            tile[j][i] = input[i * inputStride + j];
+        }
+    }
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++) {
+        for (auto j = 0; j < TRANSPOSE_TILE; j++) {
+            output[i * outputStride + j] = tile[i][j];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Transposes an 8 x 8 tile inside of 8 AVX2 registers.
+// Pairs of rows are interleaved 32 bits at a time, then 64 bits at a time, then the 128 bit halves are swapped
+// over, which leaves each register holding a column. All of the tile is loaded before any of it is stored.
+__attribute__((target("avx2")))
+void transpose_tile_avx2(const matrix_t input[], my_size_t inputStride, matrix_t output[], my_size_t outputStride) {
+    __m256i rows[8];
+    for (auto i = 0; i < 8; i++) {
+        rows[i] = _mm256_loadu_si256((const __m256i *)&input[i * inputStride]);
+    }
+
+    __m256i pairs[8];
+    for (auto i = 0; i < 8; i += 2) {
+        pairs[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+    }
+
+    __m256i quads[8];
+    for (auto i = 0; i < 8; i += 4) {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+
+    for (auto i = 0; i < 4; i++) {
+        auto low = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20);
+        auto high = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31);
+        _mm256_storeu_si256((__m256i *)&output[i * outputStride], low);
+        _mm256_storeu_si256((__m256i *)&output[(i + 4) * outputStride], high);
+    }
+}
+#endif
+
+// Picks the tile kernel to use, based on what the CPU supports.
+// The AVX2 kernel needs the elements to be 32 bits.
+transpose_tile_t select_transpose_tile() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (sizeof(matrix_t) == 4 && __builtin_cpu_supports("avx2")) {
+        return transpose_tile_avx2;
+    }
+#endif
+
+    return transpose_tile_scalar;
+}
+
+// The tile kernel to use, picked once when the program starts.
+transpose_tile_t const transpose_tile = select_transpose_tile();
+
+// Swaps the tile at a with the transpose of the tile at b, transposing both of them.
+void swap_tiles(matrix_t a[], matrix_t b[], my_size_t stride) {
+    matrix_t tile[TRANSPOSE_TILE * TRANSPOSE_TILE];
+    transpose_tile(a, stride, tile, TRANSPOSE_TILE);
+    transpose_tile(b, stride, a, stride);
+
+    for (auto i = 0; i < TRANSPOSE_TILE; i++) {
+        std::copy_n(&tile[i * TRANSPOSE_TILE], TRANSPOSE_TILE, &b[i * stride]);
+    }
+}
+
+// Swaps the rows x cols block at a with the transpose of the cols x rows block at b, when they both fit in cache.
+// Whole tiles go through the tile kernel, the edges that don't make up a whole tile are done one element at a time.
+void transpose_swap_leaf(matrix_t a[], matrix_t b[], my_size_t stride, my_size_t rows, my_size_t cols) {
+    auto tileRows = rows / TRANSPOSE_TILE * TRANSPOSE_TILE;
+    auto tileCols = cols / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    for (auto i = 0; i < tileRows; i += TRANSPOSE_TILE) {
+        for (auto j = 0; j < tileCols; j += TRANSPOSE_TILE) {
+            swap_tiles(&a[i * stride + j], &b[j * stride + i], stride);
+        }
+    }
+
+    for (auto i = 0; i < rows; i++) {
+        for (auto j = i < tileRows ? tileCols : 0; j < cols; j++) {
+            std::swap(a[i * stride + j], b[j * stride + i]);
+        }
+    }
+}
+
+// Transposes a square block on the diagonal in place, when it fits in cache.
+void transpose_diagonal_leaf(matrix_t matrix[], my_size_t stride, my_size_t size) {
+    auto tileSize = size / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    for (auto i = 0; i < tileSize; i += TRANSPOSE_TILE) {
+        // The tile on the diagonal is transposed onto itself, the ones above it are swapped with the ones below.
+        transpose_tile(&matrix[i * stride + i], stride, &matrix[i * stride + i], stride);
+
+        for (auto j = i + TRANSPOSE_TILE; j < tileSize; j += TRANSPOSE_TILE) {
+            swap_tiles(&matrix[i * stride + j], &matrix[j * stride + i], stride);
+        }
+    }
 
-    // Loop through the matrix, transposing it into the temp matrix
     for (auto i = 0; i < size; i++) {
-        for (auto j = 0; j < size; j++) {
-            matrixTemp[j * size + i] = matrix[i * size + j];
+        for (auto j = std::max(i + 1, tileSize); j < size; j++) {
+            std::swap(matrix[i * stride + j], matrix[j * stride + i]);
         }
     }
+}
+// Swaps the rows x cols block at a with the transpose of the cols x rows block at b.
+// The longer side is split in half until the blocks fit in cache, so every cache level gets used well without
+// having to know their sizes.
+void transpose_swap(matrix_t a[], matrix_t b[], my_size_t stride, my_size_t rows, my_size_t cols) {
+    if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF) {
+        transpose_swap_leaf(a, b, stride, rows, cols);
+    } else if (rows >= cols) {
+        // Split on a tile boundary, so only the real edges of the matrix are left out of the tile kernel.
+        auto half = rows / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transpose_swap(a, b, stride, half, cols);
+        transpose_swap(&a[half * stride], &b[half], stride, rows - half, cols);
+    } else {
+        auto half = cols / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+        transpose_swap(a, b, stride, rows, half);
+        transpose_swap(&a[half], &b[half * stride], stride, rows, cols - half);
+    }
+}
 
-    // Copy the transposed matrix back into the original matrix
-    for (auto i = 0; i < size * size; i++) {
-        matrix[i] = matrixTemp[i];
+// Transposes a square block on the diagonal in place.
+// The two blocks on its diagonal are transposed in place, and the two off of it are swapped with each other.
+void transpose_diagonal(matrix_t matrix[], my_size_t stride, my_size_t size) {
+    if (size <= TRANSPOSE_LEAF) {
+        transpose_diagonal_leaf(matrix, stride, size);
+        return;
     }
 
-    delete[] matrixTemp;
+    auto half = size / 2 / TRANSPOSE_TILE * TRANSPOSE_TILE;
+    transpose_diagonal(matrix, stride, half);
+    transpose_diagonal(&matrix[half * stride + half], stride, size - half);
+    transpose_swap(&matrix[half], &matrix[half * stride], stride, half, size - half);
+}
+
+// Transposes the input matrix in place
+// Helps with caching by keeping the access sequential when accessing
+// what would originally be the columns.
+// Works recursively on tiles, so no temporary matrix is needed.
+void transpose_matrix(matrix_t matrix[], my_size_t const& size) {
+    transpose_diagonal(matrix, size, size);
 }
 
 // Set up the control arrays for Scatterv
@@ -145,6 +358,27 @@ void setup_scatter_arrays(my_size_t const& size, int const groupSize, int counts
     }
 }
 
+// Set up the control arrays for Scatterv, splitting the rows up in proportion to the given weights.
+// Each process still gets at least one row, or Scatterv would hang.
+void setup_weighted_scatter_arrays(my_size_t const& size, int const groupSize, const double weights[], int counts[],
+                                   int displs[]) {
+    auto totalWeight = std::accumulate(weights, weights + groupSize, 0.0);
+
+    // Work out where the rows of each process end from the running total of the weights.
+    auto weightSoFar = 0.0;
+    my_size_t start = 0;
+    for (auto i = 0; i < groupSize; i++) {
+        weightSoFar += weights[i];
+
+        auto end = i == groupSize - 1 ? size : (my_size_t)(size * weightSoFar / totalWeight + 0.5);
+        end = std::clamp(end, start + 1, size - (groupSize - i - 1));
+
+        counts[i] = (end - start) * size;
+        displs[i] = start * size;
+        start = end;
+    }
+}
+
 // Multiply a matrix with a vector and save the result into another vector.
 void matrix_vector_multiply(const matrix_t rowVector[], const matrix_t matrixTranspose[], matrix_t resultVector[], my_size_t size) {
     // Loop through each position of the row vector
@@ -162,11 +396,913 @@ void matrix_vector_multiply(const matrix_t rowVector[], const matrix_t matrixTra
     }
 }
 
+// The order the elements of a matrix are stored in.
+enum class Layout { RowMajor, ColumnMajor };
+
+// A non-owning view of a matrix, or of a block inside of a larger matrix.
+// The stride is the distance between the starts of each row, or each column when column major, so a block of a
+// larger matrix (like the slab of rows an MPI process gets) can be worked on in place without copying it.
+template <typename T>
+struct MatrixView {
+    T *data;
+    my_size_t rows;
+    my_size_t cols;
+    my_size_t stride;
+    Layout layout = Layout::RowMajor;
+
+    // Gets the element at the given row and column.
+    T &operator()(my_size_t row, my_size_t col) const {
+        return layout == Layout::RowMajor ? data[row * stride + col] : data[col * stride + row];
+    }
+
+    // Makes a view of the rows x cols block starting at the given row and column.
+    MatrixView block(my_size_t row, my_size_t col, my_size_t blockRows, my_size_t blockCols) const {
+        return {&(*this)(row, col), blockRows, blockCols, stride, layout};
+    }
+};
+
+// Allocates a buffer for a packed panel, aligned to a cache line so the panels never straddle one.
+matrix_t *allocate_packed(my_size_t const& count) {
+    auto bytes = (count * sizeof(matrix_t) + 63) / 64 * 64;
+    return (matrix_t *)std::aligned_alloc(64, bytes);
+}
+
+// Copies a block of A into a packed buffer.
+// The block is stored as MICRO_ROWS tall strips, each one laid out column after column, so the micro-kernel
+// reads it contiguously. Strips at the edge of the matrix are padded out with zeros.
+void pack_a(MatrixView<const matrix_t> const& a, matrix_t packed[]) {
+    for (auto i = 0; i < a.rows; i += MICRO_ROWS) {
+        auto height = std::min(MICRO_ROWS, a.rows - i);
+
+        for (auto k = 0; k < a.cols; k++) {
+            for (auto ii = 0; ii < MICRO_ROWS; ii++) {
+                *packed++ = ii < height ? a(i + ii, k) : 0;
+            }
+        }
+    }
+}
+
+// Copies a strip of B, at most MICRO_COLS wide, into a packed buffer laid out row after row.
+// The strip is padded out with zeros to MICRO_COLS wide.
+void pack_b_strip(MatrixView<const matrix_t> const& b, matrix_t packed[]) {
+    for (auto k = 0; k < b.rows; k++) {
+        for (auto j = 0; j < MICRO_COLS; j++) {
+            *packed++ = j < b.cols ? b(k, j) : 0;
+        }
+    }
+}
+
+// Computes a block of C, at most MICRO_ROWS x MICRO_COLS, from a packed strip of A and B.
+// The partial sums for the whole block are held in registers, the padding in the strips means the loops always
+// have constant bounds so they can be unrolled and vectorised.
+// The first block of the shared dimension applies the epilogue, C = alpha * AB + beta * C, the rest add on
+// alpha * AB. When beta is 0 C is never read, so it doesn't need to be initialised.
+void micro_kernel(const matrix_t aStrip[], const matrix_t bStrip[], MatrixView<matrix_t> const& c, my_size_t depth,
+                  matrix_t alpha, matrix_t beta, bool first) {
+    matrix_t accumulator[MICRO_ROWS][MICRO_COLS] = {};
+
+    for (auto k = 0; k < depth; k++) {
+        for (auto i = 0; i < MICRO_ROWS; i++) {
+            auto aValue = aStrip[k * MICRO_ROWS + i];
+
+            for (auto j = 0; j < MICRO_COLS; j++) {
+                accumulator[i][j] += aValue * bStrip[k * MICRO_COLS + j];
+            }
+        }
+    }
+
+    // Only write back the part of the block that is inside of the matrix.
+    for (auto i = 0; i < c.rows; i++) {
+        for (auto j = 0; j < c.cols; j++) {
+            auto product = alpha * accumulator[i][j];
+
+            if (!first) {
+                c(i, j) += product;
+            } else if (beta == 0) {
+                c(i, j) = product;
+            } else {
+                c(i, j) = product + beta * c(i, j);
+            }
+        }
+    }
+}
+
+// Multiplies a packed block of A with a packed panel of B, walking over the register sized blocks of C.
+void multiply_packed_block(const matrix_t aPacked[], const matrix_t bPacked[], MatrixView<matrix_t> const& c,
+                           my_size_t depth, matrix_t alpha, matrix_t beta, bool first) {
+    for (auto j = 0; j < c.cols; j += MICRO_COLS) {
+        for (auto i = 0; i < c.rows; i += MICRO_ROWS) {
+            micro_kernel(&aPacked[i * depth], &bPacked[j * depth],
+                         c.block(i, j, std::min(MICRO_ROWS, c.rows - i), std::min(MICRO_COLS, c.cols - j)),
+                         depth, alpha, beta, first);
+        }
+    }
+}
+
+// Checks the shapes of the views given to gemm line up, C = A * B needs A to be M x K, B to be K x N and C M x N.
+void check_gemm_shapes(MatrixView<const matrix_t> const& a, MatrixView<const matrix_t> const& b,
+                       MatrixView<matrix_t> const& c) {
+    if (a.cols != b.rows || c.rows != a.rows || c.cols != b.cols) {
+        throw std::invalid_argument("gemm: the shapes of A, B and C don't line up");
+    }
+}
+
+// Scales C by beta, for when there is nothing to multiply.
+void scale_matrix(MatrixView<matrix_t> const& c, matrix_t beta) {
+    for (auto i = 0; i < c.rows; i++) {
+        for (auto j = 0; j < c.cols; j++) {
+            c(i, j) = beta == 0 ? 0 : beta * c(i, j);
+        }
+    }
+}
+
+// General matrix multiply, C = alpha * A * B + beta * C, for an M x K matrix A and a K x N matrix B.
+// Any of the matrices can be a strided view of a block in a larger matrix, and be row or column major.
+// The columns are split up for L3, then the shared dimension for L1, then the rows for L2, and only the panels
+// each block needs are packed, so B never needs a transposed copy.
+void gemm(matrix_t alpha, MatrixView<const matrix_t> const& a, MatrixView<const matrix_t> const& b, matrix_t beta,
+          MatrixView<matrix_t> const& c) {
+    check_gemm_shapes(a, b, c);
+
+    if (a.cols == 0) {
+        scale_matrix(c, beta);
+        return;
+    }
+
+    // Buffers for the packed panels, only ever one block of each matrix in size.
+    auto *aPacked = allocate_packed(L2_BLOCK * L1_BLOCK);
+    auto *bPacked = allocate_packed(L1_BLOCK * L3_BLOCK);
+
+    for (auto jBlock = 0; jBlock < c.cols; jBlock += L3_BLOCK) {
+        auto cols = std::min(L3_BLOCK, c.cols - jBlock);
+
+        for (auto kBlock = 0; kBlock < a.cols; kBlock += L1_BLOCK) {
+            auto depth = std::min(L1_BLOCK, a.cols - kBlock);
+
+            // Pack the panel of B, it gets reused for every row block.
+            for (auto j = 0; j < cols; j += MICRO_COLS) {
+                pack_b_strip(b.block(kBlock, jBlock + j, depth, std::min(MICRO_COLS, cols - j)), &bPacked[j * depth]);
+            }
+
+            for (auto iBlock = 0; iBlock < c.rows; iBlock += L2_BLOCK) {
+                auto rows = std::min(L2_BLOCK, c.rows - iBlock);
+
+                pack_a(a.block(iBlock, kBlock, rows, depth), aPacked);
+                multiply_packed_block(aPacked, bPacked, c.block(iBlock, jBlock, rows, cols), depth, alpha, beta,
+                                      kBlock == 0);
+            }
+        }
+    }
+
+    std::free(aPacked);
+    std::free(bPacked);
+}
+
+// A matrix in compressed sparse row (CSR) form, where only the non-zero elements are stored.
+// The elements of row i are values[rowStarts[i]] up to values[rowStarts[i + 1]], with their columns in columns.
+// The same arrays read with the rows and columns swapped are the compressed sparse column (CSC) form of the
+// transpose, so CSC is never stored separately.
+struct CsrMatrix {
+    my_size_t rows = 0;
+    my_size_t cols = 0;
+    std::vector<my_size_t> rowStarts;
+    std::vector<my_size_t> columns;
+    std::vector<matrix_t> values;
+};
+
+// Estimates the fraction of the elements of a matrix that are non-zero, from DENSITY_SAMPLES elements picked at
+// random, so a pattern in the matrix can't line up with the samples. Small matrices are counted in full.
+double estimate_density(MatrixView<const matrix_t> const& matrix) {
+    long count = (long)matrix.rows * matrix.cols;
+    long nonZeros = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (count <= DENSITY_SAMPLES) {
+        for (auto i = 0; i < matrix.rows; i++) {
+            for (auto j = 0; j < matrix.cols; j++) {
+                nonZeros += matrix(i, j) != 0;
+            }
+        }
+
+        return (double)nonZeros / count;
+    }
+
+    // A fixed seed, so the same matrix always takes the same path.
+    std::minstd_rand generator(1);
+    std::uniform_int_distribution<my_size_t> rowDistribution(0, matrix.rows - 1);
+    std::uniform_int_distribution<my_size_t> colDistribution(0, matrix.cols - 1);
+
+    for (auto i = 0; i < DENSITY_SAMPLES; i++) {
+        auto row = rowDistribution(generator);
+        nonZeros += matrix(row, colDistribution(generator)) != 0;
+    }
+
+    return (double)nonZeros / DENSITY_SAMPLES;
+}
+
+// Compresses a matrix into CSR form.
+CsrMatrix to_csr(MatrixView<const matrix_t> const& matrix) {
+    CsrMatrix csr{matrix.rows, matrix.cols};
+    csr.rowStarts.reserve(matrix.rows + 1);
+    csr.rowStarts.push_back(0);
+
+    for (auto i = 0; i < matrix.rows; i++) {
+        for (auto j = 0; j < matrix.cols; j++) {
+            if (matrix(i, j) != 0) {
+                csr.columns.push_back(j);
+                csr.values.push_back(matrix(i, j));
+            }
+        }
+
+        csr.rowStarts.push_back(csr.columns.size());
+    }
+
+    return csr;
+}
+
+// Expands a CSR matrix back out into a dense one.
+void csr_to_dense(CsrMatrix const& csr, MatrixView<matrix_t> const& matrix) {
+    scale_matrix(matrix, 0);
+
+    for (auto i = 0; i < csr.rows; i++) {
+        for (auto p = csr.rowStarts[i]; p < csr.rowStarts[i + 1]; p++) {
+            matrix(i, csr.columns[p]) = csr.values[p];
+        }
+    }
+}
+
+// Multiplies a CSR matrix with a dense one into a dense result.
+// Each non-zero of a row of the first matrix scales a row of the second one and adds it on to the row of the
+// result, so the dense matrix is always read a row at a time.
+void csr_dense_multiply(CsrMatrix const& a, MatrixView<const matrix_t> const& b, MatrixView<matrix_t> const& c) {
+    for (auto i = 0; i < a.rows; i++) {
+        for (auto j = 0; j < c.cols; j++) {
+            c(i, j) = 0;
+        }
+
+        for (auto p = a.rowStarts[i]; p < a.rowStarts[i + 1]; p++) {
+            auto value = a.values[p];
+            auto k = a.columns[p];
+
+            for (auto j = 0; j < c.cols; j++) {
+                c(i, j) += value * b(k, j);
+            }
+        }
+    }
+}
+
+// Multiplies two CSR matrices into a CSR result with Gustavson's algorithm.
+// Each row of the result is built up in a sparse accumulator, a dense row of sums along with a list of the columns
+// that have been touched, so only the non-zeros of each matrix are ever visited.
+// The rows are gone through twice, first to count the non-zeros of each row so the result can be laid out, then
+// again to fill in the values.
+CsrMatrix csr_multiply(CsrMatrix const& a, CsrMatrix const& b) {
+    CsrMatrix c{a.rows, b.cols};
+    c.rowStarts.assign(a.rows + 1, 0);
+
+    // The sparse accumulator, touched holds the last row that put a sum in each column, -1 for none.
+    std::vector<matrix_t> sums(b.cols);
+    std::vector<my_size_t> touched(b.cols, -1);
+    std::vector<my_size_t> touchedColumns;
+
+    // Count the non-zeros of each row of the result.
+    for (auto i = 0; i < a.rows; i++) {
+        my_size_t count = 0;
+
+        for (auto p = a.rowStarts[i]; p < a.rowStarts[i + 1]; p++) {
+            auto k = a.columns[p];
+
+            for (auto q = b.rowStarts[k]; q < b.rowStarts[k + 1]; q++) {
+                if (touched[b.columns[q]] != i) {
+                    touched[b.columns[q]] = i;
+                    count++;
+                }
+            }
+        }
+
+        c.rowStarts[i + 1] = count;
+    }
+
+    // Turn the counts into where each row starts, and make room for the elements.
+    std::partial_sum(c.rowStarts.begin(), c.rowStarts.end(), c.rowStarts.begin());
+    c.columns.resize(c.rowStarts[a.rows]);
+    c.values.resize(c.rowStarts[a.rows]);
+
+    std::fill(touched.begin(), touched.end(), -1);
+
+    // Sum up each row of the result, then write it out with its columns in order.
+    for (auto i = 0; i < a.rows; i++) {
+        touchedColumns.clear();
+
+        for (auto p = a.rowStarts[i]; p < a.rowStarts[i + 1]; p++) {
+            auto k = a.columns[p];
+            auto value = a.values[p];
+
+            for (auto q = b.rowStarts[k]; q < b.rowStarts[k + 1]; q++) {
+                auto j = b.columns[q];
+
+                if (touched[j] != i) {
+                    touched[j] = i;
+                    sums[j] = 0;
+                    touchedColumns.push_back(j);
+                }
+
+                sums[j] += value * b.values[q];
+            }
+        }
+
+        std::sort(touchedColumns.begin(), touchedColumns.end());
+
+        auto position = c.rowStarts[i];
+        for (auto j : touchedColumns) {
+            c.columns[position] = j;
+            c.values[position] = sums[j];
+            position++;
+        }
+    }
+
+    return c;
+}
+
+// Multiplies the slab of rows a process received with matrix2.
+// With SPARSE_MULTIPLY a slab under SPARSE_DENSITY is multiplied in CSR form, with matrix2 in CSR form as well if
+// it is also sparse. Anything else goes through the packed gemm.
+void multiply_slab(MatrixView<const matrix_t> const& slab, MatrixView<const matrix_t> const& matrix2,
+                   MatrixView<matrix_t> const& resultSlab) {
+#ifdef SPARSE_MULTIPLY
+    if (estimate_density(slab) < SPARSE_DENSITY) {
+        auto a = to_csr(slab);
+
+        if (estimate_density(matrix2) < SPARSE_DENSITY) {
+            csr_to_dense(csr_multiply(a, to_csr(matrix2)), resultSlab);
+        } else {
+            csr_dense_multiply(a, matrix2, resultSlab);
+        }
+
+        return;
+    }
+#endif
+
+    gemm(1, slab, matrix2, 0, resultSlab);
+}
+
+// Checks every element of a matrix fits in compact_t, so it can be sent in compact form without losing anything.
+bool fits_compact(const matrix_t matrix[], my_size_t count) {
+    return std::all_of(matrix, matrix + count, [](matrix_t element) {
+        return element >= std::numeric_limits<compact_t>::min() && element <= std::numeric_limits<compact_t>::max();
+    });
+}
+
+// Packs a matrix into compact_t elements.
+void pack_compact(const matrix_t matrix[], compact_t compact[], my_size_t count) {
+    for (auto i = 0; i < count; i++) {
+        compact[i] = (compact_t)matrix[i];
+    }
+}
+
+// Unpacks compact_t elements back out into a matrix.
+void unpack_compact(const compact_t compact[], matrix_t matrix[], my_size_t count) {
+    for (auto i = 0; i < count; i++) {
+        matrix[i] = compact[i];
+    }
+}
+
+// Broadcasts a matrix from the root process, as compact_t elements if compact is set.
+// Sending the compact form cuts the bytes sent down to a quarter, for the cost of packing and unpacking it.
+void broadcast_matrix(int rank, matrix_t matrix[], my_size_t count, bool compact,
+                      MPI::Intracomm const& comm = MPI::COMM_WORLD) {
+    if (!compact) {
+        comm.Bcast(matrix, count, MPI::INT, 0);
+        return;
+    }
+
+    std::vector<compact_t> buffer(count);
+    if (rank == 0) {
+        pack_compact(matrix, buffer.data(), count);
+    }
+
+    comm.Bcast(buffer.data(), count, MPI::UNSIGNED_CHAR, 0);
+
+    if (rank != 0) {
+        unpack_compact(buffer.data(), matrix, count);
+    }
+}
+
+// Scatters the rows of a matrix from the root process into the slab of each process, as compact_t elements if
+// compact is set. The root process keeps its rows in place at the start of the full matrix.
+void scatter_matrix(int rank, const matrix_t matrix[], matrix_t slab[], int counts[], int displs[], my_size_t size,
+                    bool compact) {
+    if (!compact) {
+        if (rank == 0) {
+            MPI::COMM_WORLD.Scatterv(matrix, counts, displs, MPI::INT, MPI::IN_PLACE, counts[rank], MPI::INT, 0);
+        } else {
+            MPI::COMM_WORLD.Scatterv(nullptr, counts, displs, MPI::INT, slab, counts[rank], MPI::INT, 0);
+        }
+        return;
+    }
+
+    if (rank == 0) {
+        std::vector<compact_t> buffer(size * size);
+        pack_compact(matrix, buffer.data(), size * size);
+        MPI::COMM_WORLD.Scatterv(buffer.data(), counts, displs, MPI::UNSIGNED_CHAR, MPI::IN_PLACE, counts[rank],
+                                 MPI::UNSIGNED_CHAR, 0);
+    } else {
+        std::vector<compact_t> buffer(counts[rank]);
+        MPI::COMM_WORLD.Scatterv(nullptr, counts, displs, MPI::UNSIGNED_CHAR, buffer.data(), counts[rank],
+                                 MPI::UNSIGNED_CHAR, 0);
+        unpack_compact(buffer.data(), slab, counts[rank]);
+    }
+}
+
+// A copy of matrix2 shared by all the processes on a node, held in a window allocated by the first one of them.
+struct SharedMatrix {
+    MPI::Intracomm nodeComm;
+    MPI::Intracomm leaderComm;
+    MPI_Win window;
+    matrix_t *data;
+};
+
+// Shares a matrix from the root process with every process, keeping a single copy of it on each node.
+// The first process on each node allocates the matrix in a shared window that the others on the node map in, then
+// it is only broadcast between those first processes, so each node receives it once rather than once per process.
+SharedMatrix share_matrix(int rank, const matrix_t matrix[], my_size_t count, bool compact) {
+    SharedMatrix shared{};
+
+    MPI_Comm nodeComm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+    shared.nodeComm = nodeComm;
+
+    // The processes keep their order, so the root process leads its node and is the root between the leaders too.
+    auto leader = shared.nodeComm.Get_rank() == 0;
+    shared.leaderComm = MPI::COMM_WORLD.Split(leader ? 0 : MPI::UNDEFINED, rank);
+
+    MPI_Aint bytes = leader ? (MPI_Aint)count * sizeof(matrix_t) : 0;
+    MPI_Win_allocate_shared(bytes, sizeof(matrix_t), MPI_INFO_NULL, nodeComm, &shared.data, &shared.window);
+    if (!leader) {
+        int dispUnit;
+        MPI_Win_shared_query(shared.window, 0, &bytes, &dispUnit, &shared.data);
+    }
+
+    if (leader) {
+        if (rank == 0) {
+            std::copy(matrix, matrix + count, shared.data);
+        }
+
+        broadcast_matrix(rank, shared.data, count, compact, shared.leaderComm);
+    }
+
+    // Make sure the leader has written all of the matrix before anyone on the node reads it.
+    MPI_Win_fence(0, shared.window);
+
+    return shared;
+}
+
+// Frees the window and the communicators of a shared matrix.
+void free_shared_matrix(SharedMatrix& shared) {
+    MPI_Win_free(&shared.window);
+
+    if (shared.leaderComm != MPI::COMM_NULL) {
+        shared.leaderComm.Free();
+    }
+    shared.nodeComm.Free();
+}
+
+// The rows or columns of a matrix that belong to one part, when they are split up as evenly as possible.
+struct Range {
+    my_size_t start;
+    my_size_t count;
+};
+
+// Works out the range of the given part, when size rows or columns are split up into parts.
+Range part_range(my_size_t size, int parts, int part) {
+    auto start = (my_size_t)((long)size * part / parts);
+    auto end = (my_size_t)((long)size * (part + 1) / parts);
+    return {start, end - start};
+}
+
+// A 2D grid of processes, along with communicators for each row and column of the grid.
+// The rank of a process in its row communicator is its column in the grid, and the other way around.
+struct ProcessGrid {
+    MPI::Cartcomm comm;
+    MPI::Cartcomm rowComm;
+    MPI::Cartcomm colComm;
+    int dims[2];
+    int coords[2];
+    bool cannon;
+};
+
+// Arranges all of the processes into a grid, as close to square as possible.
+// The grid wraps around so Cannon's algorithm can shift blocks off one edge and onto the other.
+ProcessGrid create_grid() {
+    ProcessGrid grid{};
+    MPI::Compute_dims(MPI::COMM_WORLD.Get_size(), 2, grid.dims);
+
+    bool periods[2] = {true, true};
+    grid.comm = MPI::COMM_WORLD.Create_cart(2, grid.dims, periods, false);
+    grid.comm.Get_coords(grid.comm.Get_rank(), 2, grid.coords);
+
+    bool keepCols[2] = {false, true};
+    bool keepRows[2] = {true, false};
+    grid.rowComm = grid.comm.Sub(keepCols);
+    grid.colComm = grid.comm.Sub(keepRows);
+
+#ifdef CANNON_MULTIPLY
+    // Cannon's algorithm only works on a square grid, anything else falls back on SUMMA.
+    grid.cannon = grid.dims[0] == grid.dims[1];
+#endif
+
+    return grid;
+}
+
+// The blocks of matrix1 and matrix2 a process in the grid holds to start with.
+struct GridBlocks {
+    Range aRows;
+    Range aCols;
+    Range bRows;
+    Range bCols;
+};
+
+// Works out the blocks the process at the given coordinates starts with.
+// For SUMMA the process at (i, j) holds block (i, j) of both matrices. For Cannon they start off skewed, so it
+// holds block (i, i + j) of matrix1 and block (i + j, j) of matrix2.
+GridBlocks grid_blocks(ProcessGrid const& grid, const int coords[2], my_size_t size) {
+    auto k = grid.cannon ? (coords[0] + coords[1]) % grid.dims[1] : coords[1];
+    auto kRow = grid.cannon ? (coords[0] + coords[1]) % grid.dims[0] : coords[0];
+
+    return {
+        part_range(size, grid.dims[0], coords[0]),
+        part_range(size, grid.dims[1], k),
+        part_range(size, grid.dims[0], kRow),
+        part_range(size, grid.dims[1], coords[1]),
+    };
+}
+
+// Makes a datatype for a block inside of a full matrix, so it can be sent or received in place.
+MPI::Datatype block_type(Range const& rows, Range const& cols, my_size_t size) {
+    auto type = MPI::INT.Create_vector(rows.count, cols.count, size);
+    type.Commit();
+    return type;
+}
+
+// Copies a block out of a full matrix into its own buffer.
+void copy_block(const matrix_t matrix[], my_size_t size, Range const& rows, Range const& cols, matrix_t block[]) {
+    for (auto i = 0; i < rows.count; i++) {
+        std::copy_n(&matrix[(rows.start + i) * size + cols.start], cols.count, &block[i * cols.count]);
+    }
+}
+
+// Sends every process its starting blocks of matrix1 and matrix2 from the root.
+void scatter_blocks(ProcessGrid const& grid, int rank, const matrix_t matrix1[], const matrix_t matrix2[],
+                    my_size_t size, matrix_t aBlock[], matrix_t bBlock[]) {
+    if (rank != 0) {
+        auto blocks = grid_blocks(grid, grid.coords, size);
+        grid.comm.Recv(aBlock, blocks.aRows.count * blocks.aCols.count, MPI::INT, 0, 0);
+        grid.comm.Recv(bBlock, blocks.bRows.count * blocks.bCols.count, MPI::INT, 0, 1);
+        return;
+    }
+
+    for (auto process = 0; process < grid.comm.Get_size(); process++) {
+        int coords[2];
+        grid.comm.Get_coords(process, 2, coords);
+        auto blocks = grid_blocks(grid, coords, size);
+
+        if (process == 0) {
+            copy_block(matrix1, size, blocks.aRows, blocks.aCols, aBlock);
+            copy_block(matrix2, size, blocks.bRows, blocks.bCols, bBlock);
+            continue;
+        }
+
+        auto aType = block_type(blocks.aRows, blocks.aCols, size);
+        auto bType = block_type(blocks.bRows, blocks.bCols, size);
+        grid.comm.Send(&matrix1[blocks.aRows.start * size + blocks.aCols.start], 1, aType, process, 0);
+        grid.comm.Send(&matrix2[blocks.bRows.start * size + blocks.bCols.start], 1, bType, process, 1);
+        aType.Free();
+        bType.Free();
+    }
+}
+
+// Collects the blocks of the result from every process back into the full result matrix on the root.
+void gather_blocks(ProcessGrid const& grid, int rank, const matrix_t cBlock[], matrix_t resultMatrix[],
+                   my_size_t size) {
+    if (rank != 0) {
+        auto blocks = grid_blocks(grid, grid.coords, size);
+        grid.comm.Send(cBlock, blocks.aRows.count * blocks.bCols.count, MPI::INT, 0, 2);
+        return;
+    }
+
+    for (auto process = 0; process < grid.comm.Get_size(); process++) {
+        int coords[2];
+        grid.comm.Get_coords(process, 2, coords);
+        auto blocks = grid_blocks(grid, coords, size);
+
+        if (process == 0) {
+            for (auto i = 0; i < blocks.aRows.count; i++) {
+                std::copy_n(&cBlock[i * blocks.bCols.count], blocks.bCols.count,
+                            &resultMatrix[(blocks.aRows.start + i) * size + blocks.bCols.start]);
+            }
+            continue;
+        }
+
+        auto cType = block_type(blocks.aRows, blocks.bCols, size);
+        grid.comm.Recv(&resultMatrix[blocks.aRows.start * size + blocks.bCols.start], 1, cType, process, 2);
+        cType.Free();
+    }
+}
+
+// Finds the part that the given row or column belongs to.
+int part_owner(my_size_t size, int parts, my_size_t index) {
+    auto owner = 0;
+    while (part_range(size, parts, owner).start + part_range(size, parts, owner).count <= index) {
+        owner++;
+    }
+
+    return owner;
+}
+
+// Multiplies the blocks held by the grid with SUMMA.
+// Goes along the shared dimension a panel at a time. The grid column that owns a panel of matrix1 broadcasts it
+// along the grid rows, and the grid row that owns the same panel of matrix2 broadcasts it down the grid columns,
+// then every process adds the product of the two panels on to its block of the result.
+// The panels never cross the edge of a block of either matrix, so each one only has a single owner.
+void summa_multiply(ProcessGrid const& grid, GridBlocks const& blocks, const matrix_t aBlock[],
+                    const matrix_t bBlock[], matrix_t cBlock[], my_size_t size) {
+    auto rows = blocks.aRows.count;
+    auto cols = blocks.bCols.count;
+
+    std::vector<matrix_t> aPanel(rows * SUMMA_PANEL);
+    std::vector<matrix_t> bPanel(SUMMA_PANEL * cols);
+
+    for (my_size_t k = 0; k < size;) {
+        auto aOwner = part_owner(size, grid.dims[1], k);
+        auto bOwner = part_owner(size, grid.dims[0], k);
+        auto aEnd = part_range(size, grid.dims[1], aOwner).start + part_range(size, grid.dims[1], aOwner).count;
+        auto bEnd = part_range(size, grid.dims[0], bOwner).start + part_range(size, grid.dims[0], bOwner).count;
+        auto width = std::min({SUMMA_PANEL, aEnd - k, bEnd - k});
+
+        if (grid.coords[1] == aOwner) {
+            copy_block(aBlock, blocks.aCols.count, {0, rows}, {k - blocks.aCols.start, width}, aPanel.data());
+        }
+        if (grid.coords[0] == bOwner) {
+            copy_block(bBlock, cols, {k - blocks.bRows.start, width}, {0, cols}, bPanel.data());
+        }
+
+        grid.rowComm.Bcast(aPanel.data(), rows * width, MPI::INT, aOwner);
+        grid.colComm.Bcast(bPanel.data(), width * cols, MPI::INT, bOwner);
+
+        gemm(1, {aPanel.data(), rows, width, width}, {bPanel.data(), width, cols, cols}, k == 0 ? 0 : 1,
+             {cBlock, rows, cols, cols});
+
+        k += width;
+    }
+}
+
+// Multiplies the blocks held by the grid with Cannon's algorithm, on a square grid.
+// The blocks start off skewed (see grid_blocks), so at every step each process holds a matching pair of blocks.
+// It adds on their product, then passes its block of matrix1 left along its grid row and its block of matrix2 up
+// its grid column, getting the next pair from the processes to its right and below.
+void cannon_multiply(ProcessGrid const& grid, GridBlocks const& blocks, std::vector<matrix_t>& aBlock,
+                     std::vector<matrix_t>& bBlock, matrix_t cBlock[], my_size_t size) {
+    auto q = grid.dims[0];
+    auto rows = blocks.aRows.count;
+    auto cols = blocks.bCols.count;
+
+    // The blocks change size as they move, so the buffers are made big enough for the largest one.
+    auto largest = part_range(size, q, q - 1).count;
+    aBlock.resize(rows * largest);
+    bBlock.resize(largest * cols);
+    std::vector<matrix_t> aNext(rows * largest);
+    std::vector<matrix_t> bNext(largest * cols);
+
+    int left, right, up, down;
+    grid.comm.Shift(1, -1, right, left);
+    grid.comm.Shift(0, -1, down, up);
+
+    for (auto step = 0; step < q; step++) {
+        auto k = (grid.coords[0] + grid.coords[1] + step) % q;
+        auto depth = part_range(size, q, k).count;
+
+        gemm(1, {aBlock.data(), rows, depth, depth}, {bBlock.data(), depth, cols, cols}, step == 0 ? 0 : 1,
+             {cBlock, rows, cols, cols});
+
+        if (step == q - 1) {
+            break;
+        }
+
+        auto nextDepth = part_range(size, q, (k + 1) % q).count;
+        grid.comm.Sendrecv(aBlock.data(), rows * depth, MPI::INT, left, 3,
+                           aNext.data(), rows * nextDepth, MPI::INT, right, 3);
+        grid.comm.Sendrecv(bBlock.data(), depth * cols, MPI::INT, up, 4,
+                           bNext.data(), nextDepth * cols, MPI::INT, down, 4);
+        std::swap(aBlock, aNext);
+        std::swap(bBlock, bNext);
+    }
+}
+
+// Multiplies two matrices using MPI on a 2D grid of processes.
+// Each process only ever holds a block of each matrix, and only panels or blocks are passed along the rows and
+// columns of the grid. So the memory and communication for each process shrink as processes are added, rather
+// than every process needing all of matrix2.
+void grid_multiply(int rank, const matrix_t matrix1[], const matrix_t matrix2[], matrix_t resultMatrix[],
+                   my_size_t size) {
+    auto grid = create_grid();
+    auto blocks = grid_blocks(grid, grid.coords, size);
+
+#ifdef DEBUG
+    if (rank == 0) {
+        print_var("gridRows", grid.dims[0]);
+        print_var("gridCols", grid.dims[1]);
+        print_var("cannon", grid.cannon);
+    }
+#endif
+
+    std::vector<matrix_t> aBlock(blocks.aRows.count * blocks.aCols.count);
+    std::vector<matrix_t> bBlock(blocks.bRows.count * blocks.bCols.count);
+    std::vector<matrix_t> cBlock(blocks.aRows.count * blocks.bCols.count);
+
+    scatter_blocks(grid, rank, matrix1, matrix2, size, aBlock.data(), bBlock.data());
+
+    if (grid.cannon) {
+        cannon_multiply(grid, blocks, aBlock, bBlock, cBlock.data(), size);
+    } else {
+        summa_multiply(grid, blocks, aBlock.data(), bBlock.data(), cBlock.data(), size);
+    }
+
+    gather_blocks(grid, rank, cBlock.data(), resultMatrix, size);
+
+    grid.rowComm.Free();
+    grid.colComm.Free();
+    grid.comm.Free();
+}
+
+// Multiplies a slab of rows of matrix1 with matrix2.
+void multiply_rows(const matrix_t slab[], const matrix_t matrix2[], matrix_t resultSlab[], my_size_t rows,
+                   my_size_t size) {
+#ifdef PACKED_MULTIPLY
+    // Multiply the rows with matrix2, in CSR form if they are mostly zeros or with packed panels of matrix2 if not,
+    // working on the slabs in place
+    multiply_slab({slab, rows, size, size}, {matrix2, size, size, size}, {resultSlab, rows, size, size});
+#else
+    // Loop through all the rows in the slab, multiplying it all
+    for (int i = 0; i < rows; i++) {
+        matrix_vector_multiply(&slab[i * size], matrix2, &resultSlab[i * size], size);
+    }
+#endif
+}
+
+// Multiplies the rows of matrix1 with matrix2 in chunks of PIPELINE_ROWS rows, overlapping the communication with
+// the computation.
+// The root sends out every chunk and posts a receive for every chunk of the result straight away, then multiplies
+// its own rows a chunk at a time, testing the requests between chunks so they keep moving. The other processes
+// post a receive for each of their chunks, then multiply each one as soon as it arrives and send it straight back.
+// So the next chunks are being received and the last ones returned while each chunk is multiplied.
+// Chunks between the same two processes arrive in the order they were sent, so they all share one tag.
+void pipelined_multiply(int rank, const matrix_t matrix1[], const matrix_t matrix2[], matrix_t resultMatrix[],
+                        matrix_t slab[], matrix_t resultSlab[], const int counts[], const int displs[],
+                        my_size_t size) {
+    auto groupSize = MPI::COMM_WORLD.Get_size();
+    auto chunk = PIPELINE_ROWS * size;
+    std::vector<MPI::Request> requests;
+
+    if (rank == 0) {
+        auto largest = *std::max_element(counts, counts + groupSize);
+
+        // Go through the chunks in order of where they are in each slab, so every process gets its first one early.
+        for (auto offset = 0; offset < largest; offset += chunk) {
+            for (auto process = 1; process < groupSize; process++) {
+                if (offset >= counts[process]) {
+                    continue;
+                }
+
+                auto count = std::min(chunk, counts[process] - offset);
+                requests.push_back(MPI::COMM_WORLD.Isend(&matrix1[displs[process] + offset], count, MPI::INT,
+                                                         process, 0));
+                requests.push_back(MPI::COMM_WORLD.Irecv(&resultMatrix[displs[process] + offset], count, MPI::INT,
+                                                         process, 1));
+            }
+        }
+
+        for (auto offset = 0; offset < counts[0]; offset += chunk) {
+            auto count = std::min(chunk, counts[0] - offset);
+            multiply_rows(&matrix1[offset], matrix2, &resultMatrix[offset], count / size, size);
+            MPI::Request::Testall(requests.size(), requests.data());
+        }
+    } else {
+        for (auto offset = 0; offset < counts[rank]; offset += chunk) {
+            requests.push_back(MPI::COMM_WORLD.Irecv(&slab[offset], std::min(chunk, counts[rank] - offset), MPI::INT,
+                                                     0, 0));
+        }
+
+        std::vector<MPI::Request> sends;
+        for (auto offset = 0, i = 0; offset < counts[rank]; offset += chunk, i++) {
+            auto count = std::min(chunk, counts[rank] - offset);
+
+            requests[i].Wait();
+            multiply_rows(&slab[offset], matrix2, &resultSlab[offset], count / size, size);
+            sends.push_back(MPI::COMM_WORLD.Isend(&resultSlab[offset], count, MPI::INT, 0, 1));
+        }
+
+        requests.insert(requests.end(), sends.begin(), sends.end());
+    }
+
+    MPI::Request::Waitall(requests.size(), requests.data());
+}
+
+// Times how fast this process multiplies a block of CALIBRATION_ROWS rows with matrix2, in rows per second.
+// Every process already has matrix2, so its first rows stand in for the block of matrix1.
+double calibrate(const matrix_t matrix2[], my_size_t size) {
+    auto rows = std::min(CALIBRATION_ROWS, size);
+    std::vector<matrix_t> result(rows * size);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    multiply_rows(matrix2, matrix2, result.data(), rows, size);
+    std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+
+    return rows / std::max(duration.count(), 1e-9);
+}
+
+// Multiplies the rows of matrix1 with matrix2, with every process claiming blocks of SCHEDULE_ROWS rows as it
+// finishes the last one, so faster processes end up doing more of them.
+// The root process holds the next block to claim in a counter, which the processes take with MPI_Fetch_and_op. The
+// other processes get the rows of each block they claim straight out of matrix1 and put the results straight into
+// the result matrix, through windows over them on the root process.
+void dynamic_multiply(int rank, matrix_t matrix1[], const matrix_t matrix2[], matrix_t resultMatrix[],
+                      my_size_t size) {
+    // With a single process there is nothing to share out
+    if (MPI::COMM_WORLD.Get_size() == 1) {
+        multiply_rows(matrix1, matrix2, resultMatrix, size, size);
+        return;
+    }
+
+    int nextBlock = 0;
+    auto windowSize = rank == 0 ? (MPI_Aint)size * size * sizeof(matrix_t) : 0;
+
+    MPI_Win counterWindow;
+    MPI_Win matrix1Window;
+    MPI_Win resultWindow;
+    MPI_Win_create(&nextBlock, rank == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD,
+                   &counterWindow);
+    MPI_Win_create(matrix1, windowSize, sizeof(matrix_t), MPI_INFO_NULL, MPI_COMM_WORLD, &matrix1Window);
+    MPI_Win_create(resultMatrix, windowSize, sizeof(matrix_t), MPI_INFO_NULL, MPI_COMM_WORLD, &resultWindow);
+
+    MPI_Win_lock_all(0, counterWindow);
+    MPI_Win_lock_all(0, matrix1Window);
+    MPI_Win_lock_all(0, resultWindow);
+
+    std::vector<matrix_t> slab;
+    std::vector<matrix_t> resultSlab;
+    if (rank != 0) {
+        slab.resize(SCHEDULE_ROWS * size);
+        resultSlab.resize(SCHEDULE_ROWS * size);
+    }
+
+    while (true) {
+        // Claim the next block
+        int one = 1;
+        int block;
+        MPI_Fetch_and_op(&one, &block, MPI_INT, 0, 0, MPI_SUM, counterWindow);
+        MPI_Win_flush(0, counterWindow);
+
+        auto firstRow = block * SCHEDULE_ROWS;
+        if (firstRow >= size) {
+            break;
+        }
+
+        auto rows = std::min(SCHEDULE_ROWS, size - firstRow);
+        auto offset = firstRow * size;
+
+        // The root process works on its blocks in place
+        if (rank == 0) {
+            multiply_rows(&matrix1[offset], matrix2, &resultMatrix[offset], rows, size);
+            continue;
+        }
+
+        MPI_Get(slab.data(), rows * size, MPI_INT, 0, offset, rows * size, MPI_INT, matrix1Window);
+        MPI_Win_flush(0, matrix1Window);
+
+        multiply_rows(slab.data(), matrix2, resultSlab.data(), rows, size);
+
+        MPI_Put(resultSlab.data(), rows * size, MPI_INT, 0, offset, rows * size, MPI_INT, resultWindow);
+        MPI_Win_flush(0, resultWindow);
+    }
+
+    MPI_Win_unlock_all(resultWindow);
+    MPI_Win_unlock_all(matrix1Window);
+    MPI_Win_unlock_all(counterWindow);
+
+    // Freeing the windows waits for every process, so all of the results are in once it returns.
+    MPI_Win_free(&resultWindow);
+    MPI_Win_free(&matrix1Window);
+    MPI_Win_free(&counterWindow);
+}
+
 // Multiplies two vectors using MPI
 // The second matrix will be transposed and broadcast, then the rows of the first matrix are spread between all the
-// processes in the MPI group.
-void multiply(int rank, int matrix1[], int matrix2[], int resultMatrix[], my_size_t size) {
-#ifndef UNCOUNTED_TRANSPOSE
+// processes in the MPI group. With PACKED_MULTIPLY the second matrix is broadcast as is, and packed panel by panel.
+void row_multiply(int rank, int matrix1[], int matrix2[], int resultMatrix[], my_size_t size) {
+#if !defined(UNCOUNTED_TRANSPOSE) && !defined(PACKED_MULTIPLY)
     // Transpose matrix 2 in the root process.
     if (rank == 0) {
         // Transpose the matrix to make the multiplication easier, ideally it would keep the matrix in the cache more readily.
@@ -174,17 +1310,53 @@ void multiply(int rank, int matrix1[], int matrix2[], int resultMatrix[], my_siz
     }
 #endif
 
+#ifdef COMPACT_TRANSFER
+    // Only send the compact form of the input matrices if every element of both of them fits in it.
+    int compact = rank == 0 && fits_compact(matrix1, size * size) && fits_compact(matrix2, size * size);
+    MPI::COMM_WORLD.Bcast(&compact, 1, MPI::INT, 0);
+#else
+    int compact = false;
+#endif
+
+#ifdef SHARED_MATRIX2
+    // Share matrix2 between the processes on each node, only broadcasting it between nodes
+    auto shared = share_matrix(rank, matrix2, size * size, compact);
+    matrix2 = shared.data;
+#else
+    // Only the root process holds the full matrices, the others allocate their own copy of matrix2 to broadcast into.
+    std::vector<matrix_t> matrix2Copy;
+    if (rank != 0) {
+        matrix2Copy.resize(size * size);
+        matrix2 = matrix2Copy.data();
+    }
+
     // Broadcast matrix2
-    MPI::COMM_WORLD.Bcast(matrix2, size * size, MPI::INT, 0);
+    broadcast_matrix(rank, matrix2, size * size, compact);
+#endif
 
+#ifdef DYNAMIC_SCHEDULE
+    // Claim blocks of rows from the root process until they have all been multiplied
+    dynamic_multiply(rank, matrix1, matrix2, resultMatrix, size);
+#else
     // Init the counts and displs arrays
     auto groupSize = MPI::COMM_WORLD.Get_size();
     int counts[groupSize];
     int displs[groupSize];
 
+#ifdef CALIBRATED_SPLIT
+    // Time a test block on every process, so the rows can be split up by how fast each of them is
+    auto throughput = calibrate(matrix2, size);
+    std::vector<double> throughputs(groupSize);
+    MPI::COMM_WORLD.Gather(&throughput, 1, MPI::DOUBLE, throughputs.data(), 1, MPI::DOUBLE, 0);
+#endif
+
     // Set up the counts and displs matrix if this is the root node
     if (rank == 0) {
+#ifdef CALIBRATED_SPLIT
+        setup_weighted_scatter_arrays(size, groupSize, throughputs.data(), counts, displs);
+#else
         setup_scatter_arrays(size, groupSize, counts, displs);
+#endif
 
 #ifdef DEBUG
         print_var("groupSize", groupSize);
@@ -196,16 +1368,111 @@ void multiply(int rank, int matrix1[], int matrix2[], int resultMatrix[], my_siz
     // Broadcast the counts matrix
     MPI::COMM_WORLD.Bcast(counts, groupSize, MPI::INT, 0);
 
+    // Allocate the slabs of matrix1 and the result for the rows this process gets, the root process works on its
+    // rows in place at the start of the full matrices.
+    std::vector<matrix_t> slabBuffer;
+    std::vector<matrix_t> resultBuffer;
+    if (rank != 0) {
+        slabBuffer.resize(counts[rank]);
+        resultBuffer.resize(counts[rank]);
+    }
+    auto *slab = rank == 0 ? matrix1 : slabBuffer.data();
+    auto *resultSlab = rank == 0 ? resultMatrix : resultBuffer.data();
+
+#ifdef PIPELINED_TRANSFER
+    // Send out, multiply and send back the rows in chunks that overlap each other
+    pipelined_multiply(rank, matrix1, matrix2, resultMatrix, slab, resultSlab, counts, displs, size);
+#else
     // Scatter matrix one across all the processes
-    MPI::COMM_WORLD.Scatterv(matrix1, counts, displs, MPI::INT, matrix1, size * size, MPI::INT, 0);
+    scatter_matrix(rank, matrix1, slab, counts, displs, size, compact);
 
-    // Loop through all the rows in the received first matrix, multiplying it all
-    for (int i = 0; i < counts[rank] / size; i++) {
-        matrix_vector_multiply(&matrix1[i * size], matrix2, &resultMatrix[i * size], size);
-    }
+    multiply_rows(slab, matrix2, resultSlab, counts[rank] / size, size);
 
     // Collect the results back
-    MPI::COMM_WORLD.Gatherv(resultMatrix, counts[rank], MPI::INT, resultMatrix, counts, displs, MPI::INT, 0);
+    if (rank == 0) {
+        MPI::COMM_WORLD.Gatherv(MPI::IN_PLACE, counts[rank], MPI::INT, resultMatrix, counts, displs, MPI::INT, 0);
+    } else {
+        MPI::COMM_WORLD.Gatherv(resultSlab, counts[rank], MPI::INT, nullptr, counts, displs, MPI::INT, 0);
+    }
+#endif
+#endif
+
+#ifdef SHARED_MATRIX2
+    free_shared_matrix(shared);
+#endif
+}
+
+// Multiplies two matrices using MPI, on a 2D grid of processes with GRID_MULTIPLY or by splitting up the rows of
+// matrix1 without it.
+void multiply(int rank, int matrix1[], int matrix2[], int resultMatrix[], my_size_t size) {
+#ifdef GRID_MULTIPLY
+    grid_multiply(rank, matrix1, matrix2, resultMatrix, size);
+#else
+    row_multiply(rank, matrix1, matrix2, resultMatrix, size);
+#endif
+}
+
+// Reads count elements of a matrix file into a buffer, starting at the given element.
+// Every process reads its part at the same time, so MPI-IO can combine them into fewer, larger reads.
+void read_elements(const char *fileName, matrix_t buffer[], my_size_t offset, my_size_t count) {
+    auto file = MPI::File::Open(MPI::COMM_WORLD, fileName, MPI::MODE_RDONLY, MPI::INFO_NULL);
+    file.Read_at_all((MPI::Offset)offset * sizeof(matrix_t), buffer, count, MPI::INT);
+    file.Close();
+}
+
+// Writes count elements from a buffer into a matrix file of total elements, starting at the given element.
+// Every process writes its part at the same time, so MPI-IO can combine them into fewer, larger writes.
+void write_elements(const char *fileName, const matrix_t buffer[], my_size_t offset, my_size_t count, my_size_t total) {
+    auto file = MPI::File::Open(MPI::COMM_WORLD, fileName, MPI::MODE_CREATE | MPI::MODE_WRONLY, MPI::INFO_NULL);
+    // An existing file could be bigger, from a run with larger matrices, so it is cut down to size first
+    file.Set_size((MPI::Offset)total * sizeof(matrix_t));
+    file.Write_at_all((MPI::Offset)offset * sizeof(matrix_t), buffer, count, MPI::INT);
+    file.Close();
+}
+
+// Makes sure there is an input matrix of the right size in the given file, randomising one if there is not.
+// Each process randomises and writes its own rows, so the root process never has to hold all of it.
+void prepare_input_file(int rank, const char *fileName, const int counts[], const int displs[], my_size_t size) {
+    int ready = rank == 0 && (std::streamoff)std::ifstream(fileName, std::ios::binary | std::ios::ate).tellg() ==
+        (std::streamoff)(size * size * sizeof(matrix_t));
+    MPI::COMM_WORLD.Bcast(&ready, 1, MPI::INT, 0);
+
+    if (ready) {
+        return;
+    }
+
+    std::vector<matrix_t> rows(counts[rank]);
+    randomise_rows(rows.data(), counts[rank] / size, size);
+    write_elements(fileName, rows.data(), displs[rank], counts[rank], size * size);
+}
+
+// Multiplies the matrices in MATRIX1_FILE and MATRIX2_FILE into RESULT_FILE using MPI-IO.
+// Each process reads its own rows of matrix1 and all of matrix2 straight from the files, then writes its rows of the
+// result straight into the result file, so none of the matrices have to go through the root process.
+void file_multiply(int rank, my_size_t size) {
+    // Every process works out the same split of the rows, so it does not need to be sent around.
+    auto groupSize = MPI::COMM_WORLD.Get_size();
+    int counts[groupSize];
+    int displs[groupSize];
+    setup_scatter_arrays(size, groupSize, counts, displs);
+
+    prepare_input_file(rank, MATRIX1_FILE, counts, displs, size);
+    prepare_input_file(rank, MATRIX2_FILE, counts, displs, size);
+
+    std::vector<matrix_t> slab(counts[rank]);
+    std::vector<matrix_t> matrix2(size * size);
+    std::vector<matrix_t> resultSlab(counts[rank]);
+    read_elements(MATRIX1_FILE, slab.data(), displs[rank], counts[rank]);
+    read_elements(MATRIX2_FILE, matrix2.data(), 0, size * size);
+
+#ifndef PACKED_MULTIPLY
+    // Transpose matrix2 to multiply the rows against, each process working on its own copy.
+    transpose_matrix(matrix2.data(), size);
+#endif
+
+    multiply_rows(slab.data(), matrix2.data(), resultSlab.data(), counts[rank] / size, size);
+
+    write_elements(RESULT_FILE, resultSlab.data(), displs[rank], counts[rank], size * size);
 }
 
 int main(int argc, char *argv[])
@@ -231,10 +1498,32 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    // Initialise the matrices
-    auto *matrix1 = new matrix_t[size * size]();
-    auto *matrix2 = new matrix_t[size * size]();
-    auto *resultMatrix = new matrix_t[size * size]();
+#ifdef FILE_IO
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Multiply the matrices in the files, the root process does not hold any of them
+        file_multiply(rank, size);
+
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start);
+        std::cout << std::endl << (rank == 0 ? "Total Time Taken: " : "Node Total Time Taken: ") << duration.count()
+                  << " microseconds" << std::endl;
+
+        MPI::Finalize();
+        return 0;
+    }
+#endif
+
+    // Initialise the matrices, only the root process holds all of them.
+    // The other processes allocate just what they get sent once the work has been split up.
+    matrix_t *matrix1 = nullptr;
+    matrix_t *matrix2 = nullptr;
+    matrix_t *resultMatrix = nullptr;
+    if (rank == 0) {
+        matrix1 = new matrix_t[size * size];
+        matrix2 = new matrix_t[size * size];
+        resultMatrix = new matrix_t[size * size];
+    }
 
     // If the process is root, then randomise the matrix and then start the multiplication, or just start the multiplication
     if (rank == 0) {
@@ -248,7 +1537,7 @@ int main(int argc, char *argv[])
         print_matrix("matrix2", matrix2, size);
 #endif
 
-#ifdef UNCOUNTED_TRANSPOSE
+#if defined(UNCOUNTED_TRANSPOSE) && !defined(PACKED_MULTIPLY) && !defined(GRID_MULTIPLY)
         // Transpose the matrix to make the multiplication easier, ideally it would keep the matrix in the cache more readily.
         transpose_matrix(matrix2, size);
 #endif